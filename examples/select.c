@@ -29,29 +29,28 @@ chan_declare(mm, char, char);
 chan_define(mm, char, char);
 
 proc void choose(chan_t(int) *chn1, chan_t(char) *chn2) {
+  int num;
+  char chr;
+
   srand(time(NULL));
 
-  /* We can make the simulation of `select` in golang. The only drawback of this
-   * simulation is the priority. We always check the channels by the order of
-   * which we write in the source code. But it's enough in most cases. */
   while (true) {
-    bool ok = false;
+    chr = 'a' + rand() % 26;
 
-    int num;
-    if (csp_chan_try_pop(chn1, &num)) {
-      printf("chn1 received number %d\n", num);
-      ok = true;
-    }
-
-    if (csp_chan_try_push(chn2, rand() & 0x7f)) {
-      ok = true;
-    }
+    select_case_t cases[] = {
+      select_case_recv(chn1, &num),
+      select_case_send(chn2, &chr),
+    };
 
-    /* If all channels failed, it's up to you to give up the control of the CPU
-     * or break the loop or do some other things. Actually it's the `default`
-     * case of the `select`. */
-    if (!ok) {
-      yield();
+    /* The process sleeps until one of the cases is ready or it timeouts. */
+    switch (csp_select(cases, 2, timer_second)) {
+      case 0:
+        printf("chn1 received number %d\n", num);
+        break;
+      case 1:
+        break;
+      default:
+        printf("timeout\n");
     }
   }
 }
@@ -15,14 +15,21 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <fcntl.h>
 #include <getopt.h>
+#include <iomanip>
 #include <iostream>
 #include <string>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <vector>
 #include "fs.hpp"
 #include "sa.hpp"
+#include "../src/acct.h"
 
 namespace csp {
 
@@ -67,6 +74,9 @@ const std::string cli_usage = (
   "      --max-procs-hint:                                                   \n"
   "        The hint of the max processes. Libcsp will initialize related     \n"
   "        resource according to it. Default is 100000.                      \n"
+  "      --mem-retained-pages:                                               \n"
+  "        The max free pages each CPU core retains. Free pages beyond it    \n"
+  "        will be returned to the OS. Default is 4096(16MB).                \n"
   "                                                                          \n"
   "  clean:                                                                  \n"
   "    Clear related generated files in the working directory.               \n"
@@ -75,6 +85,19 @@ const std::string cli_usage = (
   "      --working-dir:                                                      \n"
   "        The working directory. Default is /tmp/libcsp/.                   \n"
   "                                                                          \n"
+  "  top:                                                                    \n"
+  "    Display the process functions which eat the CPU of a running program  \n"
+  "    like `top`. The program should be built with libcsp configured with   \n"
+  "    `--enable-proc-accounting`.                                           \n"
+  "                                                                          \n"
+  "    Options:                                                              \n"
+  "      --pid:                                                              \n"
+  "        The pid of the running program. It's required.                    \n"
+  "      --interval:                                                         \n"
+  "        The refreshing interval in seconds. Default is 1.                 \n"
+  "      --count:                                                            \n"
+  "        The times to refresh before exiting. Default is 0(forever).       \n"
+  "                                                                          \n"
   "  version:                                                                \n"
   "    Display the cspcli version.                                           \n"
 );
@@ -84,12 +107,14 @@ const std::string cli_version     = "0.0.2";
 const std::string cli_cmd_init    = "init";
 const std::string cli_cmd_analyze = "analyze";
 const std::string cli_cmd_clean   = "clean";
+const std::string cli_cmd_top     = "top";
 const std::string cli_cmd_version = "version";
 
 typedef enum {
   cli_cmd_type_init = 1,
   cli_cmd_type_analyze,
   cli_cmd_type_clean,
+  cli_cmd_type_top,
   cli_cmd_type_version,
 } cli_cmd_type_t;
 
@@ -97,6 +122,7 @@ std::unordered_map<std::string, cli_cmd_type_t> cli_cmd_types = {
   {cli_cmd_init,          cli_cmd_type_init},
   {cli_cmd_analyze,       cli_cmd_type_analyze},
   {cli_cmd_clean,         cli_cmd_type_clean},
+  {cli_cmd_top,           cli_cmd_type_top},
   {cli_cmd_version,       cli_cmd_type_version},
 };
 
@@ -104,6 +130,13 @@ struct option cli_cmd_init_and_clean_options[] = {
   {"working-dir",         optional_argument, NULL, 0},
 };
 
+struct option cli_cmd_top_options[] = {
+  {"pid",                 optional_argument, NULL, 0},
+  {"interval",            optional_argument, NULL, 0},
+  {"count",               optional_argument, NULL, 0},
+  {NULL,                  no_argument,       NULL, 0}
+};
+
 struct option cli_cmd_analyze_options[] = {
   /* Used to compile libcsp itself. */
   {"building-libcsp",     optional_argument, NULL, 0},
@@ -115,6 +148,7 @@ struct option cli_cmd_analyze_options[] = {
   {"cpu-cores",           optional_argument, NULL, 0},
   {"max-threads",         optional_argument, NULL, 0},
   {"max-procs-hint",      optional_argument, NULL, 0},
+  {"mem-retained-pages",  optional_argument, NULL, 0},
   {NULL,                  no_argument,       NULL, 0}
 };
 
@@ -132,6 +166,9 @@ public:
     case csp::cli_cmd_type_analyze:
       longopts = csp::cli_cmd_analyze_options;
       break;
+    case csp::cli_cmd_type_top:
+      longopts = csp::cli_cmd_top_options;
+      break;
     case csp::cli_cmd_type_version:
       return true;
     default:
@@ -165,6 +202,25 @@ public:
       case csp::cli_cmd_type_clean:
         options.working_dir = arg_val;
         break;
+      case csp::cli_cmd_type_top: {
+        std::stringstream ss(arg_val);
+        int64_t num;
+        if (!(ss >> num) || num < 0) {
+          break;
+        }
+        switch (idx) {
+        case 0:
+          this->top_pid = num;
+          break;
+        case 1:
+          this->top_interval = num > 0 ? num : 1;
+          break;
+        case 2:
+          this->top_count = num;
+          break;
+        }
+        break;
+      }
       case csp::cli_cmd_type_analyze:
         int64_t num;
         if (idx >= 4) {
@@ -199,6 +255,9 @@ public:
         case 7:
           options.max_procs_hint = num;
           break;
+        case 8:
+          options.mem_retained_pages = num;
+          break;
         }
       }
     }
@@ -252,9 +311,123 @@ public:
     closedir(dir);
   }
 
+  void top(void) {
+    if (this->top_pid <= 0) {
+      std::cerr << err_prefix << "option --pid is required." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), csp_acct_path_fmt, (int)this->top_pid);
+
+    struct stat st;
+    int fd = ::open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      std::cerr
+        << err_prefix << "failed to open " << path << ", make sure the "
+        << "program is built with libcsp configured with "
+        << "--enable-proc-accounting." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    auto header = (const csp_acct_header_t *)addr;
+    if (addr == MAP_FAILED || (size_t)st.st_size < sizeof(csp_acct_header_t) ||
+        header->magic != csp_acct_magic ||
+        (size_t)st.st_size < csp_acct_size(header->np, header->nfns)) {
+      std::cerr << err_prefix << "invalid file " << path << "." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    auto nfns = header->nfns;
+    std::vector<csp_acct_entry_t> prev(nfns), curr(nfns);
+    this->top_collect(header, prev);
+
+    bool is_tty = isatty(STDOUT_FILENO);
+    for (int64_t i = 0; this->top_count == 0 || i < this->top_count; i++) {
+      sleep(this->top_interval);
+      this->top_collect(header, curr);
+
+      /* Sort the functions by the running time in this interval. */
+      std::vector<size_t> fns;
+      for (size_t fn = 0; fn < nfns; fn++) {
+        if (curr[fn].created > 0) {
+          fns.push_back(fn);
+        }
+      }
+      std::sort(fns.begin(), fns.end(), [&](size_t a, size_t b) {
+        return curr[a].run_nanosecs - prev[a].run_nanosecs >
+          curr[b].run_nanosecs - prev[b].run_nanosecs;
+      });
+
+      if (is_tty) {
+        std::cout << "\033[H\033[2J";
+      }
+      std::cout
+        << std::left << std::setw(32) << "FUNCTION" << std::right
+        << std::setw(8) << "%CPU" << std::setw(12) << "LIVE"
+        << std::setw(12) << "CREATED/s" << std::setw(12) << "SWITCH/s"
+        << std::endl;
+
+      double interval = this->top_interval;
+      for (auto fn: fns) {
+        auto &c = curr[fn], &p = prev[fn];
+        std::cout
+          << std::left << std::setw(32) << csp_acct_names(header)[fn]
+          << std::right << std::fixed << std::setprecision(1)
+          << std::setw(8) << (c.run_nanosecs - p.run_nanosecs) / interval / 1e7
+          << std::setw(12) << c.created - c.destroyed
+          << std::setw(12) << (uint64_t)((c.created - p.created) / interval)
+          << std::setw(12) << (uint64_t)((c.switches - p.switches) / interval)
+          << std::endl;
+      }
+      std::cout << std::endl;
+      prev.swap(curr);
+    }
+    munmap(addr, st.st_size);
+  }
+
   void version(void) {
     std::cout << csp::cli_version << std::endl;
   }
+
+private:
+  /* The options of command `top`. */
+  int64_t top_pid = 0, top_interval = 1, top_count = 0;
+
+  /* Sum the counters of each function over all CPU processors, including the
+   * slices they are running. */
+  void top_collect(const csp_acct_header_t *header,
+      std::vector<csp_acct_entry_t> &sums) {
+    std::fill(sums.begin(), sums.end(), csp_acct_entry_t{0, 0, 0, 0});
+    for (size_t pid = 0; pid < header->np; pid++) {
+      auto entries = csp_acct_entries(header, pid);
+      for (size_t fn = 0; fn < header->nfns; fn++) {
+        sums[fn].created += entries[fn].created;
+        sums[fn].destroyed += entries[fn].destroyed;
+        sums[fn].switches += entries[fn].switches;
+        sums[fn].run_nanosecs += entries[fn].run_nanosecs;
+      }
+    }
+
+    /* Read the slices after the counters, a slice switched out in between is
+     * missed this time rather than counted twice. */
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t now = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    for (size_t pid = 0; pid < header->np; pid++) {
+      auto slice = &csp_acct_slices(header)[pid];
+      int64_t fn = __atomic_load_n(&slice->fn, __ATOMIC_ACQUIRE);
+      int64_t at = __atomic_load_n(&slice->at, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (fn < 0 || (uint64_t)fn >= header->nfns || at > now ||
+          __atomic_load_n(&slice->fn, __ATOMIC_RELAXED) != fn) {
+        continue;
+      }
+      sums[fn].run_nanosecs += now - at;
+    }
+  }
 };
 
 }
@@ -299,6 +472,9 @@ int main(int argc, char *argv[]) {
   case csp::cli_cmd_type_clean:
     cli.clean();
     break;
+  case csp::cli_cmd_type_top:
+    cli.top();
+    break;
   case csp::cli_cmd_type_version:
     cli.version();
     break;
@@ -32,6 +32,10 @@
 #include "fs.hpp"
 #include "namer.hpp"
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 namespace csp {
 
 const std::string call_graph_ext            = ".cg";
@@ -43,6 +47,7 @@ const std::string fn_csp_core_proc_exit     = "csp_core_proc_exit";
 
 const size_t default_max_threads            = 1024;
 const size_t default_max_procs_hint         = 100000;
+const size_t default_mem_retained_pages     = 4096;
 const size_t default_default_stack_size     = 1 << 11;
 
 const int flag_stack_by_user                = 0x01;
@@ -109,6 +114,7 @@ public:
   size_t cpu_cores;
   size_t max_threads;
   size_t max_procs_hint;
+  size_t mem_retained_pages;
 
   analyzer_options_t():
     is_building_libcsp(false),
@@ -118,7 +124,8 @@ public:
     default_stack_size(default_default_stack_size),
     cpu_cores(0),
     max_threads(default_max_threads),
-    max_procs_hint(default_max_procs_hint)
+    max_procs_hint(default_max_procs_hint),
+    mem_retained_pages(default_mem_retained_pages)
   {}
 };
 
@@ -221,10 +228,23 @@ public:
 
       /* The size of `csp_proc_t`. Cause we make %rbp to be 16-bytes alignment,
        * so we add extra 8-bytes if `sizeof(csp_procs_t) % 16 != 0`. */
-      size_t csp_proc_t_size = 22 << 3;
+#ifdef csp_enable_proc_accounting
+      size_t csp_proc_t_size = 28 << 3;
+#else
+      size_t csp_proc_t_size = 24 << 3;
+#endif
+#ifdef csp_enable_stack_guard
+      csp_proc_t_size += 1 << 3;
+#endif
 
       /* All parts of the process plus 8-bytes call instruction space. */
       su.max_stack_size += su.proc_reserved + csp_proc_t_size + 8;
+
+#ifdef csp_enable_preemption
+      /* The space used to save the registers when the process is preempted,
+       * see `csp_preempt_stack_reserve` in `src/preempt.h`. */
+      su.max_stack_size += 1 << 12;
+#endif
     }
 
     this->gen_config(wrapper_funcs);
@@ -552,6 +572,7 @@ private:
     auto cpu_cores = this->options.cpu_cores;
     auto max_threads = this->options.max_threads;
     auto max_procs_hint = this->options.max_procs_hint;
+    auto mem_retained_pages = this->options.mem_retained_pages;
 
     file
       << "// Configure file generated by libcsp cli." << std::endl
@@ -561,6 +582,8 @@ private:
       << "size_t csp_cpu_cores = " << cpu_cores << ";" << std::endl
       << "size_t csp_max_threads = " << max_threads << ";" << std::endl
       << "size_t csp_max_procs_hint = " << max_procs_hint << ";" << std::endl
+      << "size_t csp_mem_retained_pages = " << mem_retained_pages << ";"
+      << std::endl
       << "size_t csp_procs_num = " << total << ";" << std::endl;
 
     file << "size_t csp_procs_size[] = {";
@@ -578,6 +601,13 @@ private:
     }
     file << "};" << std::endl;
 
+    /* The names of the wrapper functions, used by the process accounting. */
+    file << "const char *csp_procs_name[] = {";
+    for (decltype(total) id = 0; id < total; id++) {
+      file << "\"" << wrapper_funcs[id] << "\", ";
+    }
+    file << "};" << std::endl;
+
     file.close();
   }
 
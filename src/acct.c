@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "acct.h"
+#include "core.h"
+#include "timer.h"
+
+#ifdef csp_enable_proc_accounting
+
+/* Total processes generated by libcsp plugin. */
+extern size_t csp_procs_num;
+/* The names of the wrapper functions generated by libcsp cli. */
+extern const char *csp_procs_name[];
+
+extern int csp_sched_np;
+extern _Thread_local csp_core_t *csp_this_core;
+
+/* The sequence used to generate the process ids on each CPU processor. */
+typedef struct {
+  uint64_t next;
+  char _[56];
+} csp_acct_seq_t;
+
+static csp_acct_header_t *csp_acct;
+static csp_acct_seq_t *csp_acct_seqs;
+static char csp_acct_path[64];
+
+static void csp_acct_unlink(void) {
+  unlink(csp_acct_path);
+}
+
+/* Map the shared memory segment so that `cspcli top` can attach to us. We fall
+ * back to the private memory if failed, the counters are still available in
+ * `csp_acct_dump`. */
+static csp_acct_header_t *csp_acct_map(size_t size) {
+  snprintf(csp_acct_path, sizeof(csp_acct_path), csp_acct_path_fmt, getpid());
+
+  int fd = open(csp_acct_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd != -1) {
+    void *addr = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+      addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (addr != MAP_FAILED) {
+      atexit(csp_acct_unlink);
+      return (csp_acct_header_t *)addr;
+    }
+    unlink(csp_acct_path);
+  }
+  return (csp_acct_header_t *)calloc(1, size);
+}
+
+bool csp_acct_init(void) {
+  size_t np = csp_sched_np, nfns = csp_procs_num;
+
+  csp_acct_seqs = (csp_acct_seq_t *)aligned_alloc(
+    sizeof(csp_acct_seq_t), sizeof(csp_acct_seq_t) * np
+  );
+  csp_acct = csp_acct_map(csp_acct_size(np, nfns));
+  if (csp_acct_seqs == NULL || csp_acct == NULL) {
+    return false;
+  }
+  memset(csp_acct_seqs, 0, sizeof(csp_acct_seq_t) * np);
+
+  csp_acct->np = np;
+  csp_acct->nfns = nfns;
+  csp_acct->started_at = csp_timer_now();
+  for (size_t i = 0; i < nfns; i++) {
+    strncpy(csp_acct_names(csp_acct)[i], csp_procs_name[i],
+      csp_acct_name_max - 1);
+  }
+  for (size_t pid = 0; pid < np; pid++) {
+    csp_acct_slices(csp_acct)[pid].fn = -1;
+  }
+
+  /* Publish the header at last, the readers check it first. */
+  __atomic_store_n(&csp_acct->magic, csp_acct_magic, __ATOMIC_RELEASE);
+  return true;
+}
+
+void csp_acct_proc_new(size_t pid, csp_proc_t *proc, int fn) {
+  proc->acct.id = csp_acct_seqs[pid].next++ * csp_sched_np + pid;
+  proc->acct.fn = fn;
+  proc->acct.created_at = csp_timer_now();
+  proc->acct.run_nanosecs = 0;
+  proc->acct.switches = 0;
+  csp_acct_entries(csp_acct, pid)[fn].created++;
+}
+
+/* Count the time the process switched to last time ran. */
+void csp_acct_switch_out(csp_core_t *core) {
+  csp_proc_t *proc = core->acct.proc;
+  if (proc == NULL) {
+    return;
+  }
+
+  int64_t elapsed = csp_timer_now() - core->acct.at;
+  proc->acct.run_nanosecs += elapsed;
+  csp_acct_entries(csp_acct, core->pid)[proc->acct.fn].run_nanosecs += elapsed;
+  __atomic_store_n(&csp_acct_slices(csp_acct)[core->pid].fn, -1,
+    __ATOMIC_RELEASE);
+  core->acct.proc = NULL;
+}
+
+/* `proc` starts running on `core`, it's not a switch if it's the same one. */
+void csp_acct_switch_in(csp_core_t *core, csp_proc_t *proc) {
+  if (proc != core->acct.last) {
+    proc->acct.switches++;
+    csp_acct_entries(csp_acct, core->pid)[proc->acct.fn].switches++;
+    core->acct.last = proc;
+  }
+  core->acct.proc = proc;
+  core->acct.at = csp_timer_now();
+
+  /* Publish the slice so that the readers can count it before it ends. */
+  csp_acct_slice_t *slice = &csp_acct_slices(csp_acct)[core->pid];
+  __atomic_store_n(&slice->at, core->acct.at, __ATOMIC_RELAXED);
+  __atomic_store_n(&slice->fn, proc->acct.fn, __ATOMIC_RELEASE);
+}
+
+void csp_acct_proc_destroy(csp_proc_t *proc) {
+  csp_core_t *core = csp_this_core;
+  size_t pid = proc->borned_pid;
+
+  if (core != NULL) {
+    pid = core->pid;
+    if (core->acct.proc == proc) {
+      csp_acct_switch_out(core);
+    }
+    if (core->acct.last == proc) {
+      core->acct.last = NULL;
+    }
+  }
+  __atomic_fetch_add(&csp_acct_entries(csp_acct, pid)[proc->acct.fn].destroyed,
+    1, __ATOMIC_RELAXED);
+}
+
+#endif
+
+void csp_acct_dump(FILE *fp) {
+#ifdef csp_enable_proc_accounting
+  fprintf(fp, "%-32s %10s %12s %12s %14s\n",
+    "function", "live", "created", "switches", "run_ms");
+
+  for (size_t fn = 0; fn < csp_acct->nfns; fn++) {
+    csp_acct_entry_t sum = {0};
+    for (size_t pid = 0; pid < csp_acct->np; pid++) {
+      csp_acct_entry_t *entry = &csp_acct_entries(csp_acct, pid)[fn];
+      sum.created += entry->created;
+      sum.destroyed += entry->destroyed;
+      sum.switches += entry->switches;
+      sum.run_nanosecs += entry->run_nanosecs;
+    }
+    if (sum.created == 0) {
+      continue;
+    }
+    fprintf(fp, "%-32s %10lu %12lu %12lu %14lu\n",
+      csp_acct_names(csp_acct)[fn], sum.created - sum.destroyed, sum.created,
+      sum.switches, sum.run_nanosecs / 1000000);
+  }
+#else
+  fprintf(fp, "libcsp is not configured with --enable-proc-accounting.\n");
+#endif
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_ACCT_H
+#define LIBCSP_ACCT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* The path of the shared memory segment exported by process `pid`. */
+#define csp_acct_path_fmt   "/dev/shm/libcsp.%d"
+
+/* "libcsp02" */
+#define csp_acct_magic      0x323070736362696cULL
+
+/* The max length of the function names, including the '\0'. */
+#define csp_acct_name_max   64
+
+/*
+ * Layout of the shared memory segment is:
+ *
+ *  +--------+-----------------------+-------------------------------+
+ *  | Header | Names: [nfns][64]char | Running: [np]csp_acct_slice_t |
+ *  +--------+-----------------------+-------------------------------+
+ *  | Counters: [np][stride]csp_acct_entry_t                          |
+ *  +-----------------------------------------------------------------+
+ *
+ * The counters of a CPU processor are only written by the core running on it,
+ * and the readers(e.g. `cspcli top`) only take them as hints, so they are
+ * plain integers instead of atomic ones. The exception is `destroyed`, the
+ * processes may be destroyed outside of the cores(e.g. in the monitor), so it's
+ * always increased atomically.
+ */
+typedef struct {
+  uint64_t magic;
+
+  /* The number of CPU processors and process functions. */
+  uint64_t np, nfns;
+
+  /* The time the program started, in nanoseconds of CLOCK_REALTIME. */
+  int64_t started_at;
+
+  uint64_t _[4];
+} csp_acct_header_t;
+
+/* The counters of the processes of the same function on a CPU processor. */
+typedef struct {
+  /* The processes created and destroyed. */
+  uint64_t created, destroyed;
+
+  /* The times the processes were switched to and the time they ran. */
+  uint64_t switches, run_nanosecs;
+} csp_acct_entry_t;
+
+/* The slice a CPU processor is running, the counters only include the time of
+ * the slices switched out. `fn` is -1 if it runs nothing, and it's written
+ * after `at` so that the readers can check it before and after reading `at`. */
+typedef struct {
+  int64_t fn, at;
+  uint64_t _[6];
+} csp_acct_slice_t;
+
+/* The entries of each CPU processor are rounded up to 64 bytes so that they
+ * never share a cache line. */
+#define csp_acct_stride(nfns)       (((nfns) + 1) & ~(uint64_t)1)
+
+#define csp_acct_names(header)                                                 \
+  ((char (*)[csp_acct_name_max])((csp_acct_header_t *)(header) + 1))
+
+#define csp_acct_slices(header)                                                \
+  ((csp_acct_slice_t *)(csp_acct_names(header) + (header)->nfns))
+
+#define csp_acct_entries(header, pid)                                          \
+  ((csp_acct_entry_t *)(csp_acct_slices(header) + (header)->np) +             \
+    (pid) * csp_acct_stride((header)->nfns))
+
+#define csp_acct_size(np, nfns)                                                \
+  (sizeof(csp_acct_header_t) + csp_acct_name_max * (nfns) +                    \
+    sizeof(csp_acct_slice_t) * (np) +                                          \
+    sizeof(csp_acct_entry_t) * (np) * csp_acct_stride(nfns))
+
+/* Print the live, created processes, the switches and the running time of
+ * each process function to `fp`. It only works if libcsp is configured with
+ * `--enable-proc-accounting`. */
+void csp_acct_dump(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "chan.h"
+#include "core.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "waitq.h"
+
+#define csp_chan_item_at(items, i, size) ((char *)(items) + (i) * (size))
+
+extern _Thread_local csp_core_t *csp_this_core;
+
+/* Pop the first waiter we can wake up. The caller should hold the lock. */
+static csp_waiter_t *csp_chan_claim(csp_waitq_t *waitq) {
+  csp_waiter_t *waiter;
+  while ((waiter = csp_waitq_pop(waitq)) != NULL) {
+    if (csp_waiter_claim(waiter)) {
+      return waiter;
+    }
+  }
+  return NULL;
+}
+
+bool csp_chan_handoff_send(csp_chan_base_t *chan, void *item) {
+  csp_waiter_t *receiver = csp_chan_claim(&chan->receivers);
+  if (receiver == NULL) {
+    return false;
+  }
+  memcpy(receiver->item, item, chan->item_size);
+  receiver->done = true;
+  csp_waiter_wakeup(receiver);
+  return true;
+}
+
+bool csp_chan_handoff_recv(csp_chan_base_t *chan, void *item) {
+  csp_waiter_t *sender = csp_chan_claim(&chan->senders);
+  if (sender == NULL) {
+    return false;
+  }
+  memcpy(item, sender->item, chan->item_size);
+  sender->done = true;
+  csp_waiter_wakeup(sender);
+  return true;
+}
+
+bool csp_chan_unbuffered_try_push(csp_chan_base_t *chan, void *item) {
+  if (csp_waitq_len(&chan->receivers) == 0) {
+    return false;
+  }
+  csp_spinlock_lock(&chan->lock);
+  bool ok = csp_chan_handoff_send(chan, item);
+  csp_spinlock_unlock(&chan->lock);
+  return ok;
+}
+
+bool csp_chan_unbuffered_try_pop(csp_chan_base_t *chan, void *item) {
+  if (csp_waitq_len(&chan->senders) == 0) {
+    return false;
+  }
+  csp_spinlock_lock(&chan->lock);
+  bool ok = csp_chan_handoff_recv(chan, item);
+  csp_spinlock_unlock(&chan->lock);
+  return ok;
+}
+
+/* It succeeds only if there are `n` receivers waiting. */
+bool csp_chan_unbuffered_try_pushm(csp_chan_base_t *chan, void *items,
+    size_t n) {
+  if (n <= 1) {
+    return n == 0 || csp_chan_unbuffered_try_push(chan, items);
+  }
+  if (csp_waitq_len(&chan->receivers) < n) {
+    return false;
+  }
+
+  size_t cnt = 0;
+  csp_waiter_t *claimed = NULL, *receiver;
+
+  csp_spinlock_lock(&chan->lock);
+  while (cnt < n && (receiver = csp_chan_claim(&chan->receivers)) != NULL) {
+    receiver->next = claimed;
+    claimed = receiver;
+    cnt++;
+  }
+
+  bool ok = cnt == n;
+  while (claimed != NULL) {
+    receiver = claimed;
+    claimed = receiver->next;
+
+    if (ok) {
+      memcpy(receiver->item, csp_chan_item_at(items, --cnt, chan->item_size),
+        chan->item_size);
+      receiver->done = true;
+      csp_waiter_wakeup(receiver);
+    } else if (receiver->sel == NULL) {
+      /* Put it back, the claimed ones are in reversed order. */
+      csp_waitq_push_front(&chan->receivers, receiver);
+    } else {
+      /* The select has been claimed, let it try again. */
+      csp_waiter_wakeup(receiver);
+    }
+  }
+  csp_spinlock_unlock(&chan->lock);
+  return ok;
+}
+
+size_t csp_chan_unbuffered_try_popm(csp_chan_base_t *chan, void *items,
+    size_t n) {
+  if (n == 0 || csp_waitq_len(&chan->senders) == 0) {
+    return 0;
+  }
+
+  size_t cnt = 0;
+  csp_spinlock_lock(&chan->lock);
+  while (cnt < n && csp_chan_handoff_recv(
+      chan, csp_chan_item_at(items, cnt, chan->item_size))) {
+    cnt++;
+  }
+  csp_spinlock_unlock(&chan->lock);
+  return cnt;
+}
+
+void csp_chan_unbuffered_push(csp_chan_base_t *chan, void *item) {
+  csp_spinlock_lock(&chan->lock);
+  if (csp_chan_handoff_send(chan, item)) {
+    csp_spinlock_unlock(&chan->lock);
+    return;
+  }
+
+  /* Wait for a receiver to take the item away. */
+  csp_waiter_t waiter = {
+    .proc = csp_sched_running(), .sel = NULL, .item = item, .done = false
+  };
+  csp_waitq_push(&chan->senders, &waiter);
+  csp_sched_park(csp_waitq_unlock, &chan->lock);
+}
+
+void csp_chan_unbuffered_pop(csp_chan_base_t *chan, void *item) {
+  csp_spinlock_lock(&chan->lock);
+  if (csp_chan_handoff_recv(chan, item)) {
+    csp_spinlock_unlock(&chan->lock);
+    return;
+  }
+
+  /* Wait for a sender to give us the item. */
+  csp_waiter_t waiter = {
+    .proc = csp_sched_running(), .sel = NULL, .item = item, .done = false
+  };
+  csp_waitq_push(&chan->receivers, &waiter);
+  csp_sched_park(csp_waitq_unlock, &chan->lock);
+}
+
+void csp_chan_unbuffered_pushm(csp_chan_base_t *chan, void *items, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    csp_chan_unbuffered_push(chan,
+      csp_chan_item_at(items, i, chan->item_size));
+  }
+}
+
+void csp_chan_unbuffered_popm(csp_chan_base_t *chan, void *items, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    csp_chan_unbuffered_pop(chan, csp_chan_item_at(items, i, chan->item_size));
+  }
+}
@@ -23,57 +23,299 @@ extern "C" {
 #endif
 
 #include "rbq.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "waitq.h"
 
 #define csp_chan_t(I)                     csp_chan_t_ ## I
 #define csp_chan_new(I)                   csp_chan_new_ ## I
-#define csp_chan_try_push(c, item)        ((c)->try_push((c)->rbq, (item)))
-#define csp_chan_push(c, item)            ((c)->push((c)->rbq, (item)))
-#define csp_chan_try_pop(c, item)         ((c)->try_pop((c)->rbq, (item)))
-#define csp_chan_pop(c, item)             ((c)->pop((c)->rbq, (item)))
-#define csp_chan_try_pushm(c, items, n)   ((c)->try_pushm((c)->rbq, (items), n))
-#define csp_chan_pushm(c, items, n)       ((c)->pushm((c)->rbq, (items), n))
-#define csp_chan_try_popm(c, items, n)    ((c)->try_popm((c)->rbq, (items), n))
-#define csp_chan_popm(c, items, n)        ((c)->popm((c)->rbq, (items), n))
+#define csp_chan_try_push(c, item)        ((c)->try_push((c), (item)))
+#define csp_chan_push(c, item)            ((c)->push((c), (item)))
+#define csp_chan_try_pop(c, item)         ((c)->try_pop((c), (item)))
+#define csp_chan_pop(c, item)             ((c)->pop((c), (item)))
+#define csp_chan_try_pushm(c, items, n)   ((c)->try_pushm((c), (items), n))
+#define csp_chan_pushm(c, items, n)       ((c)->pushm((c), (items), n))
+#define csp_chan_try_popm(c, items, n)    ((c)->try_popm((c), (items), n))
+#define csp_chan_popm(c, items, n)        ((c)->popm((c), (items), n))
 #define csp_chan_destroy(c)                                                    \
-  do { (c)->destroy((c)->rbq); free(c); } while (0)                            \
+  do { (c)->destroy((c)->base.rbq); free(c); } while (0)                       \
+
+#define csp_chan_name(name, I)            csp_chan_ ## name ## _ ## I
+
+/* Pass it to `csp_chan_new` as `cap_exp` to create an unbuffered channel, in
+ * which a sender hands the item to a receiver directly. */
+#define csp_chan_unbuffered               ((size_t)-1)
+#define csp_chan_is_unbuffered(chan)      ((chan)->rbq == NULL)
+
+/*
+ * The blocking operations park the running proc in the `senders` or
+ * `receivers` waitq of the channel until `cond`, which is a non-blocking
+ * operation of the rbq, succeeds.
+ *
+ * The waiter checks `cond` again after it's in the waitq while the waker checks
+ * the waitq after its operation succeeded, and all of them are sequentially
+ * consistent atomic operations, so either the waiter sees the result of the
+ * waker or the waker sees the waiter, i.e. no wakeup will be lost.
+ */
+#define csp_chan_wait(chan, waitq, cond) do {                                  \
+  if (cond) {                                                                  \
+    break;                                                                     \
+  }                                                                            \
+  csp_waiter_t waiter = {.proc = csp_sched_running(), .sel = NULL};            \
+  do {                                                                         \
+    csp_spinlock_lock(&(chan)->lock);                                          \
+    csp_waitq_push(&(chan)->waitq, &waiter);                                   \
+    if (cond) {                                                                \
+      csp_waitq_remove(&(chan)->waitq, &waiter);                               \
+      csp_spinlock_unlock(&(chan)->lock);                                      \
+      break;                                                                   \
+    }                                                                          \
+    /* The lock will be released after the context of the proc is saved. */    \
+    csp_sched_park(csp_waitq_unlock, &(chan)->lock);                           \
+  } while (!(cond));                                                           \
+} while (0)                                                                    \
+
+/* Wake up at most `n` procs in the `senders` or `receivers` waitq. */
+#define csp_chan_wake(chan, waitq, n) do {                                     \
+  if (csp_unlikely(csp_waitq_len(&(chan)->waitq) > 0)) {                       \
+    size_t cnt = (n);                                                          \
+    csp_waiter_t *woken = NULL, *waiter;                                       \
+    csp_spinlock_lock(&(chan)->lock);                                          \
+    while (cnt > 0 && (waiter = csp_waitq_pop(&(chan)->waitq)) != NULL) {      \
+      /* Skip the select which has been woken up by others. */                 \
+      if (csp_waiter_claim(waiter)) {                                          \
+        waiter->next = woken;                                                  \
+        woken = waiter;                                                        \
+        cnt--;                                                                 \
+      }                                                                        \
+    }                                                                          \
+    csp_spinlock_unlock(&(chan)->lock);                                        \
+    /* The waiters are in the stacks of the parked procs, so we must get the   \
+     * next one before the proc is unparked. */                                \
+    while (woken != NULL) {                                                    \
+      waiter = woken;                                                          \
+      woken = waiter->next;                                                    \
+      csp_waiter_wakeup(waiter);                                               \
+    }                                                                          \
+  }                                                                            \
+} while (0)                                                                    \
+
+/* The type-independent part of the channels. */
+typedef struct {
+  /* The ring buffer, NULL if the channel is unbuffered. */
+  void *rbq;
+  csp_spinlock_t lock;
+  csp_waitq_t senders, receivers;
+  size_t item_size;
+
+  /* The non-blocking operations with type-erased item and without waking up
+   * the waiters, used by `csp_select`. */
+  bool (*try_push_raw)(void *rbq, void *item);
+  bool (*try_pop_raw)(void *rbq, void *item);
+} csp_chan_base_t;
+
+/* The operations of the unbuffered channels. `csp_chan_handoff_*` require the
+ * caller to hold the lock of the channel. */
+bool csp_chan_handoff_send(csp_chan_base_t *chan, void *item);
+bool csp_chan_handoff_recv(csp_chan_base_t *chan, void *item);
+bool csp_chan_unbuffered_try_push(csp_chan_base_t *chan, void *item);
+bool csp_chan_unbuffered_try_pop(csp_chan_base_t *chan, void *item);
+bool csp_chan_unbuffered_try_pushm(csp_chan_base_t *chan, void *items,
+    size_t n);
+size_t csp_chan_unbuffered_try_popm(csp_chan_base_t *chan, void *items,
+    size_t n);
+void csp_chan_unbuffered_push(csp_chan_base_t *chan, void *item);
+void csp_chan_unbuffered_pop(csp_chan_base_t *chan, void *item);
+void csp_chan_unbuffered_pushm(csp_chan_base_t *chan, void *items, size_t n);
+void csp_chan_unbuffered_popm(csp_chan_base_t *chan, void *items, size_t n);
 
 #define csp_chan_declare(K, T, I)                                              \
   csp_ ## K ## rbq_declare(T, I);                                              \
   typedef struct {                                                             \
-    void *rbq;                                                                 \
-    bool (*try_push)(void *rbq, T item);                                       \
-    bool (*try_pushm)(void *rbq, T *items, size_t n);                          \
-    bool (*try_pop)(void *rbq, T *item);                                       \
-    size_t (*try_popm)(void *rbq, T *, size_t n);                              \
-    void (*push)(void *rbq, T item);                                           \
-    void (*pushm)(void *rbq, T *item, size_t n);                               \
-    void (*pop)(void *rbq, T *item);                                           \
-    void (*popm)(void *rbq, T *item, size_t n);                                \
+    /* NOTE: This should be the first field, see `csp_select`. */              \
+    csp_chan_base_t base;                                                      \
+    bool (*try_push)(void *chan, T item);                                      \
+    bool (*try_pushm)(void *chan, T *items, size_t n);                         \
+    bool (*try_pop)(void *chan, T *item);                                      \
+    size_t (*try_popm)(void *chan, T *, size_t n);                             \
+    void (*push)(void *chan, T item);                                          \
+    void (*pushm)(void *chan, T *item, size_t n);                              \
+    void (*pop)(void *chan, T *item);                                          \
+    void (*popm)(void *chan, T *item, size_t n);                               \
     void (*destroy)(void *rbq);                                                \
   } csp_chan_t(I);                                                             \
   csp_chan_t(I) *csp_chan_new(I)(size_t cap_exp);                              \
 
 #define csp_chan_define(K, T, I)                                               \
   csp_ ## K ## rbq_define(T, I);                                               \
+                                                                               \
+  static bool csp_chan_name(try_push, I)(void *c, T item) {                    \
+    csp_chan_t(I) *chan = (csp_chan_t(I) *)c;                                  \
+    if (csp_ ## K ## rbq_try_push(I)(chan->base.rbq, item)) {                  \
+      csp_chan_wake(&chan->base, receivers, 1);                                \
+      return true;                                                             \
+    }                                                                          \
+    return false;                                                              \
+  }                                                                            \
+                                                                               \
+  static void csp_chan_name(push, I)(void *c, T item) {                        \
+    csp_chan_t(I) *chan = (csp_chan_t(I) *)c;                                  \
+    csp_chan_wait(&chan->base, senders,                                        \
+      csp_ ## K ## rbq_try_push(I)(chan->base.rbq, item));                     \
+    csp_chan_wake(&chan->base, receivers, 1);                                  \
+  }                                                                            \
+                                                                               \
+  static bool csp_chan_name(try_pop, I)(void *c, T *item) {                    \
+    csp_chan_t(I) *chan = (csp_chan_t(I) *)c;                                  \
+    if (csp_ ## K ## rbq_try_pop(I)(chan->base.rbq, item)) {                   \
+      csp_chan_wake(&chan->base, senders, 1);                                  \
+      return true;                                                             \
+    }                                                                          \
+    return false;                                                              \
+  }                                                                            \
+                                                                               \
+  static void csp_chan_name(pop, I)(void *c, T *item) {                        \
+    csp_chan_t(I) *chan = (csp_chan_t(I) *)c;                                  \
+    csp_chan_wait(&chan->base, receivers,                                      \
+      csp_ ## K ## rbq_try_pop(I)(chan->base.rbq, item));                      \
+    csp_chan_wake(&chan->base, senders, 1);                                    \
+  }                                                                            \
+                                                                               \
+  static bool csp_chan_name(try_pushm, I)(void *c, T *items, size_t n) {       \
+    csp_chan_t(I) *chan = (csp_chan_t(I) *)c;                                  \
+    if (csp_ ## K ## rbq_try_pushm(I)(chan->base.rbq, items, n)) {             \
+      csp_chan_wake(&chan->base, receivers, n);                                \
+      return true;                                                             \
+    }                                                                          \
+    return false;                                                              \
+  }                                                                            \
+                                                                               \
+  static void csp_chan_name(pushm, I)(void *c, T *items, size_t n) {           \
+    csp_chan_t(I) *chan = (csp_chan_t(I) *)c;                                  \
+    size_t chunk = csp_rbq_cap((csp_ ## K ## rbq_t(I) *)chan->base.rbq);       \
+    while (n > 0) {                                                            \
+      if (chunk > n) {                                                         \
+        chunk = n;                                                             \
+      }                                                                        \
+      if (chunk == 1) {                                                        \
+        csp_chan_wait(&chan->base, senders,                                    \
+          csp_ ## K ## rbq_try_push(I)(chan->base.rbq, *items));               \
+      } else if (!csp_ ## K ## rbq_try_pushm(I)(chan->base.rbq, items, chunk)) { \
+        chunk >>= 1;                                                           \
+        continue;                                                              \
+      }                                                                        \
+      csp_chan_wake(&chan->base, receivers, chunk);                            \
+      items += chunk;                                                          \
+      n -= chunk;                                                              \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static size_t csp_chan_name(try_popm, I)(void *c, T *items, size_t n) {      \
+    csp_chan_t(I) *chan = (csp_chan_t(I) *)c;                                  \
+    size_t len = csp_ ## K ## rbq_try_popm(I)(chan->base.rbq, items, n);       \
+    if (len > 0) {                                                             \
+      csp_chan_wake(&chan->base, senders, len);                                \
+    }                                                                          \
+    return len;                                                                \
+  }                                                                            \
+                                                                               \
+  static void csp_chan_name(popm, I)(void *c, T *items, size_t n) {            \
+    csp_chan_t(I) *chan = (csp_chan_t(I) *)c;                                  \
+    size_t len;                                                                \
+    while (n > 0) {                                                            \
+      csp_chan_wait(&chan->base, receivers,                                    \
+        (len = csp_ ## K ## rbq_try_popm(I)(chan->base.rbq, items, n)) > 0);   \
+      csp_chan_wake(&chan->base, senders, len);                                \
+      items += len;                                                            \
+      n -= len;                                                                \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static bool csp_chan_name(try_push_raw, I)(void *rbq, void *item) {          \
+    return csp_ ## K ## rbq_try_push(I)(rbq, *(T *)item);                      \
+  }                                                                            \
+                                                                               \
+  static bool csp_chan_name(try_pop_raw, I)(void *rbq, void *item) {           \
+    return csp_ ## K ## rbq_try_pop(I)(rbq, (T *)item);                        \
+  }                                                                            \
+                                                                               \
+  static bool csp_chan_name(try_push_unbuffered, I)(void *c, T item) {         \
+    return csp_chan_unbuffered_try_push(&((csp_chan_t(I) *)c)->base, &item);   \
+  }                                                                            \
+                                                                               \
+  static bool csp_chan_name(try_pushm_unbuffered, I)(void *c, T *items,        \
+      size_t n) {                                                              \
+    return csp_chan_unbuffered_try_pushm(&((csp_chan_t(I) *)c)->base, items,   \
+      n);                                                                      \
+  }                                                                            \
+                                                                               \
+  static bool csp_chan_name(try_pop_unbuffered, I)(void *c, T *item) {         \
+    return csp_chan_unbuffered_try_pop(&((csp_chan_t(I) *)c)->base, item);     \
+  }                                                                            \
+                                                                               \
+  static size_t csp_chan_name(try_popm_unbuffered, I)(void *c, T *items,       \
+      size_t n) {                                                              \
+    return csp_chan_unbuffered_try_popm(&((csp_chan_t(I) *)c)->base, items,    \
+      n);                                                                      \
+  }                                                                            \
+                                                                               \
+  static void csp_chan_name(push_unbuffered, I)(void *c, T item) {             \
+    csp_chan_unbuffered_push(&((csp_chan_t(I) *)c)->base, &item);              \
+  }                                                                            \
+                                                                               \
+  static void csp_chan_name(pushm_unbuffered, I)(void *c, T *items,            \
+      size_t n) {                                                              \
+    csp_chan_unbuffered_pushm(&((csp_chan_t(I) *)c)->base, items, n);          \
+  }                                                                            \
+                                                                               \
+  static void csp_chan_name(pop_unbuffered, I)(void *c, T *item) {             \
+    csp_chan_unbuffered_pop(&((csp_chan_t(I) *)c)->base, item);                \
+  }                                                                            \
+                                                                               \
+  static void csp_chan_name(popm_unbuffered, I)(void *c, T *items,             \
+      size_t n) {                                                              \
+    csp_chan_unbuffered_popm(&((csp_chan_t(I) *)c)->base, items, n);           \
+  }                                                                            \
+                                                                               \
   csp_chan_t(I) *csp_chan_new(I)(size_t cap_exp) {                             \
     csp_chan_t(I) *chan = (csp_chan_t(I) *)malloc(sizeof(csp_chan_t(I)));      \
     if (chan == NULL) {                                                        \
       return NULL;                                                             \
     }                                                                          \
-    chan->rbq = csp_ ## K ## rbq_new(I)(cap_exp);                              \
-    if (chan->rbq == NULL) {                                                   \
+    csp_spinlock_init(&chan->base.lock);                                       \
+    csp_waitq_init(&chan->base.senders);                                       \
+    csp_waitq_init(&chan->base.receivers);                                     \
+    chan->base.item_size = sizeof(T);                                          \
+    chan->base.try_push_raw = csp_chan_name(try_push_raw, I);                  \
+    chan->base.try_pop_raw  = csp_chan_name(try_pop_raw, I);                   \
+    chan->destroy = csp_ ## K ## rbq_destroy(I);                               \
+                                                                               \
+    if (cap_exp == csp_chan_unbuffered) {                                      \
+      chan->base.rbq  = NULL;                                                  \
+      chan->try_push  = csp_chan_name(try_push_unbuffered, I);                 \
+      chan->try_pushm = csp_chan_name(try_pushm_unbuffered, I);                \
+      chan->try_pop   = csp_chan_name(try_pop_unbuffered, I);                  \
+      chan->try_popm  = csp_chan_name(try_popm_unbuffered, I);                 \
+      chan->push      = csp_chan_name(push_unbuffered, I);                     \
+      chan->pushm     = csp_chan_name(pushm_unbuffered, I);                    \
+      chan->pop       = csp_chan_name(pop_unbuffered, I);                      \
+      chan->popm      = csp_chan_name(popm_unbuffered, I);                     \
+      return chan;                                                             \
+    }                                                                          \
+                                                                               \
+    chan->base.rbq = csp_ ## K ## rbq_new(I)(cap_exp);                         \
+    if (chan->base.rbq == NULL) {                                              \
       free(chan);                                                              \
       return NULL;                                                             \
     }                                                                          \
-    chan->try_push  = csp_ ## K ## rbq_try_push(I);                            \
-    chan->try_pushm = csp_ ## K ## rbq_try_pushm(I);                           \
-    chan->try_pop   = csp_ ## K ## rbq_try_pop(I);                             \
-    chan->try_popm  = csp_ ## K ## rbq_try_popm(I);                            \
-    chan->push      = csp_ ## K ## rbq_push(I);                                \
-    chan->pushm     = csp_ ## K ## rbq_pushm(I);                               \
-    chan->pop       = csp_ ## K ## rbq_pop(I);                                 \
-    chan->popm      = csp_ ## K ## rbq_popm(I);                                \
-    chan->destroy   = csp_ ## K ## rbq_destroy(I);                             \
+    chan->try_push  = csp_chan_name(try_push, I);                              \
+    chan->try_pushm = csp_chan_name(try_pushm, I);                             \
+    chan->try_pop   = csp_chan_name(try_pop, I);                               \
+    chan->try_popm  = csp_chan_name(try_popm, I);                              \
+    chan->push      = csp_chan_name(push, I);                                  \
+    chan->pushm     = csp_chan_name(pushm, I);                                 \
+    chan->pop       = csp_chan_name(pop, I);                                   \
+    chan->popm      = csp_chan_name(popm, I);                                  \
     return chan;                                                               \
   }                                                                            \
 
@@ -22,41 +22,82 @@
 extern "C" {
 #endif
 
+#include <linux/futex.h>
 #include <stdatomic.h>
-#include "timer.h"
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "common.h"
 
 #define csp_cond_signal_none       0
 #define csp_cond_signal_proc_avail 1
-#define csp_cond_signal_deep_sleep 2
 
+/* The bounds of the adaptive spinning before parking the thread. */
+#define csp_cond_spin_min (1 << 6)
+#define csp_cond_spin_max (1 << 12)
+
+#define csp_cond_futex(addr, op, val)                                          \
+  syscall(SYS_futex, (int *)(addr), (op), (val), NULL, NULL, 0)                \
+
+/*
+ * `csp_cond_t` is used by an idle core to wait for new procs. The waiter spins
+ * for a while first and then parks the thread in futex. The spinning budget
+ * grows when a signal arrives during spinning and shrinks when it doesn't, so
+ * the cores of a busy program rarely enter the kernel while the idle cores of a
+ * quiet program soon sleep instead of burning CPU.
+ */
 typedef struct {
   atomic_int stat;
-  atomic_bool waiting;
-  csp_timer_time_t start;
+
+  /* Whether the waiter is (about to be) sleeping in futex. */
+  atomic_bool parked;
+
+  /* Current spinning budget, only accessed by the waiter. */
+  int spins;
+
+  /* Whether the waiter slept in futex in its last wait, only accessed by the
+   * waiter. */
+  bool slept;
 } csp_cond_t;
 
 #define csp_cond_init(cond) do {                                               \
   atomic_store(&(cond)->stat, csp_cond_signal_none);                           \
-  atomic_store(&(cond)->waiting, false);                                       \
-  (cond)->start = 0;                                                           \
-} while (0)                                                                    \
-
-#define csp_cond_before_wait(cond) do {                                        \
-  (cond)->start = csp_timer_now();                                             \
+  atomic_store(&(cond)->parked, false);                                        \
+  (cond)->spins = csp_cond_spin_max;                                           \
+  (cond)->slept = false;                                                       \
 } while (0)                                                                    \
 
 #define csp_cond_wait(cond) ({                                                 \
-  int signal;                                                                  \
-  while ((signal = atomic_load(&(cond)->stat)) == csp_cond_signal_none) {      \
-    atomic_store(&(cond)->waiting, true);                                      \
+  int signal, spins = (cond)->spins;                                           \
+  (cond)->slept = false;                                                       \
+  while ((signal = atomic_load(&(cond)->stat)) == csp_cond_signal_none &&      \
+      spins-- > 0) {                                                           \
+    csp_cpu_relax();                                                           \
   }                                                                            \
-  csp_cond_init(cond);                                                         \
+  if (signal == csp_cond_signal_none) {                                        \
+    if ((cond)->spins > csp_cond_spin_min) {                                   \
+      (cond)->spins >>= 1;                                                     \
+    }                                                                          \
+    /* Pairs with `csp_cond_signal`, either the signaler sees `parked` or we   \
+     * see the new `stat`. */                                                  \
+    atomic_store(&(cond)->parked, true);                                       \
+    (cond)->slept = true;                                                      \
+    while ((signal = atomic_load(&(cond)->stat)) == csp_cond_signal_none) {    \
+      csp_cond_futex(&(cond)->stat, FUTEX_WAIT_PRIVATE, csp_cond_signal_none); \
+    }                                                                          \
+    atomic_store(&(cond)->parked, false);                                      \
+  } else if ((cond)->spins < csp_cond_spin_max) {                              \
+    (cond)->spins <<= 1;                                                       \
+  }                                                                            \
+  atomic_store(&(cond)->stat, csp_cond_signal_none);                           \
   signal;                                                                      \
 })                                                                             \
 
 #define csp_cond_signal(cond, signal) do {                                     \
-  while (!atomic_load(&(cond)->waiting));                                      \
   atomic_store(&(cond)->stat, (signal));                                       \
+  if (atomic_load(&(cond)->parked)) {                                          \
+    csp_cond_futex(&(cond)->stat, FUTEX_WAKE_PRIVATE, 1);                      \
+  }                                                                            \
 } while(0)                                                                     \
 
 #ifdef __cplusplus
@@ -18,6 +18,9 @@
 #include <time.h>
 #include "common.h"
 #include "core.h"
+#include "preempt.h"
+#include "stats.h"
+#include "trace.h"
 
 #define csp_core_anchor_load(reg)                                              \
   "mov (%"reg"),     %rbp\n"                                                   \
@@ -30,24 +33,46 @@ extern csp_proc_t *csp_sched_get(csp_core_t *this_core);
 extern void csp_sched_put_proc(csp_proc_t *proc);
 extern bool csp_core_pools_get(size_t pid, csp_core_t **core);
 extern void csp_core_pools_put(csp_core_t *core);
+extern void csp_proc_destroy(csp_proc_t *proc);
+
+#ifdef csp_enable_proc_accounting
+extern void csp_acct_switch_out(csp_core_t *core);
+#endif
+
+#ifdef csp_enable_preemption
+extern bool csp_preempt_thread_init(void);
+#endif
+
+#ifdef csp_enable_stack_guard
+extern bool csp_guard_thread_init(void);
+#endif
 
 _Thread_local csp_core_t *csp_this_core;
 
-csp_core_t *csp_core_new(size_t pid, csp_lrunq_t *lrunq, csp_grunq_t *grunq) {
+csp_core_t *csp_core_new(size_t pid, csp_lrunq_t **lrunqs,
+    csp_grunq_t **grunqs, csp_grunq_t **pinqs) {
   csp_core_t *core = (csp_core_t *)malloc(sizeof(csp_core_t));
   if (core == NULL) {
     return NULL;
   }
 
   core->pid = pid;
-  core->lrunq = lrunq;
-  core->grunq = grunq;
+  core->lrunqs = lrunqs;
+  core->grunqs = grunqs;
+  core->pinqs = pinqs;
+  core->picks = 0;
   core->running = NULL;
+  core->park.fn = NULL;
+  core->steal_seed = (uint32_t)pid * 2654435761u | 1;
+#ifdef csp_enable_proc_accounting
+  core->acct.proc = core->acct.last = NULL;
+#endif
 
   csp_core_state_set(core, csp_core_state_inited);
   pthread_cond_init(&core->cond, NULL);
   pthread_mutex_init(&core->mutex, NULL);
   csp_cond_init(&core->pcond);
+  atomic_store(&core->starving, false);
 
   return core;
 }
@@ -75,6 +100,20 @@ __attribute__((noinline)) void *csp_core_run(void *data) {
   csp_core_state_set(this_core, csp_core_state_running);
   csp_this_core = this_core;
 
+#ifdef csp_enable_preemption
+  if (!csp_preempt_thread_init()) {
+    perror("Failed to initialize preemption.");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+#ifdef csp_enable_stack_guard
+  if (!csp_guard_thread_init()) {
+    perror("Failed to initialize stack guard.");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
   __asm__ __volatile__(
     /* Save variable this_core to rbx. */
     "mov %0, %%rbx\n"
@@ -148,6 +187,11 @@ bool csp_core_block_prologue(csp_core_t *this_core) {
     return false;
   }
 
+  /* Count it before `next` starts writing the counters of this processor. The
+   * blocking call must not be interrupted by the preemption. */
+  csp_stats_incr(this_core->pid, block_handoffs);
+  csp_preempt_clear(this_core->pid);
+  csp_trace(csp_trace_event_block, this_core->running, 0);
   if (csp_likely(csp_core_state_get(next) != csp_core_state_inited)) {
     csp_core_wakeup(next);
   } else if (!csp_core_start(next)) {
@@ -159,7 +203,14 @@ bool csp_core_block_prologue(csp_core_t *this_core) {
 
 __attribute__((used))
 static void csp_core_block_epilogue_inner(csp_core_t *this_core) {
-  while (!csp_grunq_try_push(this_core->grunq, this_core->running));
+#ifdef csp_enable_proc_accounting
+  csp_acct_switch_out(this_core);
+#endif
+  csp_trace_stop(csp_trace_event_unblock);
+  csp_proc_t *running = this_core->running;
+  csp_grunq_t **runqs = running->pin.self == (int32_t)this_core->pid ?
+    this_core->pinqs : this_core->grunqs;
+  while (!csp_grunq_try_push(runqs[running->prio.self], running));
   this_core->running = NULL;
 
   pthread_mutex_lock(&this_core->mutex);
@@ -197,10 +248,12 @@ static void csp_core_proc_exit_inner(csp_proc_t *proc, void *anchor) {
 /* Called when current process exits. It will clean the process resource and
  * then re-schedule.*/
 void csp_core_proc_exit(void) {
+  csp_preempt_disable();
   csp_proc_t *running = csp_this_core->running, *parent = running->parent;
   if (parent != NULL && csp_proc_nchild_decr(parent) == 0x01) {
     csp_sched_put_proc(parent);
   }
+  csp_trace_stop(csp_trace_event_exit);
   csp_this_core->running = NULL;
   csp_core_proc_exit_inner(running, &csp_this_core->anchor);
 }
@@ -209,10 +262,20 @@ void csp_core_proc_exit(void) {
  * run afterwards.
  *
  * NOTE: The current process should not be waited by other processes. */
+/* Destroy the exited process on the thread stack. `to_run` was switched out
+ * with the preemption disabled, reset it as the scheduler does. */
+__attribute__((used)) static void csp_core_proc_exit_destroy(csp_proc_t *proc) {
+  csp_proc_destroy(proc);
+  csp_preempt_reset();
+}
+
 __attribute__((noreturn)) void csp_core_proc_exit_and_run(csp_proc_t *to_run) {
+  csp_preempt_disable();
   csp_core_t *this_core = csp_this_core;
   csp_proc_t *running = this_core->running;
   this_core->running = to_run;
+  csp_trace_stop(csp_trace_event_exit);
+  csp_trace_run(to_run);
 
   __asm__ __volatile__ (
     "mov %0, %%r12\n"
@@ -221,7 +284,7 @@ __attribute__((noreturn)) void csp_core_proc_exit_and_run(csp_proc_t *to_run) {
     "mov %1, %%rbp\n"
     "mov %2, %%rsp\n"
 
-    "call csp_proc_destroy@plt\n"
+    "call csp_core_proc_exit_destroy\n"
     "mov %%r12, %%rdi\n"
     "call csp_proc_restore@plt\n"
     :
@@ -41,6 +41,15 @@ extern "C" {
   pthread_mutex_unlock(&(core)->mutex);                                        \
 } while (0)                                                                    \
 
+/* The number of procs in the lrunqs of the core. */
+#define csp_core_lrunqs_len(core) ({                                           \
+  size_t len_ = 0;                                                             \
+  for (int prio_ = 0; prio_ < csp_proc_prio_num; prio_++) {                    \
+    len_ += csp_lrunq_len((core)->lrunqs[prio_]);                              \
+  }                                                                            \
+  len_;                                                                        \
+})                                                                             \
+
 typedef enum {
   csp_core_state_inited,
   csp_core_state_running,
@@ -69,11 +78,22 @@ typedef struct {
   /* State of the core. */
   _Atomic csp_core_state_t state;
 
-  /* The local runq used by cores running on the same processor. */
-  csp_lrunq_t *lrunq;
+  /* The local work-stealing runqs used by cores running on the same processor,
+   * one for each priority. Other processors steal procs from them when they
+   * are idle. */
+  csp_lrunq_t **lrunqs;
+
+  /* The global runqs used by cores running on the same processor, one for each
+   * priority. */
+  csp_grunq_t **grunqs;
 
-  /* The global runq used by cores running on the same processor. */
-  csp_grunq_t *grunq;
+  /* The runqs of the procs pinned to the processor, one for each priority.
+   * They are never stolen. */
+  csp_grunq_t **pinqs;
+
+  /* The times the core picked a proc from the runqs, used to give the lower
+   * priorities a turn periodically. */
+  uint64_t picks;
 
   /* `mutex` and `cond` are used to do synchronization operations. */
   pthread_mutex_t mutex;
@@ -81,6 +101,23 @@ typedef struct {
 
   /* porc-level conditional variable. */
   csp_cond_t pcond;
+
+  /* Whether the core is in `csp_sched_starving_procs`, so that it's queued at
+   * most once. It's cleared by the one who pops it, who must signal it then. */
+  atomic_bool starving;
+
+  /* The function called by the scheduler after the running proc is parked,
+   * e.g. to release the lock of the wait queue the proc is in. */
+  struct { void (*fn)(void *); void *arg; } park;
+
+  /* The seed used to pick the first victim in each level when stealing. */
+  uint32_t steal_seed;
+
+#ifdef csp_enable_proc_accounting
+  /* The process switched to last time and when it started running. `proc` is
+   * NULL if its running time has been counted. */
+  struct { csp_proc_t *proc, *last; int64_t at; } acct;
+#endif
 } csp_core_t;
 
 bool csp_core_block_prologue(csp_core_t *core);
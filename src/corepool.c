@@ -24,7 +24,7 @@ extern size_t csp_max_threads;
 extern size_t csp_max_procs_hint;
 
 extern csp_core_t *csp_core_new(
-  size_t pid, csp_lrunq_t *lrunq, csp_grunq_t *grunq
+  size_t pid, csp_lrunq_t **lrunqs, csp_grunq_t **grunqs, csp_grunq_t **pinqs
 );
 extern void csp_core_destroy(csp_core_t *core);
 static void csp_core_pool_destroy(csp_core_pool_t *pool);
@@ -38,17 +38,25 @@ csp_core_pool_new(int pid, size_t grunq_cap_exp, size_t cores_per_cpu) {
     return NULL;
   }
 
-  pool->lrunq = csp_lrunq_new();
-  pool->grunq = csp_grunq_new(grunq_cap_exp);
+  for (int i = 0; i < csp_proc_prio_num; i++) {
+    pool->lrunqs[i] = csp_lrunq_new(grunq_cap_exp);
+    pool->grunqs[i] = csp_grunq_new(grunq_cap_exp);
+    pool->pinqs[i] = csp_grunq_new(grunq_cap_exp);
+    if (pool->lrunqs[i] == NULL || pool->grunqs[i] == NULL ||
+        pool->pinqs[i] == NULL) {
+      goto failed;
+    }
+  }
   pool->cores = (csp_core_t **)malloc(sizeof(csp_core_t *) * cores_per_cpu);
-  if (pool->lrunq == NULL || pool->grunq == NULL || pool->cores == NULL) {
+  if (pool->cores == NULL) {
     goto failed;
   }
 
   /* We should fulfill the pool thus we can get cached core when current core
    * blocks. */
   for (size_t i = 0; i < cores_per_cpu; i++) {
-    pool->cores[i] = csp_core_new(pid, pool->lrunq, pool->grunq);
+    pool->cores[i] = csp_core_new(pid, pool->lrunqs, pool->grunqs,
+      pool->pinqs);
     if (pool->cores[i] == NULL) {
       pool->cap = i;
       goto failed;
@@ -56,7 +64,7 @@ csp_core_pool_new(int pid, size_t grunq_cap_exp, size_t cores_per_cpu) {
   }
 
   pool->cap = pool->top = cores_per_cpu;
-  csp_mutex_init(&pool->mutex);
+  csp_spinlock_init(&pool->lock);
   return pool;
 
 failed:
@@ -65,19 +73,19 @@ failed:
 }
 
 static void csp_core_pool_push(csp_core_pool_t *pool, csp_core_t *core) {
-  csp_mutex_lock(&pool->mutex);
+  csp_spinlock_lock(&pool->lock);
   pool->cores[pool->top++] = core;
-  csp_mutex_unlock(&pool->mutex);
+  csp_spinlock_unlock(&pool->lock);
 }
 
 static bool csp_core_pool_pop(csp_core_pool_t *pool, csp_core_t **core) {
-  csp_mutex_lock(&pool->mutex);
+  csp_spinlock_lock(&pool->lock);
   if (pool->top == 0) {
-    csp_mutex_unlock(&pool->mutex);
+    csp_spinlock_unlock(&pool->lock);
     return false;
   }
   *core = pool->cores[--pool->top];
-  csp_mutex_unlock(&pool->mutex);
+  csp_spinlock_unlock(&pool->lock);
   return true;
 }
 
@@ -88,8 +96,11 @@ static void csp_core_pool_destroy(csp_core_pool_t *pool) {
   for (size_t i = 0; i < pool->cap; i++) {
     csp_core_destroy(pool->cores[i]);
   }
-  csp_lrunq_destroy(pool->lrunq);
-  csp_grunq_destroy(pool->grunq);
+  for (int i = 0; i < csp_proc_prio_num; i++) {
+    csp_lrunq_destroy(pool->lrunqs[i]);
+    csp_grunq_destroy(pool->grunqs[i]);
+    csp_grunq_destroy(pool->pinqs[i]);
+  }
   free(pool->cores);
   free(pool);
 }
@@ -22,18 +22,39 @@
 extern "C" {
 #endif
 
+#include <stdatomic.h>
 #include <stdlib.h>
 #include "core.h"
-#include "mutex.h"
+#include "spinlock.h"
 
 #define csp_core_pool(i) (csp_core_pools.pools[i])
 
+/* Wake up the core sleeping on the processor of the pool if any. The sleeper
+ * is taken, so that it's signaled at most once. */
+#define csp_core_pool_wakeup(pool) do {                                        \
+  atomic_thread_fence(memory_order_seq_cst);                                   \
+  csp_core_t *sleeper_ = atomic_load(&(pool)->sleeper);                        \
+  if (sleeper_ != NULL &&                                                      \
+      atomic_compare_exchange_strong(&(pool)->sleeper, &sleeper_, NULL)) {     \
+    csp_cond_signal(&sleeper_->pcond, csp_cond_signal_proc_avail);             \
+  }                                                                            \
+} while (0)                                                                    \
+
 typedef struct {
   size_t cap, top;
   csp_core_t **cores;
-  csp_lrunq_t *lrunq;
-  csp_grunq_t *grunq;
-  csp_mutex_t mutex;
+  csp_lrunq_t *lrunqs[csp_proc_prio_num];
+  csp_grunq_t *grunqs[csp_proc_prio_num];
+
+  /* The runqs of the procs pinned to this processor. Other processors put
+   * procs into them but never steal from them. */
+  csp_grunq_t *pinqs[csp_proc_prio_num];
+
+  /* The core sleeping for new procs on this processor, used to wake it up when
+   * a proc pinned to this processor is put. It's cleared when the core wakes
+   * up. */
+  _Atomic(csp_core_t *) sleeper;
+  csp_spinlock_t lock;
 } csp_core_pool_t;
 
 typedef struct {
@@ -22,24 +22,51 @@
 extern "C" {
 #endif
 
+#include "acct.h"
 #include "chan.h"
+#include "io.h"
+#include "mem.h"
 #include "mutex.h"
 #include "netpoll.h"
 #include "sched.h"
+#include "select.h"
+#include "stats.h"
+#include "sync.h"
 #include "timer.h"
+#include "trace.h"
 
-#define csp_async   csp_sched_async
-#define csp_sync    csp_sched_sync
-#define csp_block   csp_sched_block
-#define csp_yield   csp_sched_yield
-#define csp_hangup  csp_sched_hangup
+#define csp_async       csp_sched_async
+#define csp_sync        csp_sched_sync
+#define csp_async_prio  csp_sched_async_prio
+#define csp_sync_prio   csp_sched_sync_prio
+#define csp_set_prio    csp_sched_set_prio
+#define csp_async_on    csp_sched_async_on
+#define csp_sync_on     csp_sched_sync_on
+#define csp_pin         csp_sched_pin
+#define csp_nprocs      csp_sched_nprocs
+#define csp_current_pid csp_sched_current_pid
+#define csp_block       csp_sched_block
+#define csp_yield       csp_sched_yield
+#define csp_hangup      csp_sched_hangup
 
 /* All */
 #ifdef csp_without_prefix
+#ifndef csp_acct_without_prefix
+#define csp_acct_without_prefix
+#endif
+
 #ifndef csp_chan_without_prefix
 #define csp_chan_without_prefix
 #endif
 
+#ifndef csp_io_without_prefix
+#define csp_io_without_prefix
+#endif
+
+#ifndef csp_mem_without_prefix
+#define csp_mem_without_prefix
+#endif
+
 #ifndef csp_mutex_without_prefix
 #define csp_mutex_without_prefix
 #endif
@@ -52,15 +79,37 @@ extern "C" {
 #define csp_sched_without_prefix
 #endif
 
+#ifndef csp_select_without_prefix
+#define csp_select_without_prefix
+#endif
+
+#ifndef csp_stats_without_prefix
+#define csp_stats_without_prefix
+#endif
+
+#ifndef csp_sync_without_prefix
+#define csp_sync_without_prefix
+#endif
+
 #ifndef csp_timer_without_prefix
 #define csp_timer_without_prefix
 #endif
+
+#ifndef csp_trace_without_prefix
+#define csp_trace_without_prefix
+#endif
+#endif
+
+/* Accounting */
+#ifdef csp_acct_without_prefix
+#define acct_dump           csp_acct_dump
 #endif
 
 /* Channel */
 #ifdef csp_chan_without_prefix
 #define chan_t              csp_chan_t
 #define chan_new            csp_chan_new
+#define chan_unbuffered     csp_chan_unbuffered
 #define chan_try_push       csp_chan_try_push
 #define chan_push           csp_chan_push
 #define chan_try_pop        csp_chan_try_pop
@@ -74,6 +123,21 @@ extern "C" {
 #define chan_define         csp_chan_define
 #endif
 
+/* IO */
+#ifdef csp_io_without_prefix
+#define io_read             csp_io_read
+#define io_write            csp_io_write
+#define io_accept           csp_io_accept
+#define io_connect          csp_io_connect
+#endif
+
+/* Memory */
+#ifdef csp_mem_without_prefix
+#define mem_small_size_max  csp_mem_small_size_max
+#define mem_small_alloc     csp_mem_small_alloc
+#define mem_small_free      csp_mem_small_free
+#endif
+
 /* Mutex */
 #ifdef csp_mutex_without_prefix
 #define mutex_t             csp_mutex_t
@@ -98,11 +162,71 @@ extern "C" {
 #define proc                csp_proc
 #define async               csp_async
 #define sync                csp_sync
+#define async_prio          csp_async_prio
+#define sync_prio           csp_sync_prio
+#define set_prio            csp_set_prio
+#define prio_latency        csp_proc_prio_latency
+#define prio_normal         csp_proc_prio_normal
+#define prio_background     csp_proc_prio_background
+#define async_on            csp_async_on
+#define sync_on             csp_sync_on
+#define pin                 csp_pin
+#define nprocs              csp_nprocs
+#define current_pid         csp_current_pid
 #define block               csp_block
 #define yield               csp_yield
 #define hangup              csp_hangup
 #endif
 
+/* Select */
+#ifdef csp_select_without_prefix
+#define select_send         csp_select_send
+#define select_recv         csp_select_recv
+#define select_default      csp_select_default
+#define select_forever      csp_select_forever
+#define select_case_send    csp_select_case_send
+#define select_case_recv    csp_select_case_recv
+#define select_case_t       csp_select_case_t
+#endif
+
+/* Stats */
+#ifdef csp_stats_without_prefix
+#define stats_t             csp_stats_t
+#define stats_snapshot_core csp_stats_snapshot_core
+#define stats_snapshot      csp_stats_snapshot
+#define stats_dump          csp_stats_dump
+#endif
+
+/* Sync */
+#ifdef csp_sync_without_prefix
+#define proc_cond_t         csp_proc_cond_t
+#define proc_cond_init      csp_proc_cond_init
+#define proc_cond_wait      csp_proc_cond_wait
+#define proc_cond_signal    csp_proc_cond_signal
+#define proc_cond_broadcast csp_proc_cond_broadcast
+#define sema_t              csp_sema_t
+#define sema_init           csp_sema_init
+#define sema_try_acquire    csp_sema_try_acquire
+#define sema_acquire        csp_sema_acquire
+#define sema_release        csp_sema_release
+#define wg_t                csp_wg_t
+#define wg_init             csp_wg_init
+#define wg_add              csp_wg_add
+#define wg_done             csp_wg_done
+#define wg_wait             csp_wg_wait
+#define once_t              csp_once_t
+#define once_initializer    csp_once_initializer
+#define once_init           csp_once_init
+#define once                csp_once
+#define rwlock_t            csp_rwlock_t
+#define rwlock_init         csp_rwlock_init
+#define rwlock_rdlock       csp_rwlock_rdlock
+#define rwlock_rdunlock     csp_rwlock_rdunlock
+#define rwlock_wrlock       csp_rwlock_wrlock
+#define rwlock_wrunlock     csp_rwlock_wrunlock
+#define rwlock_destroy      csp_rwlock_destroy
+#endif
+
 /* Timer */
 #ifdef csp_timer_without_prefix
 #define timer_nanosecond    csp_timer_nanosecond
@@ -120,6 +244,11 @@ extern "C" {
 #define timer_cancel        csp_timer_cancel
 #endif
 
+/* Trace */
+#ifdef csp_trace_without_prefix
+#define trace_dump          csp_trace_dump
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "core.h"
+#include "guard.h"
+#include "proc.h"
+
+#ifdef csp_enable_stack_guard
+
+extern const char *csp_procs_name[];
+extern size_t csp_procs_size[];
+extern _Thread_local csp_core_t *csp_this_core;
+
+/* The action of SIGSEGV before ours, the faults not caused by the guard pages
+ * are left to it. */
+static struct sigaction csp_guard_old_action;
+
+/* Write a string to stderr, it's safe to call in the signal handler. */
+#define csp_guard_puts(s) do {                                                 \
+  const char *s_ = (s);                                                        \
+  ssize_t ret_ = write(STDERR_FILENO, s_, strlen(s_));                         \
+  (void)ret_;                                                                  \
+} while (0)                                                                    \
+
+/* Write a number to stderr, it's safe to call in the signal handler. */
+#define csp_guard_putn(n) do {                                                 \
+  char buf_[24], *p_ = buf_ + sizeof(buf_) - 1;                                \
+  uint64_t n_ = (n);                                                           \
+  *p_ = '\0';                                                                  \
+  do {                                                                         \
+    *--p_ = '0' + n_ % 10;                                                     \
+    n_ /= 10;                                                                  \
+  } while (n_ > 0);                                                            \
+  csp_guard_puts(p_);                                                          \
+} while (0)                                                                    \
+
+/* The stack of a process can't grow in place because the memory below it
+ * belongs to others, and it can't move either because there may be pointers
+ * to it. So we report which process overflowed and let it crash. */
+static void csp_guard_handler(int sig, siginfo_t *info, void *ctx) {
+  csp_core_t *this_core = csp_this_core;
+  csp_proc_t *proc = this_core != NULL ? this_core->running : NULL;
+  uintptr_t addr = (uintptr_t)info->si_addr;
+
+  if (proc != NULL && addr >= proc->base &&
+      addr < proc->base + csp_guard_size) {
+    csp_guard_puts("libcsp: the stack of process ");
+    csp_guard_puts(csp_procs_name[proc->fn]);
+    csp_guard_puts(" overflowed its ");
+    csp_guard_putn(csp_procs_size[proc->fn] - sizeof(csp_proc_t));
+    csp_guard_puts(" bytes on CPU processor ");
+    csp_guard_putn(this_core->pid);
+    csp_guard_puts(".\n");
+  }
+
+  /* Fault again with the old action when we return. */
+  sigaction(SIGSEGV, &csp_guard_old_action, NULL);
+}
+
+bool csp_guard_init(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = csp_guard_handler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&sa.sa_mask);
+  return sigaction(SIGSEGV, &sa, &csp_guard_old_action) == 0;
+}
+
+/* The overflowed stack can't be used by the signal handler, so each core
+ * thread handles SIGSEGV on its own alternate stack. It may have been set up
+ * by the preemption already. */
+bool csp_guard_thread_init(void) {
+  stack_t ss;
+  if (sigaltstack(NULL, &ss) == 0 && !(ss.ss_flags & SS_DISABLE)) {
+    return true;
+  }
+
+  ss.ss_size = SIGSTKSZ > (1 << 16) ? SIGSTKSZ : (1 << 16);
+  ss.ss_sp = malloc(ss.ss_size);
+  ss.ss_flags = 0;
+  return ss.ss_sp != NULL && sigaltstack(&ss, NULL) == 0;
+}
+
+#endif
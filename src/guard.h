@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_GUARD_H
+#define LIBCSP_GUARD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <sys/mman.h>
+
+/* The size of the guard page below the stack of every process. */
+#define csp_guard_size              (1 << 12)
+
+#ifdef csp_enable_stack_guard
+
+/* Protect the guard page at the bottom of the memory of a process, i.e. its
+ * lowest address `base`. The process still runs without the guard if the
+ * kernel refuses, e.g. `vm.max_map_count` is reached. */
+#define csp_guard_protect(base)                                                \
+  mprotect((void *)(base), csp_guard_size, PROT_NONE)                          \
+
+/* Make the guard page accessible again before the memory is freed. */
+#define csp_guard_unprotect(base)                                              \
+  mprotect((void *)(base), csp_guard_size, PROT_READ|PROT_WRITE)               \
+
+#else
+
+#define csp_guard_protect(base)
+#define csp_guard_unprotect(base)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,623 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "core.h"
+#include "io.h"
+#include "netpoll.h"
+#include "proc.h"
+#include "runq.h"
+#include "sched.h"
+#include "timer.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef csp_enable_io_uring
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define csp_io_op_read      0
+#define csp_io_op_write     1
+#define csp_io_op_accept    2
+#define csp_io_op_connect   3
+#define csp_io_op_poll      4
+
+/* Set `errno` and return -1 if the request failed. */
+#define csp_io_ret(res) ({                                                     \
+  int64_t res_ = (res);                                                        \
+  if (res_ < 0) {                                                              \
+    errno = -res_;                                                             \
+    res_ = -1;                                                                 \
+  }                                                                            \
+  res_;                                                                        \
+})                                                                             \
+
+extern _Thread_local csp_core_t *csp_this_core;
+extern int csp_sched_np;
+extern void csp_sched_put_proc(csp_proc_t *proc);
+
+typedef struct {
+  int op, fd;
+  void *addr;
+
+  /* The length of the buffer for read and write, the length of the address
+   * for connect and the events for poll. */
+  uint64_t len;
+
+  /* The length of the address for accept. */
+  socklen_t *addrlen;
+
+  /* The return value of the syscall, or `-errno` if it failed. */
+  int64_t res;
+
+#ifdef csp_enable_io_uring
+  /* The process waiting for the completion. */
+  csp_proc_t *proc;
+  csp_timer_duration_t timeout;
+  struct __kernel_timespec ts;
+#endif
+} csp_io_req_t;
+
+#ifdef csp_enable_io_uring
+
+/* The number of entries of the submission queue of each ring. */
+#define csp_io_ring_entries 256
+
+/* The requests are queued in the ring and submitted in a batch when there are
+ * so many of them or the core has nothing else to run. */
+#define csp_io_batch_size 32
+
+#define csp_io_ring_ptr(ring, off) ((void *)((char *)(ring) + (off)))
+
+#define csp_io_uring_setup(entries, params)                                    \
+  syscall(__NR_io_uring_setup, (entries), (params))                            \
+
+#define csp_io_uring_enter(fd, to_submit, min_complete, flags)                 \
+  syscall(__NR_io_uring_enter, (fd), (to_submit), (min_complete), (flags),     \
+    NULL, 0)                                                                   \
+
+/* Each CPU processor owns an io_uring instance. Only the active core of the
+ * processor queues requests to it, while both the core and the monitor may
+ * submit and reap them. */
+typedef struct {
+  int fd;
+
+  struct {
+    atomic_uint *head, *tail, *flags;
+    unsigned mask, entries, *array;
+    struct io_uring_sqe *sqes;
+  } sq;
+
+  struct {
+    atomic_uint *head, *tail;
+    unsigned mask;
+    struct io_uring_cqe *cqes;
+  } cq;
+
+  /* The number of requests not completed yet. */
+  atomic_int inflight;
+
+  /* Only one thread can reap the completions at a time. */
+  atomic_flag reaping;
+
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_len, cq_ring_len, sqes_len;
+} csp_io_ring_t;
+
+struct {
+  bool enabled;
+  int nrings;
+  csp_io_ring_t *rings;
+} csp_io;
+
+static void csp_io_ring_destroy(csp_io_ring_t *ring) {
+  if (ring->sq.sqes != NULL) {
+    munmap(ring->sq.sqes, ring->sqes_len);
+  }
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_len);
+  }
+  if (ring->sq_ring != NULL) {
+    munmap(ring->sq_ring, ring->sq_ring_len);
+  }
+  close(ring->fd);
+}
+
+static bool csp_io_ring_init(csp_io_ring_t *ring) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  memset(ring, 0, sizeof(csp_io_ring_t));
+
+  if ((ring->fd = csp_io_uring_setup(csp_io_ring_entries, &params)) == -1) {
+    return false;
+  }
+
+  /* Make sure all the operations we use are supported, i.e. linux 5.7+. */
+  if (!(params.features & IORING_FEAT_FAST_POLL)) {
+    goto failed;
+  }
+
+  ring->sq_ring_len = params.sq_off.array + params.sq_entries *
+    sizeof(unsigned);
+  ring->cq_ring_len = params.cq_off.cqes + params.cq_entries *
+    sizeof(struct io_uring_cqe);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* Both of the rings are mapped at once if the kernel supports it. */
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && ring->cq_ring_len > ring->sq_ring_len) {
+    ring->sq_ring_len = ring->cq_ring_len;
+  }
+
+  void *ptr = mmap(NULL, ring->sq_ring_len, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ptr == MAP_FAILED) {
+    goto failed;
+  }
+  ring->sq_ring = ptr;
+
+  if (single_mmap) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ptr = mmap(NULL, ring->cq_ring_len, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ptr == MAP_FAILED) {
+      goto failed;
+    }
+    ring->cq_ring = ptr;
+  }
+
+  ptr = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ptr == MAP_FAILED) {
+    goto failed;
+  }
+  ring->sq.sqes = (struct io_uring_sqe *)ptr;
+
+  ring->sq.head = csp_io_ring_ptr(ring->sq_ring, params.sq_off.head);
+  ring->sq.tail = csp_io_ring_ptr(ring->sq_ring, params.sq_off.tail);
+  ring->sq.flags = csp_io_ring_ptr(ring->sq_ring, params.sq_off.flags);
+  ring->sq.array = csp_io_ring_ptr(ring->sq_ring, params.sq_off.array);
+  ring->sq.mask = *(unsigned *)csp_io_ring_ptr(
+    ring->sq_ring, params.sq_off.ring_mask
+  );
+  ring->sq.entries = params.sq_entries;
+
+  ring->cq.head = csp_io_ring_ptr(ring->cq_ring, params.cq_off.head);
+  ring->cq.tail = csp_io_ring_ptr(ring->cq_ring, params.cq_off.tail);
+  ring->cq.cqes = csp_io_ring_ptr(ring->cq_ring, params.cq_off.cqes);
+  ring->cq.mask = *(unsigned *)csp_io_ring_ptr(
+    ring->cq_ring, params.cq_off.ring_mask
+  );
+
+  /* The sqes are always used in order, so the array maps each slot to the sqe
+   * with the same index. */
+  for (unsigned i = 0; i < ring->sq.entries; i++) {
+    ring->sq.array[i] = i;
+  }
+
+  atomic_store(&ring->inflight, 0);
+  atomic_flag_clear(&ring->reaping);
+  return true;
+
+failed:
+  csp_io_ring_destroy(ring);
+  return false;
+}
+
+/* Submit the queued requests to the kernel. */
+static void csp_io_ring_flush(csp_io_ring_t *ring) {
+  unsigned tail = atomic_load_explicit(ring->sq.tail, memory_order_acquire);
+  unsigned head = atomic_load_explicit(ring->sq.head, memory_order_acquire);
+  if (tail != head) {
+    csp_io_uring_enter(ring->fd, tail - head, 0, 0);
+  }
+}
+
+/* Reap the completed requests and link the processes waiting for them. */
+static int csp_io_ring_reap(csp_io_ring_t *ring, csp_proc_t **start,
+    csp_proc_t **end) {
+  if (atomic_flag_test_and_set_explicit(&ring->reaping,
+      memory_order_acquire)) {
+    return 0;
+  }
+
+  int len = 0;
+  csp_proc_t *head = NULL, *tail = NULL;
+
+  unsigned cq_head = atomic_load_explicit(ring->cq.head, memory_order_relaxed);
+  unsigned cq_tail = atomic_load_explicit(ring->cq.tail, memory_order_acquire);
+
+  for (; cq_head != cq_tail; cq_head++) {
+    struct io_uring_cqe *cqe = &ring->cq.cqes[cq_head & ring->cq.mask];
+
+    /* The completions of the link timeouts carry no request. */
+    csp_io_req_t *req = (csp_io_req_t *)(uintptr_t)cqe->user_data;
+    if (req == NULL) {
+      continue;
+    }
+
+    /* The request is canceled if its link timeout expires. */
+    req->res = cqe->res;
+    csp_proc_t *proc = req->proc;
+    csp_proc_stat_set(proc, req->timeout > 0 && req->res == -ECANCELED ?
+      csp_proc_stat_netpoll_timeout : csp_proc_stat_netpoll_avail);
+
+    if (tail != NULL) {
+      tail->next = proc;
+      proc->pre = tail;
+      tail = proc;
+    } else {
+      head = tail = proc;
+    }
+    len++;
+  }
+  atomic_store_explicit(ring->cq.head, cq_head, memory_order_release);
+
+  /* The kernel keeps the completions which can't fit in the completion queue,
+   * ask it to move them back now that there is room. */
+  if (atomic_load_explicit(ring->sq.flags, memory_order_relaxed) &
+      IORING_SQ_CQ_OVERFLOW) {
+    csp_io_uring_enter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+  }
+
+  atomic_flag_clear_explicit(&ring->reaping, memory_order_release);
+
+  if (len > 0) {
+    atomic_fetch_sub_explicit(&ring->inflight, len, memory_order_relaxed);
+    *start = head;
+    *end = tail;
+  }
+  return len;
+}
+
+static void csp_io_ring_prep(csp_io_req_t *req, struct io_uring_sqe *sqe) {
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->fd = req->fd;
+  sqe->addr = (uint64_t)(uintptr_t)req->addr;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+
+  switch (req->op) {
+    case csp_io_op_read:
+    case csp_io_op_write:
+      sqe->opcode = req->op == csp_io_op_read ?
+        IORING_OP_READ : IORING_OP_WRITE;
+      sqe->len = req->len > UINT32_MAX ? UINT32_MAX : req->len;
+      /* Use the current file offset like read(2) and write(2). */
+      sqe->off = (uint64_t)-1;
+      break;
+    case csp_io_op_accept:
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->addr2 = (uint64_t)(uintptr_t)req->addrlen;
+      break;
+    case csp_io_op_connect:
+      sqe->opcode = IORING_OP_CONNECT;
+      sqe->off = req->len;
+      break;
+    case csp_io_op_poll:
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->poll32_events = req->len;
+      break;
+  }
+}
+
+/* Queue the request to the ring of current CPU processor. It's called by the
+ * scheduler after the process is parked. */
+static void csp_io_ring_submit(void *arg) {
+  csp_io_req_t *req = (csp_io_req_t *)arg;
+  csp_core_t *this_core = csp_this_core;
+  csp_io_ring_t *ring = &csp_io.rings[this_core->pid];
+  unsigned nsqes = req->timeout > 0 ? 2 : 1, head;
+
+  unsigned tail = atomic_load_explicit(ring->sq.tail, memory_order_relaxed);
+  while (tail + nsqes - (head = atomic_load_explicit(ring->sq.head,
+      memory_order_acquire)) > ring->sq.entries) {
+    /* The kernel may refuse new requests when the completion queue overflows,
+     * so reap the completions while flushing. */
+    csp_io_ring_flush(ring);
+
+    csp_proc_t *start, *end, *next;
+    if (csp_io_ring_reap(ring, &start, &end) > 0) {
+      end->next = NULL;
+      for (; start != NULL; start = next) {
+        next = start->next;
+        start->pre = start->next = NULL;
+        csp_sched_put_proc(start);
+      }
+    }
+  }
+
+  struct io_uring_sqe *sqe = &ring->sq.sqes[tail & ring->sq.mask];
+  csp_io_ring_prep(req, sqe);
+
+  if (req->timeout > 0) {
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = &ring->sq.sqes[(tail + 1) & ring->sq.mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&req->ts;
+    sqe->len = 1;
+  }
+
+  /* Count it before publishing, otherwise the pollers may skip the ring. */
+  atomic_fetch_add_explicit(&ring->inflight, 1, memory_order_relaxed);
+  atomic_store_explicit(ring->sq.tail, tail + nsqes, memory_order_release);
+
+  if (tail + nsqes - head >= csp_io_batch_size ||
+      csp_core_lrunqs_len(this_core) == 0) {
+    csp_io_ring_flush(ring);
+  }
+}
+
+/* Park current process until the request completes. */
+static int64_t csp_io_ring_run(csp_io_req_t *req,
+    csp_timer_duration_t timeout) {
+  req->proc = csp_sched_running();
+  req->timeout = timeout;
+  if (timeout > 0) {
+    req->ts.tv_sec = timeout / csp_timer_second;
+    req->ts.tv_nsec = timeout % csp_timer_second;
+  }
+
+  csp_proc_stat_set(req->proc, csp_proc_stat_netpoll_waiting);
+  csp_sched_park(csp_io_ring_submit, req);
+
+  if (csp_proc_stat_get(req->proc) == csp_proc_stat_netpoll_timeout) {
+    return -ETIMEDOUT;
+  }
+  return req->res;
+}
+
+#endif
+
+bool csp_io_init(void) {
+#ifdef csp_enable_io_uring
+  csp_io.rings = (csp_io_ring_t *)malloc(
+    sizeof(csp_io_ring_t) * csp_sched_np
+  );
+  if (csp_io.rings == NULL) {
+    return false;
+  }
+
+  for (int i = 0; i < csp_sched_np; i++) {
+    if (!csp_io_ring_init(&csp_io.rings[i])) {
+      /* Fall back to the netpoll if io_uring is not available, e.g. the kernel
+       * is too old or it's forbidden by seccomp. */
+      for (int j = 0; j < i; j++) {
+        csp_io_ring_destroy(&csp_io.rings[j]);
+      }
+      free(csp_io.rings);
+      csp_io.rings = NULL;
+      return true;
+    }
+  }
+  csp_io.nrings = csp_sched_np;
+  csp_io.enabled = true;
+#endif
+  return true;
+}
+
+/* Run the request without blocking, it's used when io_uring is unavailable. */
+static int64_t csp_io_sys(csp_io_req_t *req, csp_timer_duration_t timeout) {
+  int64_t res = -1;
+  switch (req->op) {
+    case csp_io_op_read:
+      res = read(req->fd, req->addr, req->len);
+      break;
+    case csp_io_op_write:
+      res = write(req->fd, req->addr, req->len);
+      break;
+    case csp_io_op_accept:
+      res = accept(req->fd, (struct sockaddr *)req->addr, req->addrlen);
+      break;
+    case csp_io_op_connect:
+      res = connect(req->fd, (struct sockaddr *)req->addr, req->len);
+      break;
+    case csp_io_op_poll:
+      if ((req->len == POLLIN ? csp_netpoll_wait_read(req->fd, timeout) :
+          csp_netpoll_wait_write(req->fd, timeout)) == csp_netpoll_timeout) {
+        return -ETIMEDOUT;
+      }
+      return 0;
+  }
+  return res < 0 ? -errno : res;
+}
+
+/* Run the request once, it returns `-EAGAIN` if the fd is not ready. */
+static int64_t csp_io_once(csp_io_req_t *req, csp_timer_duration_t timeout) {
+#ifdef csp_enable_io_uring
+  if (csp_io.enabled) {
+    return csp_io_ring_run(req, timeout);
+  }
+#endif
+  return csp_io_sys(req, timeout);
+}
+
+/* Run the request until it's done, waiting for the fd to be ready whenever it
+ * would block. */
+static int64_t csp_io_run(csp_io_req_t *req, csp_timer_duration_t timeout) {
+  csp_timer_time_t deadline = timeout > 0 ? csp_timer_now() + timeout : 0;
+  csp_timer_duration_t left = timeout;
+
+  csp_io_req_t poll = {
+    .op = csp_io_op_poll,
+    .fd = req->fd,
+    .len = req->op == csp_io_op_read || req->op == csp_io_op_accept ?
+      POLLIN : POLLOUT
+  };
+
+  while (true) {
+    int64_t res = csp_io_once(req, left);
+    if (res == -EINTR) {
+      continue;
+    }
+    if (res != -EAGAIN && res != -EWOULDBLOCK &&
+        (req->op != csp_io_op_connect || res != -EINPROGRESS)) {
+      return res;
+    }
+
+    if (timeout > 0 && (left = deadline - csp_timer_now()) <= 0) {
+      return -ETIMEDOUT;
+    }
+    if ((res = csp_io_once(&poll, left)) < 0) {
+      return res;
+    }
+
+    /* The connection is established in the background, get the result. */
+    if (req->op == csp_io_op_connect) {
+      int err;
+      socklen_t len = sizeof(err);
+      if (getsockopt(req->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+        return -errno;
+      }
+      return -err;
+    }
+
+    if (timeout > 0 && (left = deadline - csp_timer_now()) <= 0) {
+      return -ETIMEDOUT;
+    }
+  }
+}
+
+ssize_t csp_io_read(int fd, void *buf, size_t len,
+    csp_timer_duration_t timeout) {
+  csp_io_req_t req = {.op = csp_io_op_read, .fd = fd, .addr = buf, .len = len};
+  return csp_io_ret(csp_io_run(&req, timeout));
+}
+
+ssize_t csp_io_write(int fd, const void *buf, size_t len,
+    csp_timer_duration_t timeout) {
+  csp_io_req_t req = {
+    .op = csp_io_op_write, .fd = fd, .addr = (void *)buf, .len = len
+  };
+  return csp_io_ret(csp_io_run(&req, timeout));
+}
+
+int csp_io_accept(int fd, struct sockaddr *addr, socklen_t *addrlen,
+    csp_timer_duration_t timeout) {
+  csp_io_req_t req = {
+    .op = csp_io_op_accept, .fd = fd, .addr = addr, .addrlen = addrlen
+  };
+  return csp_io_ret(csp_io_run(&req, timeout));
+}
+
+int csp_io_connect(int fd, const struct sockaddr *addr, socklen_t addrlen,
+    csp_timer_duration_t timeout) {
+  csp_io_req_t req = {
+    .op = csp_io_op_connect, .fd = fd, .addr = (void *)addr, .len = addrlen
+  };
+  return csp_io_ret(csp_io_run(&req, timeout));
+}
+
+/* Submit the queued requests of CPU processor `pid` and reap the completed
+ * ones. It's called by the core before it goes to sleep. */
+int csp_io_poll_core(size_t pid, csp_proc_t **start, csp_proc_t **end) {
+#ifdef csp_enable_io_uring
+  if (csp_io.enabled) {
+    csp_io_ring_t *ring = &csp_io.rings[pid];
+    if (atomic_load_explicit(&ring->inflight, memory_order_relaxed) > 0) {
+      csp_io_ring_flush(ring);
+      return csp_io_ring_reap(ring, start, end);
+    }
+  }
+#endif
+  return 0;
+}
+
+/* Poll the rings of the `n` CPU processors in `pids`. It's called by the
+ * monitor owning them, and the requests queued on the busy cores are submitted
+ * here as well. */
+int csp_io_poll(const int *pids, int n, csp_proc_t **start, csp_proc_t **end) {
+  int total = 0;
+#ifdef csp_enable_io_uring
+  csp_proc_t *head, *tail;
+
+  for (int i = 0; i < n && i < csp_io.nrings; i++) {
+    int len = csp_io_poll_core(pids[i], &head, &tail);
+    if (len > 0) {
+      if (total != 0) {
+        (*end)->next = head;
+        head->pre = *end;
+        *end = tail;
+      } else {
+        *start = head;
+        *end = tail;
+      }
+      total += len;
+    }
+  }
+#endif
+  return total;
+}
+
+/* Add the io_uring instances of the `n` CPU processors in `pids` to `epfd`, so
+ * that the monitor sleeping in it is woken up when any of their requests
+ * completes. */
+bool csp_io_watch(int epfd, const int *pids, int n) {
+#ifdef csp_enable_io_uring
+  for (int i = 0; i < n && i < csp_io.nrings; i++) {
+    struct epoll_event evt = {.events = EPOLLET|EPOLLIN};
+    int fd = csp_io.rings[pids[i]].fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &evt) == -1) {
+      return false;
+    }
+  }
+#endif
+  return true;
+}
+
+/* Whether any request of the `n` CPU processors in `pids` is not completed
+ * yet. The monitor should poll the rings periodically then, the requests
+ * queued on the busy cores are only submitted by it. */
+bool csp_io_pending(const int *pids, int n) {
+#ifdef csp_enable_io_uring
+  for (int i = 0; i < n && i < csp_io.nrings; i++) {
+    if (atomic_load_explicit(&csp_io.rings[pids[i]].inflight,
+          memory_order_relaxed) > 0) {
+      return true;
+    }
+  }
+#endif
+  return false;
+}
+
+void csp_io_destroy(void) {
+#ifdef csp_enable_io_uring
+  for (int i = 0; i < csp_io.nrings; i++) {
+    csp_io_ring_destroy(&csp_io.rings[i]);
+  }
+  free(csp_io.rings);
+  csp_io.rings = NULL;
+  csp_io.nrings = 0;
+  csp_io.enabled = false;
+#endif
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_IO_H
+#define LIBCSP_IO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "timer.h"
+
+ssize_t csp_io_read(int fd, void *buf, size_t len,
+    csp_timer_duration_t timeout);
+ssize_t csp_io_write(int fd, const void *buf, size_t len,
+    csp_timer_duration_t timeout);
+int csp_io_accept(int fd, struct sockaddr *addr, socklen_t *addrlen,
+    csp_timer_duration_t timeout);
+int csp_io_connect(int fd, const struct sockaddr *addr, socklen_t addrlen,
+    csp_timer_duration_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,15 +15,22 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 #include "common.h"
 #include "core.h"
+#include "mem.h"
 #include "rbq.h"
 #include "rbtree.h"
+#include "topo.h"
 
 /*
  * mem.c implements a virtual memory manager.
@@ -45,6 +52,26 @@
  * +-----------------------------------------------------------+
  * | reversed:16 | user:1 | cpu_id:11 | l1:8 | l2:16 | page:12 |
  * +-----------------------------------------------------------+
+ *
+ * Small objects(no more than 2KB) are served by slabs. A slab is a span of
+ * pages carved from the heap of current core, whose head is `csp_mem_slab_t`
+ * followed by objects of the same size class. The page metadata records the
+ * distance to the slab head so that we can find the slab of an object in O(1).
+ * Like pages, small objects freed on other cores are sent back to the owner
+ * core through the mailboxes.
+ *
+ * The stacks of processes come from a small set of sizes and are allocated
+ * and freed at a high rate, so the freed spans of no more than
+ * `csp_mem_cache_npages` pages are cached in per-size free lists first, which
+ * avoids searching the tree and splitting spans when they are reused. The
+ * cached pages are bounded by `csp_mem_retained_pages`.
+ *
+ * Arenas are never unmapped because the heap layout depends on them. Instead,
+ * the monitor periodically asks the cores whose heaps had memory freed or still
+ * cache spans to reclaim them, the owner core then returns the cached spans
+ * unused since last time to the tree, merges the free spans and returns the
+ * pages beyond `csp_mem_retained_pages` to the OS with madvise(MADV_DONTNEED),
+ * the smaller free spans are retained first.
  */
 
 #define csp_mem_heap_size_exp     36
@@ -78,6 +105,7 @@
       PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0         \
     );                                                                         \
   } while (arena_ == MAP_FAILED);                                              \
+  csp_mem_bind(arena_, csp_mem_arena_size, (heap)->node);                      \
                                                                                \
   int32_t l1_ = csp_mem_meta_l1_by_addr(heap, arena_);                         \
   if ((heap)->metas[l1_] == NULL && !csp_mem_heap_init_l1(heap, l1_)) {        \
@@ -102,6 +130,9 @@
 #define csp_mem_page_size_exp      12
 #define csp_mem_page_size          (1 << csp_mem_page_size_exp)
 
+/* The max pages number of the spans cached. */
+#define csp_mem_cache_npages       64
+
 #define csp_mem_meta_l1_num_exp    8
 #define csp_mem_meta_l1_num        (1 << csp_mem_meta_l1_num_exp)
 #define csp_mem_meta_l1_size       (csp_mem_heap_size / csp_mem_meta_l1_num)
@@ -176,6 +207,15 @@
    (span)->npages[1] = (uint8_t)((n) >> 8);                                    \
    (span)->npages[2] = (uint8_t)(n);                                           \
 } while (0)
+#define csp_mem_span_released_get(span)                                        \
+  ((((uint32_t)((span)->released[0])) << 16) |                                 \
+   (((uint32_t)((span)->released[1])) << 8)  |                                 \
+   ((uint32_t)((span)->released[2])))
+#define csp_mem_span_released_set(span, n) do {                                \
+   (span)->released[0] = (uint8_t)((n) >> 16);                                 \
+   (span)->released[1] = (uint8_t)((n) >> 8);                                  \
+   (span)->released[2] = (uint8_t)(n);                                         \
+} while (0)
 #define csp_mem_span_is_free(heap, span)                                       \
   (((span) != NULL) && !csp_mem_meta_taken_bit_by_index((heap), (span)->index))
 #define csp_mem_span_remove(heap, span, total) ({                              \
@@ -256,7 +296,74 @@
   next_;                                                                       \
 })                                                                             \
 
+#define csp_mem_small_class_num   24
+#define csp_mem_small_class(size) ({                                           \
+  size_t size_ = (size) > 0 ? (size) : 1;                                      \
+  int32_t cls_;                                                                \
+  if (size_ <= 128) {                                                          \
+    cls_ = (size_ - 1) >> 4;                                                   \
+  } else {                                                                     \
+    int32_t exp_ = 63 - __builtin_clzl(size_ - 1);                             \
+    cls_ = 8 + ((exp_ - 7) << 2) + ((size_ - 1 - (1 << exp_)) >> (exp_ - 2));  \
+  }                                                                            \
+  cls_;                                                                        \
+})
+#define csp_mem_small_class_size(cls) ({                                       \
+  size_t size_;                                                                \
+  if ((cls) < 8) {                                                             \
+    size_ = ((size_t)(cls) + 1) << 4;                                          \
+  } else {                                                                     \
+    int32_t exp_ = 7 + (((cls) - 8) >> 2);                                     \
+    size_ = (1 << exp_) + (((((cls) - 8) & 0x03) + 1) << (exp_ - 2));          \
+  }                                                                            \
+  size_;                                                                       \
+})
+
+/* Each slab holds 16 objects at least. */
+#define csp_mem_slab_npages(size) ({                                           \
+  size_t npages_ = ((size) * 16 + csp_mem_page_size - 1) >>                    \
+    csp_mem_page_size_exp;                                                     \
+  npages_ > 0 ? npages_ : 1;                                                   \
+})
+#define csp_mem_slab_offset ((sizeof(csp_mem_slab_t) + 0x0f) & ~(size_t)0x0f)
+#define csp_mem_slab_by_addr(heap, addr) ({                                    \
+  uintptr_t addr_ = (uintptr_t)(addr);                                         \
+  int32_t l1_ = csp_mem_meta_l1_by_addr(heap, addr_);                          \
+  int32_t l2_ = csp_mem_meta_l2_by_addr(heap, addr_);                          \
+  uintptr_t page_ = addr_ & ~(uintptr_t)(csp_mem_page_size - 1);               \
+  uintptr_t dist_ = (heap)->metas[l1_]->slabs[l2_] - 1;                        \
+  (csp_mem_slab_t *)(page_ - (dist_ << csp_mem_page_size_exp));                \
+})
+#define csp_mem_slab_mark(heap, slab, npages, on) do {                         \
+  int32_t l1_ = csp_mem_meta_l1_by_addr(heap, slab);                           \
+  int32_t l2_ = csp_mem_meta_l2_by_addr(heap, slab);                           \
+  for (int32_t i_ = 0; i_ < (npages); i_++) {                                  \
+    (heap)->metas[l1_]->slabs[l2_ + i_] = (on) ? i_ + 1 : 0;                   \
+  }                                                                            \
+} while (0)
+#define csp_mem_slab_link(heap, slab) do {                                     \
+  csp_mem_slab_t **head_ = &(heap)->slabs[(slab)->cls];                        \
+  (slab)->pre = NULL;                                                          \
+  (slab)->next = *head_;                                                       \
+  if (*head_ != NULL) {                                                        \
+    (*head_)->pre = (slab);                                                    \
+  }                                                                            \
+  *head_ = (slab);                                                             \
+} while (0)
+#define csp_mem_slab_unlink(heap, slab) do {                                   \
+  if ((slab)->pre != NULL) {                                                   \
+    (slab)->pre->next = (slab)->next;                                          \
+  } else {                                                                     \
+    (heap)->slabs[(slab)->cls] = (slab)->next;                                 \
+  }                                                                            \
+  if ((slab)->next != NULL) {                                                  \
+    (slab)->next->pre = (slab)->pre;                                           \
+  }                                                                            \
+  (slab)->pre = (slab)->next = NULL;                                           \
+} while (0)
+
 extern int csp_sched_np;
+extern size_t csp_mem_retained_pages;
 extern _Thread_local csp_core_t *csp_this_core;
 
 csp_msrbq_declare(uintptr_t, obj);
@@ -267,13 +374,35 @@ typedef uint8_t csp_mem_meta_index_t[3];
 typedef struct {
   uint8_t npages[3];
   csp_mem_meta_index_t index, mt_pre, mt_next, fp_pre, fp_next;
+
+  /* The number of pages of this free span which have been returned to the OS
+   * and not touched since then. */
+  uint8_t released[3];
 } csp_mem_span_t;
 
 typedef struct {
   csp_mem_span_t spans[csp_mem_meta_l2_num];
   uint8_t taken_bits[csp_mem_meta_l2_num / sizeof(uint8_t)];
+
+  /* The distance(plus one) from the page to its slab head, 0 if the page
+   * doesn't belong to a slab. */
+  uint8_t slabs[csp_mem_meta_l2_num];
 } csp_mem_meta_t;
 
+typedef struct csp_mem_slab_t {
+  /* The list of free objects. */
+  void *free;
+
+  /* The number of free objects and all objects. */
+  uint32_t nfree, nobjs;
+
+  /* The size class and pages number of this slab. */
+  int32_t cls, npages;
+
+  /* Link the slabs with free objects of the same size class. */
+  struct csp_mem_slab_t *pre, *next;
+} csp_mem_slab_t;
+
 typedef struct csp_mem_arena_link_t {
   void *addr;
   struct csp_mem_arena_link_t *next;
@@ -292,9 +421,17 @@ typedef struct {
   /* Store the metadata of pages. */
   csp_mem_meta_t *metas[csp_mem_meta_l1_num];
 
-  /* Store the objects returned from other cores. */
+  /* Store the pages returned from other cores. */
   csp_msrbq_t(obj) *mailboxes[csp_mem_meta_l1_num];
 
+  /* The stack of small objects returned from other cores or threads, linked
+   * by their first words. Unlike the pages, the number of small objects is
+   * unbounded so that they can't be put to the mailboxes. */
+  _Atomic(void *) remote;
+
+  /* Store the slabs with free objects of each size class. */
+  csp_mem_slab_t *slabs[csp_mem_small_class_num];
+
   /* Store free pages. The key is the pages number and the value is the free
    * span list */
   csp_rbtree_t *tree;
@@ -307,14 +444,71 @@ typedef struct {
 
   /* Store all keys in the red-black tree temporarily. */
   int all_keys[csp_mem_tree_node_num];
+
+  /* The freed spans of each pages number, linked by `fp_next`. `low` is the
+   * least `len` since last reclaiming, i.e. the number of spans unused during
+   * the interval. */
+  struct {
+    csp_mem_span_t *head;
+    int32_t len, low;
+  } caches[csp_mem_cache_npages + 1];
+
+  /* The pages number of all cached spans. */
+  size_t cached_pages;
+
+  /* Whether pages were freed since last reclaiming. */
+  bool dirty;
+
+  /* Set by the monitor to ask the owner core to reclaim the heap. */
+  atomic_bool reclaim;
+
+  /* Whether there may be memory to reclaim, i.e. memory was freed to the heap
+   * or spans are cached since last reclaiming. The monitor only asks the heaps
+   * with it set, so that the idle cores are not woken up for nothing. */
+  atomic_bool pending;
+
+  /* The NUMA node of the owner core. */
+  int node;
 } csp_mem_heap_t;
 
-static bool csp_mem_heap_init(csp_mem_heap_t *heap, uintptr_t start) {
+/* Prefer the memory of NUMA node `node` for the pages in [addr, addr + len).
+ * It's only a hint, the kernel uses other nodes if `node` runs out of memory.
+ */
+static void csp_mem_bind(void *addr, size_t len, int node) {
+  if (csp_topo.nnodes <= 1 || node >= CPU_SETSIZE) {
+    return;
+  }
+
+  unsigned long mask[CPU_SETSIZE / (sizeof(unsigned long) * 8)] = {0};
+  mask[node / (sizeof(unsigned long) * 8)] |=
+    1UL << (node % (sizeof(unsigned long) * 8));
+  syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+      sizeof(mask) * 8, 0);
+}
+
+/* Tell the monitor there may be memory to reclaim in the heap. It's loaded
+ * first so that the frees from other cores don't keep writing the cache line. */
+#define csp_mem_heap_mark_pending(heap) do {                                   \
+  if (!atomic_load_explicit(&(heap)->pending, memory_order_relaxed)) {         \
+    atomic_store_explicit(&(heap)->pending, true, memory_order_relaxed);       \
+  }                                                                            \
+} while (0)                                                                    \
+
+static bool csp_mem_heap_init(csp_mem_heap_t *heap, uintptr_t start,
+    int nid) {
   memset(heap->metas, 0, sizeof(heap->metas));
   memset(heap->mailboxes, 0, sizeof(heap->mailboxes));
   memset(heap->cache_nodes, 0, sizeof(heap->cache_nodes));
+  memset(heap->slabs, 0, sizeof(heap->slabs));
+  memset(heap->caches, 0, sizeof(heap->caches));
 
+  heap->cached_pages = 0;
   heap->arenas = NULL;
+  heap->dirty = false;
+  heap->node = nid;
+  atomic_store(&heap->reclaim, false);
+  atomic_store(&heap->pending, false);
+  atomic_store(&heap->remote, NULL);
 
   heap->tree = csp_rbtree_new();
   if (heap->tree == NULL) {
@@ -371,6 +565,7 @@ static void csp_mem_heap_merge(csp_mem_heap_t *heap) {
     csp_mem_span_t *span = (csp_mem_span_t *)node->value;
     while (span != NULL) {
       int total = 0;
+      uint32_t released = csp_mem_span_released_get(span);
 
       csp_mem_span_t
         *pre = csp_mem_meta_span_by_index(heap, span->mt_pre),
@@ -378,12 +573,14 @@ static void csp_mem_heap_merge(csp_mem_heap_t *heap) {
         *start = span, *end = span;
 
       while (csp_mem_span_is_free(heap, pre)) {
+        released += csp_mem_span_released_get(pre);
         csp_mem_span_remove(heap, pre, total);
         start = pre;
         pre = csp_mem_meta_span_by_index(heap, pre->mt_pre);
       }
 
       while (csp_mem_span_is_free(heap, next)) {
+        released += csp_mem_span_released_get(next);
         csp_mem_span_remove(heap, next, total);
         end = next;
         next = csp_mem_meta_span_by_index(heap, next->mt_next);
@@ -398,6 +595,7 @@ static void csp_mem_heap_merge(csp_mem_heap_t *heap) {
 
       node = csp_rbtree_insert(heap->tree, total);
       csp_mem_span_npages_set(start, total);
+      csp_mem_span_released_set(start, released);
       csp_mem_tree_node_put_span(heap, node, start);
 
       if (next) {
@@ -420,7 +618,113 @@ static void csp_mem_heap_free(csp_mem_heap_t *heap, void *obj) {
   csp_rbtree_node_t *node = csp_rbtree_insert(
     heap->tree, csp_mem_span_npages_get(curr)
   );
+  csp_mem_span_released_set(curr, 0);
   csp_mem_tree_node_put_span(heap, node, curr);
+  heap->dirty = true;
+}
+
+/* Take a cached span of `npages` pages, NULL if there is none. */
+static void *csp_mem_heap_cache_get(csp_mem_heap_t *heap, int npages) {
+  if (npages > csp_mem_cache_npages || heap->caches[npages].head == NULL) {
+    return NULL;
+  }
+
+  csp_mem_span_t *span = heap->caches[npages].head;
+  heap->caches[npages].head = csp_mem_meta_span_by_index(heap, span->fp_next);
+  if (--heap->caches[npages].len < heap->caches[npages].low) {
+    heap->caches[npages].low = heap->caches[npages].len;
+  }
+  heap->cached_pages -= npages;
+
+  int32_t l1 = csp_mem_meta_l1_by_index(span->index);
+  int32_t l2 = csp_mem_meta_l2_by_index(span->index);
+  return (void *)csp_mem_meta_l1l2_to_addr(heap, l1, l2);
+}
+
+/* Cache a freed span, or free it to the heap if it's too large or the cache is
+ * full. The span stays taken while it's cached, so it's never merged. */
+static void csp_mem_heap_cache_put(csp_mem_heap_t *heap, void *obj) {
+  csp_mem_span_t *span = csp_mem_meta_span_by_addr(heap, obj);
+  int npages = csp_mem_span_npages_get(span);
+  if (npages > csp_mem_cache_npages ||
+      heap->cached_pages + npages > csp_mem_retained_pages) {
+    csp_mem_heap_free(heap, obj);
+    return;
+  }
+
+  csp_mem_span_t *head = heap->caches[npages].head;
+  if (head != NULL) {
+    csp_mem_meta_index_set(span->fp_next, head->index);
+  } else {
+    csp_mem_meta_index_set_zero(span->fp_next);
+  }
+  heap->caches[npages].head = span;
+  heap->caches[npages].len++;
+  heap->cached_pages += npages;
+}
+
+/* Free the cached spans unused since last reclaiming to the heap. */
+static void csp_mem_heap_cache_trim(csp_mem_heap_t *heap) {
+  for (int npages = 1; npages <= csp_mem_cache_npages; npages++) {
+    for (int32_t n = heap->caches[npages].low; n > 0; n--) {
+      csp_mem_heap_free(heap, csp_mem_heap_cache_get(heap, npages));
+    }
+    heap->caches[npages].low = heap->caches[npages].len;
+  }
+}
+
+/* Free a small object to the slab it belongs to. */
+static void csp_mem_heap_small_free(csp_mem_heap_t *heap, void *obj) {
+  csp_mem_slab_t *slab = csp_mem_slab_by_addr(heap, obj);
+  *(void **)obj = slab->free;
+  slab->free = obj;
+
+  if (slab->nfree++ == 0) {
+    csp_mem_slab_link(heap, slab);
+    return;
+  }
+
+  /* Return the empty slab to the heap unless it's the only one of its class,
+   * which avoids allocating and freeing a slab back and forth. */
+  if (slab->nfree == slab->nobjs && (slab->pre != NULL || slab->next != NULL)) {
+    csp_mem_slab_unlink(heap, slab);
+    csp_mem_slab_mark(heap, slab, slab->npages, false);
+    csp_mem_heap_free(heap, slab);
+  }
+}
+
+/* Collect objects returned by other cores. Return true if any. */
+static bool csp_mem_heap_collect(csp_mem_heap_t *heap) {
+  /* Take the whole stack at once, so there is no ABA problem. */
+  void *obj = NULL;
+  if (atomic_load_explicit(&heap->remote, memory_order_relaxed) != NULL) {
+    obj = atomic_exchange_explicit(&heap->remote, NULL, memory_order_acquire);
+  }
+  bool is_freed = obj != NULL;
+  while (obj != NULL) {
+    void *next = *(void **)obj;
+    csp_mem_heap_small_free(heap, obj);
+    obj = next;
+  }
+
+  for (int i = 0; i < csp_mem_meta_l1_num; i++) {
+    csp_msrbq_t(obj) *mailbox = heap->mailboxes[i];
+    if (mailbox == NULL) {
+      break;
+    }
+    size_t n;
+    uintptr_t objs[16];
+    while ((n = csp_msrbq_try_popm(obj)(mailbox, objs, 16)) > 0) {
+      is_freed = true;
+      for (size_t j = 0; j < n; j++) {
+        csp_mem_heap_cache_put(heap, (void *)objs[j]);
+      }
+      if (n < 16) {
+        break;
+      }
+    }
+  }
+  return is_freed;
 }
 
 /* Allocate n pages from the heap. `size` is guaranteed to 4KB alignment.*/
@@ -430,31 +734,20 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
     size = csp_mem_arena_size;
   }
 
-  void *result;
   int npages = size >> csp_mem_page_size_exp;
+  void *result = csp_mem_heap_cache_get(heap, npages);
+  if (result != NULL) {
+    return result;
+  }
 
   csp_rbtree_node_t *node = csp_mem_tree_node_get_gte(heap, npages);
   if (node == NULL) {
-    /* Try to collect free pages returned by other prcessors. */
-    bool is_freed = false;
-    for (int i = 0; i < csp_mem_meta_l1_num; i++) {
-      csp_msrbq_t(obj) *mailbox = heap->mailboxes[i];
-      if (mailbox == NULL) {
-        break;
-      }
-      size_t n;
-      uintptr_t objs[16];
-      while ((n = csp_msrbq_try_popm(obj)(mailbox, objs, 16)) > 0) {
-        is_freed = true;
-        for (size_t j = 0; j < n; j++) {
-          csp_mem_heap_free(heap, (void *)objs[j]);
-        }
-        if (n < 16) {
-          break;
-        }
+    /* Try to collect free pages returned by other prcessors, they may be
+     * cached. */
+    if (csp_mem_heap_collect(heap)) {
+      if ((result = csp_mem_heap_cache_get(heap, npages)) != NULL) {
+        return result;
       }
-    }
-    if (is_freed) {
       node = csp_mem_tree_node_get_gte(heap, npages);
     }
 
@@ -503,6 +796,11 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
       );
       csp_mem_span_npages_set(new_span, key - npages);
       csp_mem_meta_taken_bit_clear(heap, new_l1, new_l2);
+      /* We don't know which pages are released, assume the allocated ones
+       * are so that the released pages are never overcounted. */
+      uint32_t released = csp_mem_span_released_get(span);
+      csp_mem_span_released_set(new_span,
+        released > (uint32_t)npages ? released - npages : 0);
 
       /* Insert the new span to the metadata list. */
       csp_mem_span_t *next = csp_mem_meta_span_by_index(heap, span->mt_next);
@@ -518,6 +816,7 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
       csp_mem_tree_node_put_span(heap, node, new_span);
     }
 
+    csp_mem_span_released_set(span, 0);
     return result;
   }
 
@@ -536,6 +835,7 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
     uintptr_t addr = (uintptr_t)result + size;
     csp_mem_span_t *new_span = csp_mem_meta_span_by_addr(heap, addr);
     csp_mem_span_npages_set(new_span, csp_mem_arena_npages - npages);
+    csp_mem_span_released_set(new_span, 0);
 
     /* Link the two parts in metadata list. */
     csp_mem_meta_index_set(span->mt_next, new_span->index);
@@ -549,6 +849,94 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
   return result;
 }
 
+/* Allocate an object of size class `cls` from the slabs of the heap. */
+static void *csp_mem_heap_small_alloc(csp_mem_heap_t *heap, int32_t cls) {
+  csp_mem_slab_t *slab = heap->slabs[cls];
+  if (slab == NULL && csp_mem_heap_collect(heap)) {
+    slab = heap->slabs[cls];
+  }
+
+  if (slab == NULL) {
+    size_t size = csp_mem_small_class_size(cls);
+    int32_t npages = csp_mem_slab_npages(size);
+
+    slab = (csp_mem_slab_t *)csp_mem_heap_alloc(
+      heap, npages << csp_mem_page_size_exp
+    );
+    csp_mem_slab_mark(heap, slab, npages, true);
+
+    slab->cls = cls;
+    slab->npages = npages;
+    slab->nobjs = ((npages << csp_mem_page_size_exp) - csp_mem_slab_offset) /
+      size;
+    slab->nfree = slab->nobjs;
+
+    /* Thread the objects into the free list in the address order. */
+    uintptr_t obj = (uintptr_t)slab + csp_mem_slab_offset;
+    slab->free = (void *)obj;
+    for (uint32_t i = 1; i < slab->nobjs; i++, obj += size) {
+      *(void **)obj = (void *)(obj + size);
+    }
+    *(void **)obj = NULL;
+
+    csp_mem_slab_link(heap, slab);
+  }
+
+  void *obj = slab->free;
+  slab->free = *(void **)obj;
+  if (--slab->nfree == 0) {
+    csp_mem_slab_unlink(heap, slab);
+  }
+  return obj;
+}
+
+/* Return the free pages beyond `csp_mem_retained_pages` to the OS. */
+static void csp_mem_heap_reclaim(csp_mem_heap_t *heap) {
+  /* Clear it before collecting, the frees from other cores after that set it
+   * again. The spans still cached are trimmed next time if they are unused. */
+  atomic_store(&heap->pending, false);
+  csp_mem_heap_collect(heap);
+  csp_mem_heap_cache_trim(heap);
+  if (heap->cached_pages > 0) {
+    csp_mem_heap_mark_pending(heap);
+  }
+  if (!heap->dirty) {
+    return;
+  }
+  heap->dirty = false;
+  csp_mem_heap_merge(heap);
+
+  /* The nodes are in the ascending order of pages number, so that the small
+   * spans, which are more likely to be reused, are retained first. Only the
+   * pages not released yet count. */
+  size_t retained = 0;
+  int n = csp_rbtree_all_nodes(heap->tree, heap->all_nodes);
+  for (int i = 0; i < n; i++) {
+    csp_rbtree_node_t *node = heap->all_nodes[i];
+    csp_mem_span_t *span = (csp_mem_span_t *)node->value;
+
+    for (; span != NULL;
+         span = csp_mem_meta_span_by_index(heap, span->fp_next)) {
+      size_t resident = node->key - csp_mem_span_released_get(span);
+      if (resident == 0) {
+        continue;
+      }
+      if (retained + resident <= csp_mem_retained_pages) {
+        retained += resident;
+        continue;
+      }
+
+      int32_t l1 = csp_mem_meta_l1_by_index(span->index);
+      int32_t l2 = csp_mem_meta_l2_by_index(span->index);
+      void *addr = (void *)csp_mem_meta_l1l2_to_addr(heap, l1, l2);
+      if (madvise(addr, (size_t)node->key << csp_mem_page_size_exp,
+            MADV_DONTNEED) == 0) {
+        csp_mem_span_released_set(span, node->key);
+      }
+    }
+  }
+}
+
 static void csp_mem_heap_destroy(csp_mem_heap_t *heap) {
   for (int i = 0; i < csp_mem_meta_l1_num; i++) {
     csp_mem_heap_destroy_l1(heap, i);
@@ -577,7 +965,7 @@ bool csp_mem_init(void) {
 
   for (int i = 0; i < csp_sched_np; i++) {
     uintptr_t start = (uintptr_t)(i + 1) << csp_mem_heap_size_exp;
-    if (!csp_mem_heap_init(&csp_mem.heaps[i], start)) {
+    if (!csp_mem_heap_init(&csp_mem.heaps[i], start, csp_topo_node(i))) {
       csp_mem.len = i;
       return false;
     }
@@ -587,12 +975,43 @@ bool csp_mem_init(void) {
   return true;
 }
 
+/* Ask core `pid` to reclaim its heap if there may be memory to reclaim. Return
+ * true if it's asked. It's called by the monitor. */
+bool csp_mem_reclaim_notify(size_t pid) {
+  if (pid >= csp_mem.len) {
+    return false;
+  }
+
+  csp_mem_heap_t *heap = &csp_mem.heaps[pid];
+  if (!atomic_load_explicit(&heap->pending, memory_order_relaxed) &&
+      atomic_load_explicit(&heap->remote, memory_order_relaxed) == NULL) {
+    return false;
+  }
+  atomic_store_explicit(&heap->reclaim, true, memory_order_relaxed);
+  return true;
+}
+
+/* Reclaim the heap of core `pid` if the monitor asked. It must be called by the
+ * owner core. */
+void csp_mem_reclaim(size_t pid) {
+  if (csp_unlikely(pid >= csp_mem.len)) {
+    return;
+  }
+
+  csp_mem_heap_t *heap = &csp_mem.heaps[pid];
+  if (atomic_load_explicit(&heap->reclaim, memory_order_relaxed) &&
+      atomic_exchange_explicit(&heap->reclaim, false, memory_order_relaxed)) {
+    csp_mem_heap_reclaim(heap);
+  }
+}
+
 void *csp_mem_alloc(size_t pid, size_t size) {
   return csp_mem_heap_alloc(&csp_mem.heaps[pid], size);
 }
 
 void csp_mem_free(size_t pid, void *obj) {
   csp_mem_heap_t *heap = &csp_mem.heaps[pid];
+  csp_preempt_disable();
 
   /*
    * The condition check `csp_this_core == NULL` matters here cause it may be
@@ -611,9 +1030,61 @@ void csp_mem_free(size_t pid, void *obj) {
     csp_msrbq_push(obj)(
       heap->mailboxes[csp_mem_meta_l1_by_addr(heap, obj)], (uintptr_t)obj
     );
+    csp_mem_heap_mark_pending(heap);
   } else {
-    csp_mem_heap_free(heap, obj);
+    csp_mem_heap_mark_pending(heap);
+    csp_mem_heap_cache_put(heap, obj);
+    csp_mem_reclaim(pid);
+  }
+  csp_preempt_enable();
+}
+
+void *csp_mem_small_alloc(size_t size) {
+  csp_preempt_disable();
+  csp_core_t *this_core = csp_this_core;
+  void *obj;
+
+  /* Fall back to the system malloc if the object is too large, we are not in
+   * a core thread(e.g. the monitor or a user thread) or the heaps are not
+   * initialized(e.g. built with `csp_with_sysmalloc`). */
+  if (csp_likely(size <= csp_mem_small_size_max && this_core != NULL &&
+      this_core->pid < csp_mem.len)) {
+    obj = csp_mem_heap_small_alloc(
+      &csp_mem.heaps[this_core->pid], csp_mem_small_class(size)
+    );
+  } else {
+    obj = malloc(size);
+  }
+  csp_preempt_enable();
+  return obj;
+}
+
+void csp_mem_small_free(void *obj) {
+  if (obj == NULL) {
+    return;
+  }
+
+  /* Objects outside of the heaps come from the system malloc. */
+  uintptr_t addr = (uintptr_t)obj;
+  size_t pid = (addr >> csp_mem_heap_size_exp) - 1;
+  if (csp_likely(addr >= csp_mem_heap_size && pid < csp_mem.len)) {
+    csp_mem_heap_t *heap = &csp_mem.heaps[pid];
+    csp_preempt_disable();
+    csp_core_t *this_core = csp_this_core;
+    if (this_core != NULL && this_core->pid == pid) {
+      csp_mem_heap_small_free(heap, obj);
+      csp_mem_heap_mark_pending(heap);
+    } else {
+      void *top = atomic_load_explicit(&heap->remote, memory_order_relaxed);
+      do {
+        *(void **)obj = top;
+      } while (!atomic_compare_exchange_weak_explicit(&heap->remote, &top, obj,
+            memory_order_release, memory_order_relaxed));
+    }
+    csp_preempt_enable();
+    return;
   }
+  free(obj);
 }
 
 void csp_mem_destroy(void) {
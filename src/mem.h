@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_MEM_H
+#define LIBCSP_MEM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/* The max object size served by the per-core slabs. Larger requests go to the
+ * system malloc. */
+#define csp_mem_small_size_max  2048
+
+/* `csp_mem_small_alloc` allocates `size` bytes of 16-byte aligned memory from
+ * the slabs of current core. Return NULL if failed. */
+void *csp_mem_small_alloc(size_t size);
+
+/* `csp_mem_small_free` frees the memory allocated by `csp_mem_small_alloc`. It
+ * can be called on any core. */
+void csp_mem_small_free(void *obj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,30 +17,46 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include "core.h"
 #include "corepool.h"
 #include "netpoll.h"
+#include "preempt.h"
 #include "proc.h"
 #include "rand.h"
+#include "stats.h"
 #include "timer.h"
+#include "topo.h"
+#include "trace.h"
 
-/* 10ms */
-#define csp_monitor_max_sleep_microsecs 10000
+/* The max time to sleep while there are io requests inflight or processes
+ * running with the preemption enabled. */
+#define csp_monitor_max_sleep (10 * csp_timer_millisecond)
 
-/* Libcsp can support at most 2048 cores. */
-#define csp_monitor_cores_len 2048
+/* Ask the cores to reclaim their memory every second. */
+#define csp_monitor_reclaim_interval csp_timer_second
 
-/* The length of csp_monitor_procs. */
+/* The length of `procs` of the monitor. */
 #define csp_monitor_procs_len 16
 
+/* The max number of CPU processors a monitor owns. */
+#define csp_monitor_group_size 16
+
 /* Put the porcesses in the link list to the array and return the number of
- * processes put. */
-#define csp_monitor_procs_put_list(start, max_len) ({                          \
+ * processes put. It stops at the first process whose priority or pinned
+ * processor differs from the ones put, so that they can be pushed to the same
+ * grunq. */
+#define csp_monitor_procs_put_list(procs, start, max_len) ({                   \
   size_t num = 0;                                                              \
   csp_proc_t *next;                                                            \
-  while ((start) != NULL && num < max_len) {                                   \
-    csp_monitor_procs[num++] = (start);                                        \
+  while ((start) != NULL && num < max_len && (num == 0 ||                      \
+      ((start)->prio.self == (procs)[0]->prio.self &&                          \
+       (start)->pin.self == (procs)[0]->pin.self))) {                          \
+    (procs)[num++] = (start);                                                  \
     next = (start)->next;                                                      \
     (start)->next = (start)->pre = NULL;                                       \
     (start) = next;                                                            \
@@ -48,110 +64,286 @@
   num;                                                                         \
 })                                                                             \
 
-csp_mmrbq_declare(csp_core_t *, core);
-
 extern int csp_sched_np;
-extern csp_mmrbq_t(core) *csp_sched_starving_threads, *csp_sched_starving_procs;
-extern int csp_netpoll_poll(csp_proc_t **start, csp_proc_t **end);
-extern int csp_timer_poll(csp_proc_t **start, csp_proc_t **end);
+extern csp_core_t *csp_sched_starving_pop(void);
+extern int csp_io_poll(const int *pids, int n, csp_proc_t **start,
+    csp_proc_t **end);
+extern int csp_netpoll_poll(const int *pids, int n, csp_proc_t **start,
+    csp_proc_t **end);
+extern int csp_timer_poll(const int *pids, int n, csp_proc_t **start,
+    csp_proc_t **end);
+extern csp_timer_time_t csp_timer_deadline(const int *pids, int n);
+extern bool csp_netpoll_watch(int epfd, const int *pids, int n);
+extern bool csp_io_watch(int epfd, const int *pids, int n);
+extern bool csp_io_pending(const int *pids, int n);
+extern bool csp_mem_reclaim_notify(size_t pid);
+
+#ifdef csp_enable_preemption
+extern bool csp_preempt_check(int64_t now, const int *pids, int n);
+#endif
+
+/*
+ * The CPU processors are split into groups of at most `csp_monitor_group_size`
+ * ones in the same NUMA node, and each group is owned by a monitor thread. The
+ * monitor polls the netpoll, the io rings and the timer wheels of its CPU
+ * processors only, and delivers the ready processes to them unless they are
+ * pinned to others.
+ *
+ * The monitor sleeps in `epfd` when there is nothing to do. It's woken up when
+ * an fd registered to the netpoll of its CPU processors gets ready, an io
+ * request completes, the timer `tfd` expires at the earliest deadline, or
+ * `efd` is written when an earlier timer is put.
+ */
+typedef struct {
+  int id;
+
+  /* The CPU processors owned. */
+  const int *pids;
+  int npids;
 
-static csp_rand_t csp_monitor_rand;
-static csp_proc_t *csp_monitor_procs[csp_monitor_procs_len];
-static csp_core_t *csp_monitor_cores[csp_monitor_cores_len];
+  int epfd, efd, tfd;
 
-bool csp_monitor_poll(int (*poll)(csp_proc_t **, csp_proc_t **)) {
+  /* The time the monitor is going to sleep until, or 0 if it's awake. */
+  atomic_int_fast64_t sleep_until;
+
+  csp_rand_t rand;
+  csp_proc_t *procs[csp_monitor_procs_len];
+} csp_monitor_t;
+
+static struct {
+  int len;
+  csp_monitor_t *monitors;
+
+  /* The monitor owning each CPU processor. */
+  csp_monitor_t **owners;
+} csp_monitors;
+
+bool csp_monitor_poll(csp_monitor_t *monitor,
+    int (*poll)(const int *, int, csp_proc_t **, csp_proc_t **),
+    csp_stats_wakeup_t source) {
   csp_proc_t *start, *end;
 
-  int n = poll(&start, &end);
+  int n = poll(monitor->pids, monitor->npids, &start, &end);
   if (n <= 0) {
     return false;
   }
 
-  csp_core_t *core;
-  if (csp_mmrbq_try_pop(core)(csp_sched_starving_procs, &core)) {
-    csp_lrunq_set(core->lrunq, n, start, end);
-    csp_cond_signal(&core->pcond, csp_cond_signal_proc_avail);
-    return true;
-  }
+  /* Prefer our starving core, it will steal the remaining procs from others
+   * after it wakes up. A starving core owned by other monitors is signaled
+   * after the procs are put as well, it will steal them. */
+  csp_core_t *core = csp_sched_starving_pop();
+  bool is_starving = core != NULL && csp_monitors.owners[core->pid] == monitor;
 
+  csp_proc_t **procs = monitor->procs;
   while (true) {
-    size_t num = csp_monitor_procs_put_list(start, csp_monitor_procs_len);
+    size_t num = csp_monitor_procs_put_list(procs, start,
+      csp_monitor_procs_len);
     if (num == 0) {
       break;
     }
-    int pid = csp_rand(&csp_monitor_rand) % csp_sched_np;
-    while (!csp_grunq_try_pushm(csp_core_pool(pid)->grunq,
-        csp_monitor_procs, num)) {
-      if (csp_unlikely(++pid >= csp_sched_np)) {
-        pid = 0;
+#ifdef csp_enable_trace
+    for (size_t i = 0; i < num; i++) {
+      csp_trace(csp_trace_event_wakeup, procs[i], source);
+    }
+#endif
+
+    /* The pinned processes must go to the pinq of their processor, which is
+     * never stolen from. Otherwise pick one of ours, they are in the same node
+     * and the memory of their stacks is likely allocated from it. */
+    int pin = procs[0]->pin.self;
+    int idx = is_starving ? -1 : csp_rand(&monitor->rand) % monitor->npids;
+    int pid = pin >= 0 ? pin : is_starving ? core->pid : monitor->pids[idx];
+    uint32_t prio = procs[0]->prio.self;
+    while (!csp_grunq_try_pushm((pin >= 0 ? csp_core_pool(pid)->pinqs :
+        csp_core_pool(pid)->grunqs)[prio], procs, num)) {
+      if (pin < 0) {
+        if (csp_unlikely(++idx >= monitor->npids)) {
+          idx = 0;
+        }
+        pid = monitor->pids[idx];
       }
     }
+
+    if (pin >= 0) {
+      csp_core_pool_wakeup(csp_core_pool(pid));
+    }
+    /* The counter of a pinned processor may belong to another monitor, which
+     * is its only writer, so charge the wakeups to one of ours instead. */
+    csp_stats_add(pin >= 0 ? monitor->pids[0] : pid, monitor_wakeups[source],
+      num);
   }
 
-  if (csp_mmrbq_try_pop(core)(csp_sched_starving_threads, &core)) {
-    csp_core_wakeup(core);
+  if (core != NULL) {
+    csp_cond_signal(&core->pcond, csp_cond_signal_proc_avail);
   }
   return true;
 }
 
+/* Ask the cores with memory to reclaim to do it. The ones sleeping are woken up
+ * to do it and they will go back to sleep if there is no process to run, the
+ * others are left alone. */
+void csp_monitor_reclaim(void) {
+  for (int pid = 0; pid < csp_sched_np; pid++) {
+    if (csp_mem_reclaim_notify(pid)) {
+      csp_core_pool_wakeup(csp_core_pool(pid));
+    }
+  }
+}
+
+/* Wake up the monitor owning CPU processor `pid` if it's going to sleep beyond
+ * `when`, e.g. a timer triggered at `when` is put to the wheel of `pid`. */
+void csp_monitor_notify(size_t pid, csp_timer_time_t when) {
+  csp_monitor_t *monitor = csp_monitors.owners[pid];
+  int_fast64_t until = atomic_load(&monitor->sleep_until);
+  while (when < until) {
+    if (atomic_compare_exchange_weak(&monitor->sleep_until, &until, 0)) {
+      eventfd_write(monitor->efd, 1);
+      return;
+    }
+  }
+}
+
+/* Sleep until `deadline`, the earliest timer or any event arrives. */
+static void csp_monitor_wait(csp_monitor_t *monitor, csp_timer_time_t now,
+    csp_timer_time_t deadline) {
+  /* Publish the deadline before checking the timers, so either we see the
+   * timer put concurrently or its putter sees us sleeping and wakes us up. */
+  atomic_store(&monitor->sleep_until, deadline);
+  csp_timer_time_t next = csp_timer_deadline(monitor->pids, monitor->npids);
+  if (next < deadline) {
+    deadline = next;
+    atomic_store(&monitor->sleep_until, deadline);
+  }
+
+  if (deadline > now) {
+    /* The timer is disarmed if there is no deadline. */
+    struct itimerspec its = {0};
+    if (deadline != INT64_MAX) {
+      its.it_value.tv_sec = deadline / csp_timer_second;
+      its.it_value.tv_nsec = deadline % csp_timer_second;
+    }
+    struct epoll_event evts[8];
+    int n = sizeof(evts) / sizeof(evts[0]);
+    if (timerfd_settime(monitor->tfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+      epoll_wait(monitor->epfd, evts, n, -1);
+    }
+
+    /* There is no need to read `tfd`, arming it again clears the expirations.
+     */
+    eventfd_t val;
+    eventfd_read(monitor->efd, &val);
+  }
+  atomic_store(&monitor->sleep_until, 0);
+}
+
 void *csp_monitor(void *data) {
-  int64_t duration = 1, since_last_checked = 0;
+  csp_monitor_t *monitor = (csp_monitor_t *)data;
+  const int *pids = monitor->pids;
+  int npids = monitor->npids;
+
+  /* Only the first monitor reclaims the memory, for all cores. */
+  bool reclaims = monitor->id == 0;
+  csp_timer_time_t reclaimed_at = csp_timer_now();
+
   while (true) {
-    if (!csp_monitor_poll(csp_netpoll_poll) &&
-        !csp_monitor_poll(csp_timer_poll)) {
-      since_last_checked += duration;
-      usleep(duration);
-
-      duration <<= 1;
-      if (duration > csp_monitor_max_sleep_microsecs) {
-        duration = csp_monitor_max_sleep_microsecs;
+    csp_timer_time_t now = csp_timer_now();
+    csp_timer_time_t deadline = INT64_MAX;
+    if (reclaims) {
+      if (now - reclaimed_at >= csp_monitor_reclaim_interval) {
+        csp_monitor_reclaim();
+        reclaimed_at = now;
       }
-    } else {
-      duration = 1;
-      /* We consider that the mointer spent `csp_monitor_max_sleep_microsecs`
-       * to poll. */
-      since_last_checked += csp_monitor_max_sleep_microsecs;
+      deadline = reclaimed_at + csp_monitor_reclaim_interval;
     }
 
-    if (since_last_checked < csp_timer_second / 1000) {
-      continue;
+#ifdef csp_enable_preemption
+    if (csp_preempt_check(now, pids, npids) &&
+        now + csp_monitor_max_sleep < deadline) {
+      deadline = now + csp_monitor_max_sleep;
     }
+#endif
 
-    size_t n = csp_mmrbq_try_popm(core)(
-      csp_sched_starving_procs, csp_monitor_cores, csp_monitor_cores_len
-    ), len = 0;
-
-    if (n > 0) {
-      csp_timer_time_t now = csp_timer_now();
-      for (size_t i = 0; i < n; i++) {
-        csp_core_t *core = csp_monitor_cores[i];
-        if (now - core->pcond.start > csp_timer_second) {
-          /* Tell the core to go to deep sleep. */
-          csp_cond_signal(&core->pcond, csp_cond_signal_deep_sleep);
-        } else {
-          csp_monitor_cores[len++] = core;
-        }
+    if (!csp_monitor_poll(monitor, csp_netpoll_poll,
+          csp_stats_wakeup_netpoll) &&
+        !csp_monitor_poll(monitor, csp_io_poll, csp_stats_wakeup_io) &&
+        !csp_monitor_poll(monitor, csp_timer_poll, csp_stats_wakeup_timer)) {
+      if (csp_io_pending(pids, npids) &&
+          now + csp_monitor_max_sleep < deadline) {
+        deadline = now + csp_monitor_max_sleep;
       }
-      while(!csp_mmrbq_try_pushm(core)(
-        csp_sched_starving_procs, csp_monitor_cores, len
-      ));
+      csp_monitor_wait(monitor, now, deadline);
     }
-
-    since_last_checked = 0;
   }
 }
 
-bool csp_monitor_init(void) {
+static bool csp_monitor_start(csp_monitor_t *monitor) {
   pthread_t tid;
   pthread_attr_t attr;
+  struct epoll_event evt = {.events = EPOLLIN};
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  int efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  int tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (epfd == -1 || efd == -1 || tfd == -1 ||
+      epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &evt) == -1 ||
+      epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &evt) == -1 ||
+      !csp_netpoll_watch(epfd, monitor->pids, monitor->npids) ||
+      !csp_io_watch(epfd, monitor->pids, monitor->npids)) {
+    return false;
+  }
+  monitor->epfd = epfd;
+  monitor->efd = efd;
+  monitor->tfd = tfd;
+  atomic_store(&monitor->sleep_until, 0);
+  csp_rand_init(&monitor->rand);
 
   if (pthread_attr_init(&attr) != 0 ||
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
-    pthread_create(&tid, &attr, csp_monitor, NULL) != 0) {
+    pthread_create(&tid, &attr, csp_monitor, monitor) != 0) {
     return false;
   }
   pthread_attr_destroy(&attr);
+  return true;
+}
+
+bool csp_monitor_init(void) {
+  /* Every node needs `ceil(n / csp_monitor_group_size)` monitors. */
+  int len = 0;
+  for (int node = 0; node < csp_topo.nnodes; node++) {
+    int n = csp_topo.node_starts[node + 1] - csp_topo.node_starts[node];
+    len += (n + csp_monitor_group_size - 1) / csp_monitor_group_size;
+  }
+
+  csp_monitors.monitors = (csp_monitor_t *)calloc(len, sizeof(csp_monitor_t));
+  csp_monitors.owners = (csp_monitor_t **)calloc(
+    csp_sched_np, sizeof(csp_monitor_t *)
+  );
+  if (csp_monitors.monitors == NULL || csp_monitors.owners == NULL) {
+    return false;
+  }
 
-  csp_rand_init(&csp_monitor_rand);
+  /* Split the CPU processors of every node into groups as even as possible,
+   * they must all be owned before any monitor starts to deliver procs. */
+  for (int node = 0; node < csp_topo.nnodes; node++) {
+    int start = csp_topo.node_starts[node];
+    int n = csp_topo.node_starts[node + 1] - start;
+    int groups = (n + csp_monitor_group_size - 1) / csp_monitor_group_size;
+    for (int i = 0; i < groups; i++) {
+      csp_monitor_t *monitor = &csp_monitors.monitors[csp_monitors.len];
+      int lo = n * i / groups, hi = n * (i + 1) / groups;
+      monitor->id = csp_monitors.len++;
+      monitor->pids = &csp_topo.node_pids[start + lo];
+      monitor->npids = hi - lo;
+      for (int j = 0; j < monitor->npids; j++) {
+        csp_monitors.owners[monitor->pids[j]] = monitor;
+      }
+    }
+  }
+
+  for (int i = 0; i < csp_monitors.len; i++) {
+    if (!csp_monitor_start(&csp_monitors.monitors[i])) {
+      return false;
+    }
+  }
   return true;
 }
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdatomic.h>
+#include "common.h"
+#include "core.h"
+#include "mutex.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "waitq.h"
+
+/* The times a process spins before parking itself. */
+#define csp_mutex_spin_times 128
+
+extern _Thread_local csp_core_t *csp_this_core;
+
+void csp_mutex_lock_slow(csp_mutex_t *mutex) {
+  /* The owner may be running on another core and unlock it soon. */
+  for (int i = 0; i < csp_mutex_spin_times; i++) {
+    if (atomic_load_explicit(&mutex->stat, memory_order_relaxed) ==
+        csp_mutex_unlocked && csp_mutex_try_lock(mutex)) {
+      return;
+    }
+    csp_cpu_relax();
+  }
+
+  csp_waiter_t waiter = {.proc = csp_sched_running(), .sel = NULL};
+  csp_spinlock_lock(&mutex->lock);
+
+  /* Mark the mutex contended so that the owner will wake us up, or take it if
+   * it has been unlocked. There is no waiter if it's unlocked. */
+  int stat = atomic_load(&mutex->stat), next;
+  while (stat != csp_mutex_contended) {
+    next = stat == csp_mutex_unlocked ? csp_mutex_locked : csp_mutex_contended;
+    if (atomic_compare_exchange_weak(&mutex->stat, &stat, next)) {
+      break;
+    }
+  }
+
+  if (stat == csp_mutex_unlocked) {
+    csp_spinlock_unlock(&mutex->lock);
+    return;
+  }
+
+  /* The lock will be released after the context of the proc is saved, and the
+   * mutex is ours when we are woken up. */
+  csp_waitq_push(&mutex->waiters, &waiter);
+  csp_sched_park(csp_waitq_unlock, &mutex->lock);
+}
+
+void csp_mutex_unlock_slow(csp_mutex_t *mutex) {
+  csp_spinlock_lock(&mutex->lock);
+  csp_waiter_t *waiter = csp_waitq_pop(&mutex->waiters);
+  if (waiter == NULL) {
+    atomic_store(&mutex->stat, csp_mutex_unlocked);
+  } else if (csp_waitq_len(&mutex->waiters) == 0) {
+    atomic_store(&mutex->stat, csp_mutex_locked);
+  }
+
+  /* Hand the mutex over to the waiter directly, so it can't be stolen by the
+   * processes which haven't waited. */
+  csp_proc_t *proc = waiter != NULL ? waiter->proc : NULL;
+  csp_spinlock_unlock(&mutex->lock);
+
+  if (proc != NULL) {
+    csp_sched_unpark(proc);
+  }
+}
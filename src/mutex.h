@@ -23,13 +23,55 @@ extern "C" {
 #endif
 
 #include <stdatomic.h>
+#include "spinlock.h"
+#include "waitq.h"
 
-#define csp_mutex_t                atomic_flag
-#define csp_mutex_try_lock(mutex)  (!atomic_flag_test_and_set(mutex))
-#define csp_mutex_lock(mutex)      while (!csp_mutex_try_lock(mutex)) {}
-#define csp_mutex_unlock(mutex)    atomic_flag_clear(mutex)
-#define csp_mutex_init(mutex)                                                  \
-  do { *(mutex) = (atomic_flag)ATOMIC_FLAG_INIT; } while (0)                   \
+#define csp_mutex_unlocked  0
+#define csp_mutex_locked    1
+
+/* The mutex is locked and there may be processes waiting for it. */
+#define csp_mutex_contended 2
+
+/*
+ * `csp_mutex_t` is the mutex used by processes. A process failing to lock it
+ * spins for a while and then parks itself in `waiters` instead of burning the
+ * core, and the owner hands the mutex over to the first waiter when unlocking.
+ */
+typedef struct {
+  atomic_int stat;
+
+  /* Protect `waiters`. */
+  csp_spinlock_t lock;
+  csp_waitq_t waiters;
+} csp_mutex_t;
+
+#define csp_mutex_init(mutex) do {                                             \
+  atomic_store(&(mutex)->stat, csp_mutex_unlocked);                            \
+  csp_spinlock_init(&(mutex)->lock);                                           \
+  csp_waitq_init(&(mutex)->waiters);                                           \
+} while (0)                                                                    \
+
+#define csp_mutex_try_lock(mutex) ({                                           \
+  int stat_ = csp_mutex_unlocked;                                              \
+  atomic_compare_exchange_strong(&(mutex)->stat, &stat_, csp_mutex_locked);    \
+})                                                                             \
+
+#define csp_mutex_lock(mutex) do {                                             \
+  if (!csp_mutex_try_lock(mutex)) {                                            \
+    csp_mutex_lock_slow(mutex);                                                \
+  }                                                                            \
+} while (0)                                                                    \
+
+#define csp_mutex_unlock(mutex) do {                                           \
+  int stat_ = csp_mutex_locked;                                                \
+  if (!atomic_compare_exchange_strong(&(mutex)->stat, &stat_,                  \
+      csp_mutex_unlocked)) {                                                   \
+    csp_mutex_unlock_slow(mutex);                                              \
+  }                                                                            \
+} while (0)                                                                    \
+
+void csp_mutex_lock_slow(csp_mutex_t *mutex);
+void csp_mutex_unlock_slow(csp_mutex_t *mutex);
 
 #ifdef __cplusplus
 }
@@ -27,50 +27,31 @@
 #include "netpoll.h"
 #include "proc.h"
 #include "runq.h"
+#include "sched.h"
+#include "spinlock.h"
 #include "timer.h"
 
+/* The max events returned by one `epoll_wait`. */
+#define csp_netpoll_evts_len 128
+
 #define csp_netpoll_waiter_proc_get(w)    atomic_load(&(w)->proc)
 #define csp_netpoll_waiter_proc_set(w, p) atomic_store(&(w)->proc, (p))
 
-#define csp_netpoll_wait(fd, timeout, evt) ({                                  \
-  csp_core_t *this_core = csp_this_core;                                       \
-                                                                               \
-  csp_proc_t *running = this_core->running;                                    \
-  csp_proc_stat_set(running, csp_proc_stat_netpoll_waiting);                   \
-                                                                               \
-  /* Set waiter to tell netpoll we are waiting the evt. */                     \
-  csp_netpoll_waiter_t *waiter = &csp_netpoll.waiters[fd];                     \
-  csp_netpoll_waiter_proc_set(waiter, running);                                \
-  waiter->waiting_evt = (evt);                                                 \
-                                                                               \
-  if ((timeout) > 0) {                                                         \
-    csp_timer_t timer = csp_timer_after(                                       \
-      (timeout), csp_netpoll_on_timeout((fd), running)                         \
-    );                                                                         \
-    csp_soft_mbarr();                                                          \
-    waiter->timer = &timer;                                                    \
-  } else {                                                                     \
-    /* Tell the netpoll there is no timer. */                                  \
-    waiter->timer = NULL;                                                      \
-  }                                                                            \
-                                                                               \
-  /* Set this_core->running to NULL to prevent this process being scheduled    \
-   * twice. */                                                                 \
-  this_core->running = NULL;                                                   \
-  csp_core_yield(running, &this_core->anchor);                                 \
-                                                                               \
-  csp_netpoll_waiter_proc_set(waiter, NULL);                                   \
-  csp_proc_stat_get(running);                                                  \
-})                                                                             \
-
 extern _Thread_local csp_core_t *csp_this_core;
 extern void csp_core_proc_exit_and_run(csp_proc_t *to_run);
-extern void csp_core_yield(csp_proc_t *proc, void *anchor);
 
 typedef struct {
+  /* Protects the waiting process against being resumed before it's fully
+   * published. */
+  csp_spinlock_t lock;
+
   /* Whether is fd is registered to the netpoll. */
   bool registered;
 
+  /* The id of the CPU processor whose epoll instance the fd is registered to.
+   */
+  size_t pid;
+
   /* The event(EPOLLIN or EPOLLOUT) we are waiting. */
   int waiting_evt;
 
@@ -82,12 +63,38 @@ typedef struct {
   csp_timer_t *timer;
 } csp_netpoll_waiter_t;
 
+/* The wait passed to the park callback, it lives on the stack of the parked
+ * process. */
+typedef struct {
+  int fd, evt;
+  csp_proc_t *proc;
+  csp_timer_duration_t timeout;
+  csp_timer_t timer;
+} csp_netpoll_wait_t;
+
+/* Each CPU processor owns an epoll instance. The core polls it before going to
+ * sleep and the monitor owning the processor polls it as a fallback. */
+typedef struct {
+  int epfd;
+
+  /* The number of fds registered to it. */
+  atomic_int nfds;
+
+  /* Used by the core only. */
+  struct epoll_event evts[csp_netpoll_evts_len];
+} csp_netpoll_poller_t;
+
 struct {
-  int epfd, waiters_cap;
+  int waiters_cap, npollers;
   csp_netpoll_waiter_t *waiters;
-  struct epoll_event evts[128];
+  csp_netpoll_poller_t *pollers;
 } csp_netpoll;
 
+/* Used by the monitors only, each of them has its own. */
+static _Thread_local struct epoll_event csp_netpoll_evts[csp_netpoll_evts_len];
+
+extern int csp_sched_np;
+
 bool csp_netpoll_init(void) {
   struct rlimit r;
   if (getrlimit(RLIMIT_NOFILE, &r) == -1 || r.rlim_max <= 0) {
@@ -102,8 +109,22 @@ bool csp_netpoll_init(void) {
     return false;
   }
 
-  csp_netpoll.epfd = epoll_create1(0);
-  return csp_netpoll.epfd != -1;
+  csp_netpoll.pollers = (csp_netpoll_poller_t *)malloc(
+    sizeof(csp_netpoll_poller_t) * csp_sched_np
+  );
+  if (csp_netpoll.pollers == NULL) {
+    return false;
+  }
+
+  for (int i = 0; i < csp_sched_np; i++) {
+    csp_netpoll_poller_t *poller = &csp_netpoll.pollers[i];
+    atomic_store(&poller->nfds, 0);
+    if ((poller->epfd = epoll_create1(0)) == -1) {
+      return false;
+    }
+    csp_netpoll.npollers++;
+  }
+  return true;
 }
 
 bool csp_netpoll_register(int fd) {
@@ -120,22 +141,71 @@ bool csp_netpoll_register(int fd) {
     .events = EPOLLET|EPOLLIN|EPOLLOUT,
     .data = {.fd = fd}
   };
-  if (epoll_ctl(csp_netpoll.epfd, EPOLL_CTL_ADD, fd, &evt) == -1) {
+
+  /* Register the fd to current CPU processor, the monitor thread uses the
+   * first one. */
+  csp_preempt_disable();
+  csp_core_t *this_core = csp_this_core;
+  size_t pid = this_core != NULL ? this_core->pid : 0;
+  csp_preempt_enable();
+  csp_netpoll_poller_t *poller = &csp_netpoll.pollers[pid];
+  if (epoll_ctl(poller->epfd, EPOLL_CTL_ADD, fd, &evt) == -1) {
     return false;
   }
 
+  atomic_fetch_add(&poller->nfds, 1);
+  csp_netpoll.waiters[fd].pid = pid;
   csp_netpoll.waiters[fd].registered = true;
   return true;
 }
 
 /* The timeout handler. */
 csp_proc static void csp_netpoll_on_timeout(int fd, csp_proc_t *proc) {
+  csp_netpoll_waiter_t *waiter = &csp_netpoll.waiters[fd];
   uint64_t stat = csp_proc_stat_netpoll_waiting;
-  if (csp_proc_stat_cas(proc, stat, csp_proc_stat_netpoll_timeout)) {
+
+  csp_spinlock_lock(&waiter->lock);
+  bool timeout = csp_proc_stat_cas(proc, stat, csp_proc_stat_netpoll_timeout);
+  csp_spinlock_unlock(&waiter->lock);
+
+  if (timeout) {
     csp_core_proc_exit_and_run(proc);
   }
 }
 
+/* Publish the waiter and arm the timer. It's called by the scheduler after the
+ * context of the process is saved, and the lock keeps the pollers and the timer
+ * from resuming it until we are done with its stack. */
+static void csp_netpoll_on_parked(void *arg) {
+  csp_netpoll_wait_t *wait = (csp_netpoll_wait_t *)arg;
+  csp_netpoll_waiter_t *waiter = &csp_netpoll.waiters[wait->fd];
+
+  csp_spinlock_lock(&waiter->lock);
+  csp_proc_stat_set(wait->proc, csp_proc_stat_netpoll_waiting);
+  waiter->waiting_evt = wait->evt;
+  if (wait->timeout > 0) {
+    wait->timer = csp_timer_after(
+      wait->timeout, csp_netpoll_on_timeout(wait->fd, wait->proc)
+    );
+    waiter->timer = &wait->timer;
+  } else {
+    /* Tell the netpoll there is no timer. */
+    waiter->timer = NULL;
+  }
+  csp_netpoll_waiter_proc_set(waiter, wait->proc);
+  csp_spinlock_unlock(&waiter->lock);
+}
+
+static int csp_netpoll_wait(int fd, csp_timer_duration_t timeout, int evt) {
+  csp_netpoll_wait_t wait = {
+    .fd = fd, .evt = evt, .proc = csp_sched_running(), .timeout = timeout
+  };
+  csp_sched_park(csp_netpoll_on_parked, &wait);
+
+  csp_netpoll_waiter_proc_set(&csp_netpoll.waiters[fd], NULL);
+  return csp_proc_stat_get(wait.proc);
+}
+
 int csp_netpoll_wait_read(int fd, csp_timer_duration_t timeout) {
   return csp_netpoll_wait(fd, timeout, EPOLLIN);
 }
@@ -144,10 +214,10 @@ int csp_netpoll_wait_write(int fd, csp_timer_duration_t timeout) {
   return csp_netpoll_wait(fd, timeout, EPOLLOUT);
 }
 
-int csp_netpoll_poll(csp_proc_t **start, csp_proc_t **end) {
-  int n = epoll_wait(csp_netpoll.epfd, csp_netpoll.evts,
-    sizeof(csp_netpoll.evts)/sizeof(struct epoll_event), 0
-  );
+/* Poll the ready processes from an epoll instance without blocking. */
+static int csp_netpoll_poll_epfd(int epfd, struct epoll_event *evts,
+    csp_proc_t **start, csp_proc_t **end) {
+  int n = epoll_wait(epfd, evts, csp_netpoll_evts_len, 0);
   if (n <= 0) {
     return 0;
   }
@@ -156,9 +226,7 @@ int csp_netpoll_poll(csp_proc_t **start, csp_proc_t **end) {
   csp_proc_t *head = NULL, *tail = NULL;
 
   for (int i = 0; i < n; i++) {
-    csp_netpoll_waiter_t *waiter = &csp_netpoll.waiters[
-      csp_netpoll.evts[i].data.fd
-    ];
+    csp_netpoll_waiter_t *waiter = &csp_netpoll.waiters[evts[i].data.fd];
 
     csp_proc_t *proc = csp_netpoll_waiter_proc_get(waiter);
     if (proc == NULL) {
@@ -166,25 +234,31 @@ int csp_netpoll_poll(csp_proc_t **start, csp_proc_t **end) {
     }
 
     uint32_t mask = 0;
-    if (csp_netpoll.evts[i].events & EPOLLIN) {
+    if (evts[i].events & EPOLLIN) {
       mask |= EPOLLIN;
     }
-    if (csp_netpoll.evts[i].events & EPOLLOUT) {
+    if (evts[i].events & EPOLLOUT) {
       mask |= EPOLLOUT;
     }
     /* Regard EPOLLERR and EPOLLHUP as success. The caller should handle the
      * error in the following read or write. */
-    if (csp_netpoll.evts[i].events & (EPOLLERR|EPOLLHUP)) {
+    if (evts[i].events & (EPOLLERR|EPOLLHUP)) {
       mask |= EPOLLIN|EPOLLOUT;
     }
 
+    if (!(mask & waiter->waiting_evt)) {
+      continue;
+    }
+
     uint64_t stat = csp_proc_stat_netpoll_waiting;
-    if ((mask & waiter->waiting_evt) &&
-        csp_proc_stat_cas(proc, stat, csp_proc_stat_netpoll_avail)) {
-      if (waiter->timer != NULL) {
-        csp_timer_cancel(*waiter->timer);
-      }
+    csp_spinlock_lock(&waiter->lock);
+    bool avail = csp_proc_stat_cas(proc, stat, csp_proc_stat_netpoll_avail);
+    if (avail && waiter->timer != NULL) {
+      csp_timer_cancel(*waiter->timer);
+    }
+    csp_spinlock_unlock(&waiter->lock);
 
+    if (avail) {
       if (tail != NULL) {
         tail->next = proc;
         proc->pre = tail;
@@ -204,11 +278,68 @@ int csp_netpoll_poll(csp_proc_t **start, csp_proc_t **end) {
   return len;
 }
 
+/* Poll the epoll instance of CPU processor `pid`. It's called by the core
+ * before it goes to sleep. */
+int csp_netpoll_poll_core(size_t pid, csp_proc_t **start, csp_proc_t **end) {
+  csp_netpoll_poller_t *poller = &csp_netpoll.pollers[pid];
+  if (atomic_load_explicit(&poller->nfds, memory_order_relaxed) == 0) {
+    return 0;
+  }
+  return csp_netpoll_poll_epfd(poller->epfd, poller->evts, start, end);
+}
+
+/* Poll the epoll instances of the `n` CPU processors in `pids`. It's called by
+ * the monitor owning them. */
+int csp_netpoll_poll(const int *pids, int n, csp_proc_t **start,
+    csp_proc_t **end) {
+  int total = 0;
+  csp_proc_t *head, *tail;
+
+  for (int i = 0; i < n; i++) {
+    csp_netpoll_poller_t *poller = &csp_netpoll.pollers[pids[i]];
+    if (atomic_load_explicit(&poller->nfds, memory_order_relaxed) == 0) {
+      continue;
+    }
+
+    int len = csp_netpoll_poll_epfd(poller->epfd, csp_netpoll_evts, &head,
+      &tail);
+    if (len > 0) {
+      if (total != 0) {
+        (*end)->next = head;
+        head->pre = *end;
+        *end = tail;
+      } else {
+        *start = head;
+        *end = tail;
+      }
+      total += len;
+    }
+  }
+  return total;
+}
+
+/* Add the epoll instances of the `n` CPU processors in `pids` to `epfd`, so
+ * that the monitor sleeping in it is woken up when any of their fds gets ready.
+ */
+bool csp_netpoll_watch(int epfd, const int *pids, int n) {
+  for (int i = 0; i < n; i++) {
+    struct epoll_event evt = {.events = EPOLLET|EPOLLIN};
+    int fd = csp_netpoll.pollers[pids[i]].epfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &evt) == -1) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool csp_netpoll_unregister(int fd) {
-  if (epoll_ctl(csp_netpoll.epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+  csp_netpoll_waiter_t *waiter = &csp_netpoll.waiters[fd];
+  csp_netpoll_poller_t *poller = &csp_netpoll.pollers[waiter->pid];
+  if (epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
     return false;
   }
-  csp_netpoll.waiters[fd].registered = false;
+  atomic_fetch_sub(&poller->nfds, 1);
+  waiter->registered = false;
   return true;
 }
 
@@ -219,5 +350,9 @@ void csp_netpoll_destroy() {
     }
   }
   free(csp_netpoll.waiters);
-  close(csp_netpoll.epfd);
+
+  for (int i = 0; i < csp_netpoll.npollers; i++) {
+    close(csp_netpoll.pollers[i].epfd);
+  }
+  free(csp_netpoll.pollers);
 }
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cpuid.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include "preempt.h"
+#include "proc.h"
+
+#ifdef csp_enable_preemption
+
+/* The size of the red zone of System V x86_64 ABI. */
+#define csp_preempt_red_zone        128
+
+/* The stack used by the trampoline besides the xsave area, i.e. the return
+ * address, the saved registers, the alignment and the frames of
+ * `csp_sched_yield`. */
+#define csp_preempt_frame_size      512
+
+/* The state components saved by xsave, i.e. x87, SSE, AVX and AVX-512. The
+ * AMX tiles are not saved, they must be released before the processes switch
+ * anyway. */
+#define csp_preempt_xsave_features  0xe7
+
+/* The bounds of the text of the program, defined by the linker. */
+extern char __executable_start, etext;
+
+extern int csp_sched_np;
+extern _Thread_local csp_core_t *csp_this_core;
+
+csp_preempt_slot_t *csp_preempt_slots;
+
+/* Positive if the current thread runs the runtime code or holds spinlocks, see
+ * `csp_preempt_disable`. */
+_Thread_local int csp_preempt_disabled;
+
+static bool csp_preempt_enabled;
+
+/* The switches of each CPU processor seen by its monitor last time, and when
+ * it changed. */
+static uint64_t *csp_preempt_seen;
+static int64_t *csp_preempt_seen_at;
+
+/* Accessed by the trampoline. */
+__attribute__((used)) static uint64_t csp_preempt_xsave_size;
+__attribute__((used)) static uint32_t csp_preempt_xsave_mask;
+
+/*
+ * The preempted process continues here. The signal handler has pushed the
+ * address it was interrupted at below the red zone, so it looks like that the
+ * process called us. We save all the registers the process may be using, yield
+ * and restore them after it's scheduled again.
+ */
+__attribute__((naked,used)) static void csp_preempt_trampoline(void) {
+  __asm__ __volatile__(
+    "pushfq\n"
+    "push %rax\n"
+    "push %rcx\n"
+    "push %rdx\n"
+    "push %rsi\n"
+    "push %rdi\n"
+    "push %r8\n"
+    "push %r9\n"
+    "push %r10\n"
+    "push %r11\n"
+    "push %rbx\n"
+    "mov  %rsp, %rbx\n"
+
+    /* Make room for the xsave area which should be 64-bytes aligned and whose
+     * header should be zero. */
+    "sub  csp_preempt_xsave_size(%rip), %rsp\n"
+    "and  $-64, %rsp\n"
+    "xor  %eax, %eax\n"
+    "mov  %rax, 0x200(%rsp)\n"
+    "mov  %rax, 0x208(%rsp)\n"
+    "mov  %rax, 0x210(%rsp)\n"
+    "mov  %rax, 0x218(%rsp)\n"
+    "mov  %rax, 0x220(%rsp)\n"
+    "mov  %rax, 0x228(%rsp)\n"
+    "mov  %rax, 0x230(%rsp)\n"
+    "mov  %rax, 0x238(%rsp)\n"
+    "xor  %edx, %edx\n"
+    "mov  csp_preempt_xsave_mask(%rip), %eax\n"
+    "xsave64 (%rsp)\n"
+
+    "cld\n"
+    "call csp_sched_yield@plt\n"
+
+    "xor  %edx, %edx\n"
+    "mov  csp_preempt_xsave_mask(%rip), %eax\n"
+    "xrstor64 (%rsp)\n"
+    "mov  %rbx, %rsp\n"
+    "pop  %rbx\n"
+    "pop  %r11\n"
+    "pop  %r10\n"
+    "pop  %r9\n"
+    "pop  %r8\n"
+    "pop  %rdi\n"
+    "pop  %rsi\n"
+    "pop  %rdx\n"
+    "pop  %rcx\n"
+    "pop  %rax\n"
+    "popfq\n"
+
+    /* Return to where it was interrupted and skip the red zone. */
+    "retq $128\n"
+  );
+}
+
+/*
+ * We only preempt the process if it's interrupted in the code of the program,
+ * i.e. not in libc or libcsp whose state we don't know, and it doesn't hold any
+ * spinlock or wait for any child. The address range can't tell libcsp apart
+ * when it's linked statically or its macros are inlined to the program, so the
+ * runtime disables the preemption explicitly too.
+ */
+static void csp_preempt_handler(int sig, siginfo_t *info, void *ctx) {
+  csp_core_t *this_core = csp_this_core;
+  if (this_core == NULL || csp_preempt_disabled > 0) {
+    return;
+  }
+
+  csp_proc_t *proc = this_core->running;
+  greg_t *regs = ((ucontext_t *)ctx)->uc_mcontext.gregs;
+  uintptr_t rip = regs[REG_RIP], rsp = regs[REG_RSP];
+  if (proc == NULL || csp_proc_nchild_get(proc) != 0 ||
+      rsp < csp_proc_stack_bottom(proc) + csp_preempt_stack_reserve ||
+      rsp >= (uintptr_t)proc ||
+      rip < (uintptr_t)&__executable_start || rip >= (uintptr_t)&etext) {
+    return;
+  }
+
+  rsp -= csp_preempt_red_zone + sizeof(uintptr_t);
+  *(uintptr_t *)rsp = rip;
+  regs[REG_RSP] = rsp;
+  regs[REG_RIP] = (uintptr_t)csp_preempt_trampoline;
+}
+
+/* Compute the size of the xsave area. It returns false if xsave is not
+ * supported. */
+static bool csp_preempt_xsave_init(void) {
+  uint32_t eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)) {
+    return false;
+  }
+
+  uint32_t xcr0_lo, xcr0_hi;
+  __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  csp_preempt_xsave_mask = xcr0_lo & csp_preempt_xsave_features;
+
+  /* The legacy area and the header. */
+  uint64_t size = 576;
+  for (int i = 2; i < 8; i++) {
+    if (csp_preempt_xsave_mask & (1 << i)) {
+      __cpuid_count(0x0d, i, eax, ebx, ecx, edx);
+      if (ebx + eax > size) {
+        size = ebx + eax;
+      }
+    }
+  }
+  csp_preempt_xsave_size = size;
+  return csp_preempt_red_zone + csp_preempt_frame_size + size <=
+    csp_preempt_stack_reserve;
+}
+
+bool csp_preempt_init(void) {
+  csp_preempt_slots = (csp_preempt_slot_t *)aligned_alloc(
+    _Alignof(csp_preempt_slot_t), sizeof(csp_preempt_slot_t) * csp_sched_np
+  );
+  csp_preempt_seen = (uint64_t *)calloc(csp_sched_np, sizeof(uint64_t));
+  csp_preempt_seen_at = (int64_t *)calloc(csp_sched_np, sizeof(int64_t));
+  if (csp_preempt_slots == NULL || csp_preempt_seen == NULL ||
+      csp_preempt_seen_at == NULL) {
+    return false;
+  }
+  memset(csp_preempt_slots, 0, sizeof(csp_preempt_slot_t) * csp_sched_np);
+
+  /* Fall back to the cooperative scheduling silently if the CPU can't save
+   * the state of the processes for us. */
+  if (!csp_preempt_xsave_init()) {
+    return true;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = csp_preempt_handler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(csp_preempt_signal, &sa, NULL) != 0) {
+    return false;
+  }
+
+  csp_preempt_enabled = true;
+  return true;
+}
+
+/* The stacks of the processes are too small for the signal handler, so each
+ * core thread handles the signal on its own alternate stack. */
+bool csp_preempt_thread_init(void) {
+  stack_t ss;
+  if (!csp_preempt_enabled ||
+      (sigaltstack(NULL, &ss) == 0 && !(ss.ss_flags & SS_DISABLE))) {
+    return true;
+  }
+
+  ss.ss_size = SIGSTKSZ > (1 << 16) ? SIGSTKSZ : (1 << 16);
+  ss.ss_sp = malloc(ss.ss_size);
+  ss.ss_flags = 0;
+  return ss.ss_sp != NULL && sigaltstack(&ss, NULL) == 0;
+}
+
+/* Called by the monitor owning the `n` CPU processors in `pids` periodically,
+ * signal their cores running the same process for longer than
+ * `csp_preempt_slice`. Return whether any of them is running a process, i.e.
+ * whether it should be called again soon. */
+bool csp_preempt_check(int64_t now, const int *pids, int n) {
+  if (!csp_preempt_enabled) {
+    return false;
+  }
+
+  bool running = false;
+
+  for (int i = 0; i < n; i++) {
+    int pid = pids[i];
+    csp_preempt_slot_t *slot = &csp_preempt_slots[pid];
+    csp_core_t *core = atomic_load_explicit(&slot->core, memory_order_relaxed);
+    uint64_t switches = atomic_load_explicit(
+      &slot->switches, memory_order_relaxed
+    );
+
+    running |= core != NULL;
+    if (core == NULL || switches != csp_preempt_seen[pid]) {
+      csp_preempt_seen[pid] = switches;
+      csp_preempt_seen_at[pid] = now;
+    } else if (now - csp_preempt_seen_at[pid] >= csp_preempt_slice) {
+      pthread_kill(core->tid, csp_preempt_signal);
+      csp_preempt_seen_at[pid] = now;
+    }
+  }
+  return running;
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_PREEMPT_H
+#define LIBCSP_PREEMPT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <signal.h>
+#include <stdatomic.h>
+#include "core.h"
+
+/* The signal sent to the core running a process for too long. */
+#define csp_preempt_signal          SIGURG
+
+/* A process is preempted if it has run for so long without switching. */
+#define csp_preempt_slice           (10 * 1000 * 1000)
+
+/* The stack space reserved for the preemption trampoline, i.e. the red zone,
+ * the saved registers and the xsave area. It's added to the stack size of
+ * every process by `cspcli analyze`. */
+#define csp_preempt_stack_reserve   (1 << 12)
+
+#ifdef csp_enable_preemption
+
+/* The core running on each CPU processor and the times it switched, only
+ * written by that core and read by the monitor. */
+typedef struct {
+  _Alignas(64) _Atomic(csp_core_t *) core;
+  atomic_uint_fast64_t switches;
+} csp_preempt_slot_t;
+
+extern csp_preempt_slot_t *csp_preempt_slots;
+
+/* The core `c` is going to run a process, which may have switched out with
+ * the preemption disabled. */
+#define csp_preempt_mark(c) do {                                               \
+  csp_preempt_slot_t *slot = &csp_preempt_slots[(c)->pid];                     \
+  csp_preempt_reset();                                                         \
+  atomic_store_explicit(&slot->core, (c), memory_order_relaxed);               \
+  atomic_store_explicit(&slot->switches,                                       \
+    atomic_load_explicit(&slot->switches, memory_order_relaxed) + 1,           \
+    memory_order_relaxed                                                       \
+  );                                                                           \
+} while (0)                                                                    \
+
+/* The core on the CPU processor `pid` is going to sleep or block. */
+#define csp_preempt_clear(pid)                                                 \
+  atomic_store_explicit(                                                       \
+    &csp_preempt_slots[pid].core, NULL, memory_order_relaxed                   \
+  )                                                                            \
+
+#else
+
+#define csp_preempt_mark(c)
+#define csp_preempt_clear(pid)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
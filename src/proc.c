@@ -19,7 +19,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "core.h"
+#include "guard.h"
 #include "proc.h"
+#include "sched.h"
+#include "trace.h"
 
 /* Total processes generated by libcsp plugin. */
 extern size_t csp_procs_num;
@@ -34,11 +37,24 @@ extern void *csp_mem_alloc(size_t pid, size_t size);
 extern void csp_mem_free(size_t pid, void *obj);
 #endif
 
+#ifdef csp_enable_proc_accounting
+extern void csp_acct_proc_new(size_t pid, csp_proc_t *proc, int fn);
+extern void csp_acct_proc_destroy(csp_proc_t *proc);
+#endif
+
 csp_proc_t *csp_proc_new(int id, bool waited_by_parent) {
+  csp_preempt_disable();
   csp_core_t *this_core = csp_this_core;
   size_t size = csp_procs_size[id];
 
-#ifdef csp_with_sysmalloc
+#ifdef csp_enable_stack_guard
+  /* The guard page is below the stack, so the stack size is unchanged. */
+  size += csp_guard_size;
+#endif
+
+#if defined(csp_with_sysmalloc) && defined(csp_enable_stack_guard)
+  uintptr_t base = (uintptr_t)aligned_alloc(csp_guard_size, size);
+#elif defined(csp_with_sysmalloc)
   uintptr_t base = (uintptr_t)malloc(size);
 #else
   uintptr_t base = (uintptr_t)csp_mem_alloc(this_core->pid, size);
@@ -50,6 +66,8 @@ csp_proc_t *csp_proc_new(int id, bool waited_by_parent) {
     exit(EXIT_FAILURE);
   }
 
+  csp_guard_protect(base);
+
   csp_proc_t *proc = (csp_proc_t *)(base + size - sizeof(csp_proc_t));
   proc->base = base;
   proc->is_new = true;
@@ -67,14 +85,32 @@ csp_proc_t *csp_proc_new(int id, bool waited_by_parent) {
   }
   proc->pre = proc->next = NULL;
 
+  /* The process inherits the priority its parent gives to the children. */
+  proc->prio.self = proc->prio.child = this_core->running == NULL ?
+    csp_proc_prio_normal : this_core->running->prio.child;
+  proc->pin.self = proc->pin.child = this_core->running == NULL ?
+    -1 : this_core->running->pin.child;
+
+#ifdef csp_enable_stack_guard
+  proc->fn = id;
+#endif
+
 #ifdef csp_enable_valgrind
-  proc->valgrind_stack = VALGRIND_STACK_REGISTER(proc->base, proc);
+  proc->valgrind_stack = VALGRIND_STACK_REGISTER(
+    csp_proc_stack_bottom(proc), proc
+  );
+#endif
+
+#ifdef csp_enable_proc_accounting
+  csp_acct_proc_new(this_core->pid, proc, id);
 #endif
+  csp_trace(csp_trace_event_create, proc, id);
+  csp_preempt_enable();
   return proc;
 }
 
 __attribute__((noinline,used)) void csp_proc_nchild_set(size_t nchild) {
-  atomic_store(&csp_this_core->running->nchild, nchild);
+  atomic_store(&csp_sched_running()->nchild, nchild);
 }
 
 __attribute__((naked)) void csp_proc_restore(csp_proc_t *proc) {
@@ -112,10 +148,16 @@ __attribute__((naked)) void csp_proc_restore(csp_proc_t *proc) {
 }
 
 __attribute__((noinline)) void csp_proc_destroy(csp_proc_t *proc) {
+#ifdef csp_enable_proc_accounting
+  csp_acct_proc_destroy(proc);
+#endif
+
 #ifdef csp_enable_valgrind
   VALGRIND_STACK_DEREGISTER(proc->valgrind_stack);
 #endif
 
+  csp_guard_unprotect(proc->base);
+
 #ifdef csp_with_sysmalloc
   free((void *)proc->base);
 #else
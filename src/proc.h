@@ -25,6 +25,7 @@ extern "C" {
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include "guard.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -52,6 +53,19 @@ extern "C" {
 #define csp_proc_stat_cas(proc, oval, nval)                                    \
   atomic_compare_exchange_weak(&(proc)->stat, &(oval), nval)
 
+#define csp_proc_prio_latency           0
+#define csp_proc_prio_normal            1
+#define csp_proc_prio_background        2
+#define csp_proc_prio_num               3
+
+/* The lowest address the stack of the process can use, the guard page below
+ * it is not part of the stack. */
+#ifdef csp_enable_stack_guard
+#define csp_proc_stack_bottom(p)        ((p)->base + csp_guard_size)
+#else
+#define csp_proc_stack_bottom(p)        ((p)->base)
+#endif
+
 #define csp_proc_save(reg)                                                     \
   "stmxcsr   0x18(%"reg")\n"                                                   \
   "fstcw     0x1c(%"reg")\n"                                                   \
@@ -144,7 +158,7 @@ typedef struct csp_proc_t {
   /* The waiting parent process. */
   struct csp_proc_t *parent;
 
-  /* Used in lrunq. */
+  /* Used in the proc lists of timer and netpoll. */
   struct csp_proc_t *pre, *next;
 
   /* Number of children the porcess is waiting. */
@@ -153,10 +167,33 @@ typedef struct csp_proc_t {
   /* The state of process. */
   atomic_uint_fast64_t stat;
 
+  /* The priority of the process itself and the priority of the processes it
+   * spawns. */
+  struct { uint32_t self, child; } prio;
+
+  /* The CPU processor the process is pinned to and the one the processes it
+   * spawns are pinned to, -1 if not pinned. */
+  struct { int32_t self, child; } pin;
+
+#ifdef csp_enable_stack_guard
+  /* The id of its wrapper function, reported when the stack overflows. */
+  int64_t fn;
+#endif
+
 #ifdef csp_enable_valgrind
   /* The id returned by VALGRIND_STACK_REGISTER. */
   uint64_t valgrind_stack;
 #endif
+
+#ifdef csp_enable_proc_accounting
+  /* The accounting information, i.e. the unique id of the process, the id of
+   * its wrapper function, the time it was created, the time it ran and the
+   * times it was switched to. */
+  struct {
+    uint64_t id;
+    int64_t fn, created_at, run_nanosecs, switches;
+  } acct;
+#endif
 } csp_proc_t;
 
 void csp_proc_nchild_set(size_t nchild);
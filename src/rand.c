@@ -26,7 +26,7 @@ void csp_rand_init(csp_rand_t *r) {
   for (int i = 0; i < sizeof(r->state) / sizeof(uint64_t); i++) {
     r->state[i] = rand();
   }
-  csp_mutex_init(&r->mutex);
+  csp_spinlock_init(&r->lock);
 }
 
 uint64_t csp_rand(csp_rand_t *r) {
@@ -298,24 +298,27 @@ typedef struct {
   bool csp_rbq_name(rbqt, try_push, I)(void *rbq, T item) {                    \
     csp_rbq_name(rbqt, t, I) *q = (csp_rbq_name(rbqt, t, I) *)rbq;             \
                                                                                \
-    uint_fast64_t                                                              \
-      sbarr = csp_rbq_ptr_name(slow_ptr_t, barr_get)(q->slow),                 \
-      fnext = csp_rbq_ptr_name(fast_ptr_t, next_get)(q->fast);                 \
+    /* Retry if we lost the race to other writers, so that `false` always      \
+     * means the queue is full. */                                             \
+    while (true) {                                                             \
+      uint_fast64_t                                                            \
+        sbarr = csp_rbq_ptr_name(slow_ptr_t, barr_get)(q->slow),               \
+        fnext = csp_rbq_ptr_name(fast_ptr_t, next_get)(q->fast);               \
                                                                                \
-    if (csp_unlikely(sbarr + q->cap <= fnext)) {                               \
-      sbarr = csp_rbq_ptr_name(slow_ptr_t, barr_update)(q->slow, q->mask);     \
       if (csp_unlikely(sbarr + q->cap <= fnext)) {                             \
-        return false;                                                          \
+        sbarr = csp_rbq_ptr_name(slow_ptr_t, barr_update)(q->slow, q->mask);   \
+        if (csp_unlikely(sbarr + q->cap <= fnext)) {                           \
+          return false;                                                        \
+        }                                                                      \
       }                                                                        \
-    }                                                                          \
                                                                                \
-    if (csp_likely(                                                            \
-        csp_rbq_ptr_name(fast_ptr_t, next_rsv)(q->fast, fnext, 1))) {          \
-      csp_rbq_items_set(q, fnext, item);                                       \
-      csp_rbq_ptr_name(fast_ptr_t, mark_avail)(q->fast, fnext, q->mask);       \
-      return true;                                                             \
+      if (csp_likely(                                                          \
+          csp_rbq_ptr_name(fast_ptr_t, next_rsv)(q->fast, fnext, 1))) {        \
+        csp_rbq_items_set(q, fnext, item);                                     \
+        csp_rbq_ptr_name(fast_ptr_t, mark_avail)(q->fast, fnext, q->mask);     \
+        return true;                                                           \
+      }                                                                        \
     }                                                                          \
-    return false;                                                              \
   }                                                                            \
                                                                                \
   void csp_rbq_name(rbqt, push, I)(void *rbq, T item) {                        \
@@ -348,24 +351,27 @@ typedef struct {
   bool csp_rbq_name(rbqt, try_pop, I)(void *rbq, T *item) {                    \
     csp_rbq_name(rbqt, t, I) *q = (csp_rbq_name(rbqt, t, I) *)rbq;             \
                                                                                \
-    uint_fast64_t                                                              \
-      snext = csp_rbq_ptr_name(slow_ptr_t, next_get)(q->slow),                 \
-      fbarr = csp_rbq_ptr_name(fast_ptr_t, barr_get)(q->fast);                 \
+    /* Retry if we lost the race to other readers, so that `false` always      \
+     * means the queue is empty. */                                            \
+    while (true) {                                                             \
+      uint_fast64_t                                                            \
+        snext = csp_rbq_ptr_name(slow_ptr_t, next_get)(q->slow),               \
+        fbarr = csp_rbq_ptr_name(fast_ptr_t, barr_get)(q->fast);               \
                                                                                \
-    if (csp_unlikely(snext >= fbarr)) {                                        \
-      fbarr = csp_rbq_ptr_name(fast_ptr_t, barr_update)(q->fast, q->mask);     \
       if (csp_unlikely(snext >= fbarr)) {                                      \
-        return false;                                                          \
+        fbarr = csp_rbq_ptr_name(fast_ptr_t, barr_update)(q->fast, q->mask);   \
+        if (csp_unlikely(snext >= fbarr)) {                                    \
+          return false;                                                        \
+        }                                                                      \
       }                                                                        \
-    }                                                                          \
                                                                                \
-    if (csp_likely(                                                            \
-        csp_rbq_ptr_name(slow_ptr_t, next_rsv)(q->slow, snext, 1))) {          \
-      csp_rbq_items_get(q, snext, item);                                       \
-      csp_rbq_ptr_name(slow_ptr_t, mark_avail)(q->slow, snext, q->mask);       \
-      return true;                                                             \
+      if (csp_likely(                                                          \
+          csp_rbq_ptr_name(slow_ptr_t, next_rsv)(q->slow, snext, 1))) {        \
+        csp_rbq_items_get(q, snext, item);                                     \
+        csp_rbq_ptr_name(slow_ptr_t, mark_avail)(q->slow, snext, q->mask);     \
+        return true;                                                           \
+      }                                                                        \
     }                                                                          \
-    return false;                                                              \
   }                                                                            \
                                                                                \
   void csp_rbq_name(rbqt, pop, I)(void *rbq, T *item) {                        \
@@ -397,7 +403,7 @@ typedef struct {
   bool csp_rbq_name(rbqt, try_pushm, I)(void *rbq, T *items, size_t n) {       \
     csp_rbq_name(rbqt, t, I) *q = (csp_rbq_name(rbqt, t, I) *)rbq;             \
                                                                                \
-    if (csp_likely(n > 1)) {                                                   \
+    while (csp_likely(n > 1)) {                                                \
       uint_fast64_t                                                            \
         sbarr = csp_rbq_ptr_name(slow_ptr_t, barr_get)(q->slow),               \
         fnext = csp_rbq_ptr_name(fast_ptr_t, next_get)(q->fast);               \
@@ -417,7 +423,6 @@ typedef struct {
         );                                                                     \
         return true;                                                           \
       }                                                                        \
-      return false;                                                            \
     }                                                                          \
     return n == 1 ? csp_rbq_name(rbqt, try_push, I)(q, *items) : true;         \
   }                                                                            \
@@ -475,7 +480,7 @@ typedef struct {
   size_t csp_rbq_name(rbqt, try_popm, I)(void *rbq, T *items, size_t n) {      \
     csp_rbq_name(rbqt, t, I) *q = (csp_rbq_name(rbqt, t, I) *)rbq;             \
                                                                                \
-    if (csp_likely(n > 1)) {                                                   \
+    while (csp_likely(n > 1)) {                                                \
       uint_fast64_t                                                            \
         snext = csp_rbq_ptr_name(slow_ptr_t, next_get)(q->slow),               \
         fbarr = csp_rbq_ptr_name(fast_ptr_t, barr_get)(q->fast);               \
@@ -505,7 +510,6 @@ typedef struct {
         }                                                                      \
         return len;                                                            \
       }                                                                        \
-      return 0;                                                                \
     }                                                                          \
     return csp_likely(n == 1) ? csp_rbq_name(rbqt, try_pop, I)(q, items) : 0;  \
   }                                                                            \
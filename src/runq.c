@@ -20,84 +20,137 @@
 
 csp_mmrbq_define(csp_proc_t *, proc);
 
-csp_lrunq_t *csp_lrunq_new() {
+static csp_lrunq_array_t *csp_lrunq_array_new(int64_t cap,
+    csp_lrunq_array_t *pre) {
+  csp_lrunq_array_t *array = (csp_lrunq_array_t *)malloc(
+    sizeof(csp_lrunq_array_t) + sizeof(csp_proc_t *) * cap
+  );
+  if (array != NULL) {
+    array->mask = cap - 1;
+    array->pre = pre;
+  }
+  return array;
+}
+
+csp_lrunq_t *csp_lrunq_new(size_t cap_exp) {
   csp_lrunq_t *lrunq = (csp_lrunq_t *)malloc(sizeof(csp_lrunq_t));
   if (lrunq == NULL) {
     return NULL;
   }
-  lrunq->len = 0;
-  lrunq->head = lrunq->tail = NULL;
+
+  csp_lrunq_array_t *array = csp_lrunq_array_new(1 << cap_exp, NULL);
+  if (array == NULL) {
+    free(lrunq);
+    return NULL;
+  }
+
+  atomic_store(&lrunq->array, array);
+  atomic_store(&lrunq->top, 0);
+  atomic_store(&lrunq->bottom, 0);
   lrunq->poped_times = 0;
   return lrunq;
 }
 
-void csp_lrunq_push(csp_lrunq_t *lrunq, csp_proc_t *proc) {
-  if (lrunq->tail != NULL) {
-    lrunq->tail->next = proc;
-    proc->pre = lrunq->tail;
-    lrunq->tail = proc;
-  } else {
-    lrunq->head = lrunq->tail = proc;
+/* Push a proc to the bottom and grow the array if it's full. It can only be
+ * called by the owner. It returns false only if we are out of memory. */
+bool csp_lrunq_push(csp_lrunq_t *lrunq, csp_proc_t *proc) {
+  int64_t
+    b = atomic_load_explicit(&lrunq->bottom, memory_order_relaxed),
+    t = atomic_load_explicit(&lrunq->top, memory_order_acquire);
+  csp_lrunq_array_t *array = atomic_load_explicit(
+    &lrunq->array, memory_order_relaxed
+  );
+
+  if (csp_unlikely(b - t > array->mask)) {
+    csp_lrunq_array_t *new_array = csp_lrunq_array_new(
+      (array->mask + 1) << 1, array
+    );
+    if (new_array == NULL) {
+      return false;
+    }
+    for (int64_t i = t; i < b; i++) {
+      atomic_store_explicit(&new_array->procs[i & new_array->mask],
+        atomic_load_explicit(&array->procs[i & array->mask],
+          memory_order_relaxed),
+        memory_order_relaxed);
+    }
+    atomic_store_explicit(&lrunq->array, new_array, memory_order_release);
+    array = new_array;
   }
-  lrunq->len++;
+
+  atomic_store_explicit(&array->procs[b & array->mask], proc,
+    memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&lrunq->bottom, b + 1, memory_order_relaxed);
+  return true;
 }
 
-void csp_lrunq_push_front(csp_lrunq_t *lrunq, csp_proc_t *proc) {
-  if (lrunq->head != NULL) {
-    proc->next = lrunq->head;
-    lrunq->head->pre = proc;
-    lrunq->head = proc;
-  } else {
-    lrunq->head = lrunq->tail = proc;
+/* Pop a proc from the bottom. It can only be called by the owner. */
+bool csp_lrunq_try_pop(csp_lrunq_t *lrunq, csp_proc_t **proc) {
+  int64_t b = atomic_load_explicit(&lrunq->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&lrunq->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t t = atomic_load_explicit(&lrunq->top, memory_order_relaxed);
+
+  if (csp_unlikely(t > b)) {
+    atomic_store_explicit(&lrunq->bottom, b + 1, memory_order_relaxed);
+    return false;
   }
-  lrunq->len++;
-}
 
-int csp_lrunq_try_pop_front(csp_lrunq_t *lrunq, csp_proc_t **proc) {
-  if (csp_unlikely((lrunq->poped_times & 0x1f) == 0x1f)) {
-    lrunq->poped_times++;
-    return csp_lrunq_missed;
+  csp_lrunq_array_t *array = atomic_load_explicit(
+    &lrunq->array, memory_order_relaxed
+  );
+  *proc = atomic_load_explicit(
+    &array->procs[b & array->mask], memory_order_relaxed
+  );
+  if (csp_likely(t < b)) {
+    return true;
   }
 
-  if (csp_unlikely(lrunq->head == NULL)) {
+  /* It's the last one, so we should race with the thieves for it. */
+  bool ok = atomic_compare_exchange_strong_explicit(
+    &lrunq->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed
+  );
+  atomic_store_explicit(&lrunq->bottom, b + 1, memory_order_relaxed);
+  return ok;
+}
+
+/* Steal a proc from the top. It can be called by any core. It returns
+ * `csp_lrunq_missed` if we lost the race with the owner or other thieves. */
+int csp_lrunq_try_steal(csp_lrunq_t *lrunq, csp_proc_t **proc) {
+  int64_t t = atomic_load_explicit(&lrunq->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t b = atomic_load_explicit(&lrunq->bottom, memory_order_acquire);
+
+  if (t >= b) {
     return csp_lrunq_failed;
   }
 
-  *proc = lrunq->head;
-  if (lrunq->head != lrunq->tail) {
-    lrunq->head = (*proc)->next;
-    lrunq->head->pre = NULL;
-    (*proc)->next = NULL;
-  } else {
-    lrunq->head = lrunq->tail = NULL;
+  csp_lrunq_array_t *array = atomic_load_explicit(
+    &lrunq->array, memory_order_acquire
+  );
+  csp_proc_t *top = atomic_load_explicit(
+    &array->procs[t & array->mask], memory_order_relaxed
+  );
+  if (!atomic_compare_exchange_strong_explicit(&lrunq->top, &t, t + 1,
+      memory_order_seq_cst, memory_order_relaxed)) {
+    return csp_lrunq_missed;
   }
 
-  lrunq->len--;
-  lrunq->poped_times++;
+  *proc = top;
   return csp_lrunq_ok;
 }
 
-/* `n` should be guaranteed by caller to be `0 < n <= lrunq->len`. */
-void csp_lrunq_popm_front(
-    csp_lrunq_t *lrunq, size_t n, csp_proc_t **start, csp_proc_t **end) {
-  lrunq->len -= n;
-
-  if (csp_unlikely(lrunq->len == 0)) {
-    *start = lrunq->head;
-    *end = lrunq->tail;
-    lrunq->head = lrunq->tail = NULL;
+void csp_lrunq_destroy(csp_lrunq_t *lrunq) {
+  if (lrunq == NULL) {
     return;
   }
 
-  *start = lrunq->head;
-  for (int i = 0; i < n; i++) {
-    lrunq->head = lrunq->head->next;
+  csp_lrunq_array_t *array = atomic_load(&lrunq->array), *pre;
+  while (array != NULL) {
+    pre = array->pre;
+    free(array);
+    array = pre;
   }
-  *end = lrunq->head->pre;
-  lrunq->head->pre = NULL;
-  (*end)->next = NULL;
-}
-
-void csp_lrunq_destroy(csp_lrunq_t *lrunq) {
   free(lrunq);
 }
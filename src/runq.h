@@ -22,10 +22,13 @@
 extern "C" {
 #endif
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include "proc.h"
 #include "rbq.h"
-#include "mutex.h"
+#include "spinlock.h"
 
 #define csp_grunq_t          csp_mmrbq_t(proc)
 #define csp_grunq_new        csp_mmrbq_new(proc)
@@ -37,28 +40,48 @@ extern "C" {
 #define csp_lrunq_ok         0
 #define csp_lrunq_failed     -1
 #define csp_lrunq_missed     1
-#define csp_lrunq_len(lrunq) ((lrunq)->len)
-#define csp_lrunq_set(lrunq, n, start, end) do {                               \
-  (lrunq)->head = (start);                                                     \
-  (lrunq)->tail = (end);                                                       \
-  (lrunq)->len = (n);                                                          \
-} while (0)                                                                    \
+#define csp_lrunq_len(lrunq) ({                                                \
+  int64_t len_ = atomic_load(&(lrunq)->bottom) - atomic_load(&(lrunq)->top);   \
+  (size_t)(len_ > 0 ? len_ : 0);                                               \
+})                                                                             \
 
 csp_mmrbq_declare(csp_proc_t *, proc);
 
+/*
+ * `csp_lrunq_t` is the lock-free work-stealing deque of Chase and Lev(see
+ * `Dynamic Circular Work-Stealing Deque` and `Correct and Efficient
+ * Work-Stealing for Weak Memory Models`).
+ *
+ * The owner core pushes and pops procs at the bottom, so the most recently
+ * spawned proc runs first and its data is still hot in the cache. Other cores
+ * steal the oldest procs from the top.
+ *
+ * The circular array grows when it's full. The thieves may still read the old
+ * arrays, so they are kept in the `pre` list until the deque is destroyed.
+ * Their total size is less than the current one.
+ */
+typedef struct csp_lrunq_array_t {
+  int64_t mask;
+  struct csp_lrunq_array_t *pre;
+  _Atomic(csp_proc_t *) procs[];
+} csp_lrunq_array_t;
+
 typedef struct {
-  csp_proc_t *head, *tail;
-  size_t len;
+  csp_rbq_padding_t _top;
+  atomic_int_fast64_t top;
+  csp_rbq_padding_t _bottom;
+  atomic_int_fast64_t bottom;
+  csp_rbq_padding_t _array;
+  _Atomic(csp_lrunq_array_t *) array;
+
+  /* Only used by the owner to check the grunq periodically. */
   int64_t poped_times;
 } csp_lrunq_t;
 
-csp_lrunq_t *csp_lrunq_new();
-void csp_lrunq_push(csp_lrunq_t *lrunq, csp_proc_t *proc);
-void csp_lrunq_push_front(csp_lrunq_t *lrunq, csp_proc_t *proc);
-int csp_lrunq_try_pop_front(csp_lrunq_t *lrunq, csp_proc_t **proc);
-void csp_lrunq_popm_front(csp_lrunq_t *lrunq, size_t n, csp_proc_t **start,
-  csp_proc_t **end
-);
+csp_lrunq_t *csp_lrunq_new(size_t cap_exp);
+bool csp_lrunq_push(csp_lrunq_t *lrunq, csp_proc_t *proc);
+bool csp_lrunq_try_pop(csp_lrunq_t *lrunq, csp_proc_t **proc);
+int csp_lrunq_try_steal(csp_lrunq_t *lrunq, csp_proc_t **proc);
 void csp_lrunq_destroy(csp_lrunq_t *lrunq);
 
 #ifdef __cplusplus
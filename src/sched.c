@@ -21,16 +21,29 @@
 #include "common.h"
 #include "core.h"
 #include "corepool.h"
+#include "preempt.h"
 #include "rbq.h"
 #include "runq.h"
 #include "sched.h"
+#include "stats.h"
 #include "timer.h"
+#include "topo.h"
+#include "trace.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+/* Whether the proc is pinned to a processor other than the one of the core. */
+#define csp_sched_pinned_away(core, proc)                                      \
+  ((proc)->pin.self >= 0 && (proc)->pin.self != (int32_t)(core)->pid)          \
+
+/* Whether the proc is pinned to the processor of the core. */
+#define csp_sched_pinned_here(core, proc)                                      \
+  ((proc)->pin.self == (int32_t)(core)->pid)                                   \
+
 extern size_t csp_cpu_cores;
+extern size_t csp_max_threads;
 extern _Thread_local csp_core_t *csp_this_core;
 
 extern void csp_core_init_main(csp_core_t *core);
@@ -39,10 +52,35 @@ extern bool csp_core_pools_init(void);
 extern bool csp_core_pools_get(size_t pid, csp_core_t **core);
 extern void csp_core_pools_destroy(void);
 extern void csp_core_yield(csp_proc_t *proc, void *anchor);
+extern void csp_mem_reclaim(size_t pid);
 extern bool csp_monitor_init(void);
 extern bool csp_netpoll_init(void);
-extern bool csp_timer_heaps_init(void);
-extern void csp_timer_heaps_destroy(void);
+extern int csp_netpoll_poll_core(size_t pid, csp_proc_t **start,
+    csp_proc_t **end);
+extern bool csp_io_init(void);
+extern int csp_io_poll_core(size_t pid, csp_proc_t **start, csp_proc_t **end);
+extern bool csp_stats_init(void);
+
+#ifdef csp_enable_preemption
+extern bool csp_preempt_init(void);
+#endif
+
+#ifdef csp_enable_stack_guard
+extern bool csp_guard_init(void);
+#endif
+
+#ifdef csp_enable_proc_accounting
+extern bool csp_acct_init(void);
+extern void csp_acct_switch_in(csp_core_t *core, csp_proc_t *proc);
+extern void csp_acct_switch_out(csp_core_t *core);
+#endif
+#ifdef csp_enable_trace
+extern bool csp_trace_init(void);
+#endif
+
+extern bool csp_timer_wheels_init(void);
+extern bool csp_topo_init(void);
+extern void csp_timer_wheels_destroy(void);
 extern void csp_timer_put(size_t pid, csp_proc_t *proc);
 
 #ifndef csp_with_sysmalloc
@@ -54,7 +92,26 @@ csp_mmrbq_declare(csp_core_t *, core);
 csp_mmrbq_define(csp_core_t *, core);
 
 int csp_sched_np;
-csp_mmrbq_t(core) *csp_sched_starving_threads, *csp_sched_starving_procs;
+csp_mmrbq_t(core) *csp_sched_starving_procs;
+
+/* Pop a starving core, NULL if there is none. The caller must signal it, it
+ * may have gone to sleep again without queueing itself. */
+csp_core_t *csp_sched_starving_pop(void) {
+  csp_core_t *core;
+  if (!csp_mmrbq_try_pop(core)(csp_sched_starving_procs, &core)) {
+    return NULL;
+  }
+  atomic_store(&core->starving, false);
+  return core;
+}
+
+/* Wake up a starving core if any, e.g. to steal the procs just put. */
+void csp_sched_starving_wakeup(void) {
+  csp_core_t *core = csp_sched_starving_pop();
+  if (core != NULL) {
+    csp_cond_signal(&core->pcond, csp_cond_signal_proc_avail);
+  }
+}
 
 __attribute__((constructor)) static void csp_sched_start() {
   /* Get the number of processores. */
@@ -67,20 +124,58 @@ __attribute__((constructor)) static void csp_sched_start() {
     csp_sched_np = csp_cpu_cores;
   }
 
-  csp_sched_starving_threads = csp_mmrbq_new(core)(csp_exp(csp_sched_np));
-  if (csp_sched_starving_threads == NULL) {
+  /* Every core is queued at most once, so pushing to it never fails. */
+  csp_sched_starving_procs = csp_mmrbq_new(core)(
+    csp_exp(csp_sched_np + csp_max_threads)
+  );
+  if (csp_sched_starving_procs == NULL) {
     errno = ENOMEM;
     perror("Failed to initialize starving queue.");
     exit(EXIT_FAILURE);
   }
 
-  csp_sched_starving_procs = csp_mmrbq_new(core)(csp_exp(csp_sched_np));
-  if (csp_sched_starving_procs == NULL) {
+  if (!csp_topo_init()) {
     errno = ENOMEM;
-    perror("Failed to initialize starving queue.");
+    perror("Failed to initialize topology.");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!csp_stats_init()) {
+    errno = ENOMEM;
+    perror("Failed to initialize stats.");
     exit(EXIT_FAILURE);
   }
 
+#ifdef csp_enable_preemption
+  if (!csp_preempt_init()) {
+    perror("Failed to initialize preemption.");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+#ifdef csp_enable_stack_guard
+  if (!csp_guard_init()) {
+    perror("Failed to initialize stack guard.");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+#ifdef csp_enable_proc_accounting
+  if (!csp_acct_init()) {
+    errno = ENOMEM;
+    perror("Failed to initialize process accounting.");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+#ifdef csp_enable_trace
+  if (!csp_trace_init()) {
+    errno = ENOMEM;
+    perror("Failed to initialize trace.");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
   if (!csp_core_pools_init()) {
     errno = ENOMEM;
     perror("Failed to initialize core pools.");
@@ -100,9 +195,15 @@ __attribute__((constructor)) static void csp_sched_start() {
     exit(EXIT_FAILURE);
   }
 
-  if (!csp_timer_heaps_init()) {
+  if (!csp_io_init()) {
     errno = ENOMEM;
-    perror("Failed to initialize timer heaps.");
+    perror("Failed to initialize io.");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!csp_timer_wheels_init()) {
+    errno = ENOMEM;
+    perror("Failed to initialize timer wheels.");
     exit(EXIT_FAILURE);
   }
 
@@ -123,86 +224,358 @@ __attribute__((constructor)) static void csp_sched_start() {
   }
 }
 
+/* Put the proc to the pinq of the processor it's pinned to and wake up the
+ * processor if it's sleeping. */
+static void csp_sched_put_pinned(csp_proc_t *proc) {
+  csp_core_pool_t *pool = csp_core_pool(proc->pin.self);
+  while (!csp_grunq_try_push(pool->pinqs[proc->prio.self], proc));
+  csp_core_pool_wakeup(pool);
+}
+
+/* The procs pinned to this processor go to its pinq so that nobody steals them
+ * only to give them back. If the pinq is full they go to the lrunq, we can't
+ * wait for it to be drained as we are the one draining it. */
 void csp_sched_put_proc(csp_proc_t *proc) {
-  csp_lrunq_push_front(csp_this_core->lrunq, proc);
+  csp_preempt_disable();
+  csp_core_t *this_core = csp_this_core;
+  if (csp_unlikely(csp_sched_pinned_away(this_core, proc))) {
+    csp_sched_put_pinned(proc);
+  } else if ((csp_likely(!csp_sched_pinned_here(this_core, proc)) ||
+      !csp_grunq_try_push(this_core->pinqs[proc->prio.self], proc)) &&
+      csp_unlikely(!csp_lrunq_push(this_core->lrunqs[proc->prio.self], proc))) {
+    perror("Failed to grow the lrunq.");
+    exit(EXIT_FAILURE);
+  }
+  csp_preempt_enable();
 }
 
-/* We must return the proc cause we may use it in `csp_timer_cancel`. */
+/* We must return the proc cause we may use it in `csp_timer_cancel`, which
+ * looks up the wheel by `borned_pid`, so put it there rather than on the wheel
+ * of this core, which differs if it's preempted and migrated after spawning. */
 csp_proc_t *csp_sched_put_timer(csp_proc_t *proc) {
-  csp_timer_put(csp_this_core->pid, proc);
+  csp_timer_put(proc->borned_pid, proc);
   return proc;
 }
 
-csp_proc_t *csp_sched_get(csp_core_t *this_core) {
-  int pid, code;
-  csp_proc_t *running = this_core->running, *proc;
+/* Get a proc of priority `prio` from the runqs of this processor. */
+static bool csp_sched_get_prio(csp_core_t *this_core, uint32_t prio,
+    csp_proc_t **proc) {
+  csp_lrunq_t *lrunq = this_core->lrunqs[prio];
+  csp_grunq_t *grunq = this_core->grunqs[prio], *pinq = this_core->pinqs[prio];
+
+  /* Check the grunq and the pinq first periodically, otherwise the procs in
+   * them may starve when the procs in lrunq keep spawning new procs. */
+  if (csp_unlikely((++lrunq->poped_times & 0x1f) == 0) &&
+      (csp_grunq_try_pop(grunq, proc) || csp_grunq_try_pop(pinq, proc))) {
+    csp_stats_incr(this_core->pid, grunq_pops);
+    return true;
+  }
+  if (csp_lrunq_try_pop(lrunq, proc)) {
+    csp_stats_incr(this_core->pid, lrunq_pops);
+    return true;
+  }
+  if (csp_grunq_try_pop(pinq, proc) || csp_grunq_try_pop(grunq, proc)) {
+    csp_stats_incr(this_core->pid, grunq_pops);
+    return true;
+  }
+  return false;
+}
 
-  while (true) {
-    code = csp_lrunq_try_pop_front(this_core->lrunq, &proc);
-    if (code == csp_lrunq_ok || (code == csp_lrunq_missed && (
-        csp_grunq_try_pop(csp_core_pool(this_core->pid)->grunq, &proc) ||
-        csp_lrunq_try_pop_front(this_core->lrunq, &proc) == csp_lrunq_ok))) {
-      goto found;
+/*
+ * Get a proc from the runqs of this processor. The higher priorities are
+ * checked first, except that the normal ones go first every 8 picks and the
+ * background ones every 64 picks, so the lower priorities still make progress
+ * when the higher ones saturate the processor.
+ */
+static bool csp_sched_get_local(csp_core_t *this_core, csp_proc_t **proc) {
+  uint64_t picks = ++this_core->picks;
+  uint32_t first = (picks & 0x3f) == 0 ? csp_proc_prio_background :
+    (picks & 0x07) == 0 ? csp_proc_prio_normal : csp_proc_prio_latency;
+
+  if (csp_sched_get_prio(this_core, first, proc)) {
+    return true;
+  }
+  for (uint32_t prio = 0; prio < csp_proc_prio_num; prio++) {
+    if (prio != first && csp_sched_get_prio(this_core, prio, proc)) {
+      return true;
     }
+  }
+  return false;
+}
 
-    pid = this_core->pid;
-    for (int i = 0; i < csp_sched_np; i++) {
-      if (csp_grunq_try_pop(csp_core_pool(pid)->grunq, &proc)) {
-        goto found;
-      }
-      if (++pid == csp_sched_np) {
-        pid = 0;
+/*
+ * Steal a proc from other processors level by level, i.e. the ones sharing the
+ * L2 cache first, then the L3 cache, the package and the others. In each level
+ * we start from a random victim so that the idle processors don't all rush to
+ * the same one, and take its proc of the highest priority.
+ */
+static bool csp_sched_steal(csp_core_t *this_core, csp_proc_t **proc) {
+  int *victims = csp_topo_steal_order(this_core->pid);
+  int *ends = csp_topo_steal_ends(this_core->pid), code;
+
+  /* xorshift32 */
+  uint32_t r = this_core->steal_seed;
+  r ^= r << 13;
+  r ^= r >> 17;
+  r ^= r << 5;
+  this_core->steal_seed = r;
+
+  csp_stats_incr(this_core->pid, steal_attempts);
+
+  for (int start = 0; start < csp_sched_np - 1; start = ends[start]) {
+    int n = ends[start] - start, first = r % n;
+    for (int i = 0; i < n; i++) {
+      int pid = victims[start + (first + i) % n];
+      csp_core_pool_t *victim = csp_core_pool(pid);
+      for (int prio = 0; prio < csp_proc_prio_num; prio++) {
+        while ((code = csp_lrunq_try_steal(victim->lrunqs[prio], proc)) ==
+            csp_lrunq_missed);
+        if (code != csp_lrunq_ok &&
+            !csp_grunq_try_pop(victim->grunqs[prio], proc)) {
+          continue;
+        }
+        /* Give the proc pinned to the victim back to it, it's in the lrunq
+         * only if the pinq of the victim was full. */
+        if (csp_unlikely(csp_sched_pinned_away(this_core, *proc))) {
+          csp_sched_put_pinned(*proc);
+          continue;
+        }
+        csp_stats_incr(this_core->pid, steals);
+        csp_trace(csp_trace_event_steal, *proc, pid);
+        return true;
       }
     }
+  }
+  return false;
+}
+
+/* Put the processes ready in the epoll instance or the io ring of this
+ * processor to the runqs. Return true if any. */
+static bool csp_sched_poll(csp_core_t *this_core,
+    int (*poll)(size_t, csp_proc_t **, csp_proc_t **),
+    csp_stats_wakeup_t source) {
+  csp_proc_t *start, *end, *next;
+  int n = poll(this_core->pid, &start, &end);
+  if (n <= 0) {
+    return false;
+  }
+  csp_stats_add(this_core->pid, wakeups[source], n);
+
+  end->next = NULL;
+  for (; start != NULL; start = next) {
+    next = start->next;
+    start->pre = start->next = NULL;
+    csp_trace(csp_trace_event_wakeup, start, source);
+    csp_sched_put_proc(start);
+  }
+  return true;
+}
+
+csp_proc_t *csp_sched_get(csp_core_t *this_core) {
+  csp_trace_stop(csp_trace_event_yield);
+
+  /* The context of the parked proc has been saved, it's safe to wake it up
+   * from now on. */
+  if (this_core->park.fn != NULL) {
+    this_core->park.fn(this_core->park.arg);
+    this_core->park.fn = NULL;
+  }
+
+#ifdef csp_enable_proc_accounting
+  csp_acct_switch_out(this_core);
+#endif
 
+  csp_proc_t *running = this_core->running, *proc;
+  bool is_runnable = running != NULL && csp_proc_nchild_get(running) == 0;
+
+  /* The running proc has been pinned to another processor. */
+  if (is_runnable && csp_unlikely(csp_sched_pinned_away(this_core, running))) {
+    csp_sched_put_pinned(running);
+    is_runnable = false;
+  }
+
+  while (!csp_sched_get_local(this_core, &proc) &&
+      !csp_sched_steal(this_core, &proc)) {
     /* If stealing failed, we continue to run current proc if it's valid. */
-    if (running != NULL && csp_proc_nchild_get(running) == 0) {
+    if (is_runnable) {
+#ifdef csp_enable_proc_accounting
+      csp_acct_switch_in(this_core, running);
+#endif
+      csp_preempt_mark(this_core);
+      csp_trace_run(running);
       return running;
     }
 
-    /* We must call this before push it to the starving queue, otherwise there
-     * will be data race with monitor. */
-    csp_cond_before_wait(&this_core->pcond);
+    /* Run the processes whose network events are ready or whose io requests
+     * are completed before sleeping, the monitor only polls them
+     * periodically. */
+    if (csp_sched_poll(this_core, csp_netpoll_poll_core,
+          csp_stats_wakeup_netpoll) ||
+        csp_sched_poll(this_core, csp_io_poll_core, csp_stats_wakeup_io)) {
+      continue;
+    }
 
-    while(!csp_mmrbq_try_push(core)(csp_sched_starving_procs, this_core));
-    if (csp_cond_wait(&this_core->pcond) == csp_cond_signal_deep_sleep) {
-      pthread_mutex_lock(&this_core->mutex);
-      while(!csp_mmrbq_try_push(core)(csp_sched_starving_threads, this_core));
-      pthread_cond_wait(&this_core->cond, &this_core->mutex);
-      pthread_mutex_unlock(&this_core->mutex);
+    /* Return the idle memory to the OS before sleeping if the monitor asked. */
+    csp_mem_reclaim(this_core->pid);
+
+    /* Let the procs pinned to this processor and the ones put anywhere wake
+     * us up, and check the runqs again in case one was put before we were
+     * published. We may be queued already if a pinned proc woke us up last
+     * time, the one popping us will signal us anyway. */
+    csp_core_pool_t *pool = csp_core_pool(this_core->pid);
+    atomic_store(&pool->sleeper, this_core);
+    if (!atomic_exchange(&this_core->starving, true)) {
+      csp_mmrbq_try_push(core)(csp_sched_starving_procs, this_core);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (csp_sched_get_local(this_core, &proc)) {
+      atomic_store(&pool->sleeper, NULL);
+      break;
     }
-  }
 
-found:
-  if (running != NULL && csp_proc_nchild_get(running) == 0) {
-    csp_lrunq_push(this_core->lrunq, running);
+    /* Spin for a while and then park the thread until someone signals us. */
+    csp_preempt_clear(this_core->pid);
+    csp_timer_time_t sleep_at = csp_timer_now();
+    csp_cond_wait(&this_core->pcond);
+    atomic_store(&pool->sleeper, NULL);
+
+    csp_stats_incr(this_core->pid, sleeps);
+    csp_stats_add(this_core->pid, sleep_nanosecs, csp_timer_now() - sleep_at);
+    if (this_core->pcond.slept) {
+      csp_stats_incr(this_core->pid, deep_sleeps);
+    }
   }
 
-  size_t half = (csp_lrunq_len(this_core->lrunq) + 1) >> 1;
-  if (half == 0) {
-    return proc;
+  /* The yielded proc should run after the pending ones, so we put it to the
+   * tail of the grunq, or the pinq if it's pinned here, instead of the bottom
+   * of the lrunq. */
+  if (is_runnable && !csp_grunq_try_push((csp_sched_pinned_here(this_core,
+      running) ? this_core->pinqs : this_core->grunqs)[running->prio.self],
+      running)) {
+    csp_sched_put_proc(running);
   }
+  csp_stats_incr(this_core->pid, switches);
 
-  csp_core_t *starving_core;
-  if (csp_mmrbq_try_pop(core)(csp_sched_starving_procs, &starving_core)) {
-    csp_proc_t *start = NULL, *end = NULL;
-    csp_lrunq_popm_front(this_core->lrunq, half, &start, &end);
-    csp_lrunq_set(starving_core->lrunq, half, start, end);
-    csp_cond_signal(&starving_core->pcond, csp_cond_signal_proc_avail);
+  /* Wake up a starving core to steal the remaining procs. */
+  if (csp_core_lrunqs_len(this_core) > 0) {
+    csp_sched_starving_wakeup();
   }
+
+#ifdef csp_enable_proc_accounting
+  csp_acct_switch_in(this_core, proc);
+#endif
+  csp_preempt_mark(this_core);
+  csp_trace_run(proc);
   return proc;
 }
 
+/* The functions switching out current process disable the preemption and the
+ * scheduler resets it after the switch, see `csp_preempt_mark`. */
 void csp_sched_yield(void) {
+  csp_preempt_disable();
   csp_core_t *this_core = csp_this_core;
   csp_core_yield(this_core->running, &this_core->anchor);
 }
 
+/* Change the priority of current process. It takes effect the next time the
+ * process is put to the runqs. */
+bool csp_sched_set_prio(uint32_t prio) {
+  if (prio >= csp_proc_prio_num) {
+    errno = EINVAL;
+    return false;
+  }
+  csp_sched_running()->prio.self = prio;
+  return true;
+}
+
+/* Set the priority of the processes spawned by current process and return the
+ * previous one. An invalid `prio` means the normal priority. */
+uint32_t csp_sched_spawn_prio(uint32_t prio) {
+  csp_proc_t *running = csp_sched_running();
+  uint32_t prev = running->prio.child;
+  running->prio.child = prio < csp_proc_prio_num ?
+    prio : csp_proc_prio_normal;
+  return prev;
+}
+
+/* Pin current process to the CPU processor `pid`, or unpin it if `pid` is -1.
+ * The process moves to that processor at once. */
+bool csp_sched_pin(int32_t pid) {
+  if (pid < -1 || pid >= csp_sched_np) {
+    errno = EINVAL;
+    return false;
+  }
+
+  csp_preempt_disable();
+  csp_core_t *this_core = csp_this_core;
+  this_core->running->pin.self = pid;
+  if (pid != -1 && pid != this_core->pid) {
+    csp_core_yield(this_core->running, &this_core->anchor);
+  } else {
+    csp_preempt_enable();
+  }
+  return true;
+}
+
+/* Set the processor the processes spawned by current process are pinned to and
+ * return the previous one. An invalid `pid` means not to pin them. */
+int32_t csp_sched_spawn_pin(int32_t pid) {
+  csp_proc_t *running = csp_sched_running();
+  int32_t prev = running->pin.child;
+  running->pin.child = pid >= 0 && pid < csp_sched_np ? pid : -1;
+  return prev;
+}
+
+int csp_sched_nprocs(void) {
+  return csp_sched_np;
+}
+
+int csp_sched_current_pid(void) {
+  csp_preempt_disable();
+  int pid = csp_this_core->pid;
+  csp_preempt_enable();
+  return pid;
+}
+
+void csp_sched_park(void (*fn)(void *), void *arg) {
+  csp_preempt_disable();
+  csp_core_t *this_core = csp_this_core;
+  csp_proc_t *running = this_core->running;
+
+  this_core->park.fn = fn;
+  this_core->park.arg = arg;
+
+  /* Set `this_core->running` to NULL so that it will only be scheduled after
+   * someone calls `csp_sched_unpark`. */
+  this_core->running = NULL;
+  csp_core_yield(running, &this_core->anchor);
+}
+
+void csp_sched_unpark(csp_proc_t *proc) {
+  if (csp_likely(csp_this_core != NULL)) {
+    csp_sched_put_proc(proc);
+    return;
+  }
+
+  /* We are not in a core thread, e.g. in the monitor. */
+  if (proc->pin.self >= 0) {
+    csp_sched_put_pinned(proc);
+    return;
+  }
+  while (!csp_grunq_try_push(
+    csp_core_pool(proc->borned_pid)->grunqs[proc->prio.self], proc
+  ));
+
+  /* All cores may be sleeping, wake up one to steal it. */
+  csp_sched_starving_wakeup();
+}
+
 void csp_sched_hangup(uint64_t nanoseconds) {
   if (csp_unlikely(nanoseconds == 0)) {
     return;
   }
 
+  csp_preempt_disable();
   csp_core_t *this_core = csp_this_core;
   csp_proc_t *running = this_core->running;
   running->timer.when = csp_timer_now() + nanoseconds;
@@ -24,6 +24,7 @@ extern "C" {
 
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "core.h"
 #include "timer.h"
 
@@ -37,18 +38,68 @@ extern "C" {
   csp_sched_yield();                                                           \
 } while (0)                                                                    \
 
+/* Run the tasks with the priority `prio`, and the processes spawned by them
+ * inherit it too. */
+#define csp_sched_async_prio(prio, tasks)                                      \
+  csp_sched_run_prio(false, prio, tasks)                                       \
+
+#define csp_sched_sync_prio(prio, tasks)                                       \
+  csp_sched_run_prio(true, prio, tasks)                                        \
+
+#define csp_sched_run_prio(is_sync, prio, tasks) do {                          \
+  uint32_t csp_sched_prio_ = csp_sched_spawn_prio(prio);                       \
+  csp_sched_run(is_sync, tasks);                                               \
+  csp_sched_spawn_prio(csp_sched_prio_);                                       \
+} while (0)                                                                    \
+
+/* Run the tasks pinned to the CPU processor `pid`, and the processes spawned
+ * by them are pinned to it too. */
+#define csp_sched_async_on(pid, tasks)                                         \
+  csp_sched_run_on(false, pid, tasks)                                          \
+
+#define csp_sched_sync_on(pid, tasks)                                          \
+  csp_sched_run_on(true, pid, tasks)                                           \
+
+#define csp_sched_run_on(is_sync, pid, tasks) do {                             \
+  int32_t csp_sched_pin_ = csp_sched_spawn_pin(pid);                           \
+  csp_sched_run(is_sync, tasks);                                               \
+  csp_sched_spawn_pin(csp_sched_pin_);                                         \
+} while (0)                                                                    \
+
+/* The process must stay on the core it hands off, so it's not preempted. The
+ * epilogue switches it out and the scheduler resets the counter, so it's only
+ * re-enabled when there is no handoff. */
 #define csp_sched_block(tasks) do {                                            \
+  csp_preempt_disable();                                                       \
   csp_core_t *this_core = csp_this_core;                                       \
   if (csp_core_block_prologue(this_core)) {                                    \
     { tasks; }                                                                 \
     csp_core_block_epilogue(this_core, this_core->running);                    \
   } else {                                                                     \
     { tasks; }                                                                 \
+    csp_preempt_enable();                                                      \
   }                                                                            \
 } while (0)                                                                    \
 
+/* The current process. It's not preempted between loading `csp_this_core` and
+ * its `running`, otherwise it may load the one of another core. */
+#define csp_sched_running() ({                                                 \
+  csp_preempt_disable();                                                       \
+  csp_proc_t *running_ = csp_this_core->running;                               \
+  csp_preempt_enable();                                                        \
+  running_;                                                                    \
+})                                                                             \
+
 void csp_sched_yield(void);
+bool csp_sched_set_prio(uint32_t prio);
+uint32_t csp_sched_spawn_prio(uint32_t prio);
+bool csp_sched_pin(int32_t pid);
+int32_t csp_sched_spawn_pin(int32_t pid);
+int csp_sched_nprocs(void);
+int csp_sched_current_pid(void);
 void csp_sched_hangup(uint64_t nanoseconds);
+void csp_sched_park(void (*fn)(void *), void *arg);
+void csp_sched_unpark(csp_proc_t *proc);
 void csp_sched_proc_anchor(bool need_sync) __attribute__((noinline));
 void csp_shced_atomic_incr(atomic_uint_fast64_t *cnt) __attribute__((noinline));
 
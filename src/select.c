@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "chan.h"
+#include "core.h"
+#include "proc.h"
+#include "sched.h"
+#include "select.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "waitq.h"
+
+#define csp_select_chan(c)  ((csp_chan_base_t *)(c)->chan)
+#define csp_select_waitq(c) ((c)->op == csp_select_send ?                      \
+  &csp_select_chan(c)->senders : &csp_select_chan(c)->receivers)               \
+
+extern _Thread_local csp_core_t *csp_this_core;
+
+typedef struct {
+  /* The proc running the select. */
+  csp_proc_t *proc;
+
+  /* The cases with distinct channels sorted by the addresses of the channels,
+   * we always lock the channels in this order to avoid deadlocks. */
+  csp_select_case_t *locked;
+
+  /* The state shared by the waiters of the cases. */
+  csp_waiter_sel_t sel;
+
+  /* Set by the timer when it fires and when it finishes. */
+  atomic_bool timed_out, timer_done;
+} csp_select_t;
+
+/* Try the case without blocking. `locked` tells whether we hold the lock of
+ * the channel.
+ *
+ * For the buffered channels the waiters of the other side are not woken up,
+ * so it's safe to call it while holding the locks of the channels. For the
+ * unbuffered channels the item is handed off to the waiter directly. */
+static bool csp_select_try(csp_select_case_t *c, bool locked) {
+  csp_chan_base_t *chan = csp_select_chan(c);
+  if (csp_chan_is_unbuffered(chan)) {
+    if (c->op == csp_select_send) {
+      return locked ? csp_chan_handoff_send(chan, c->item) :
+        csp_chan_unbuffered_try_push(chan, c->item);
+    }
+    return locked ? csp_chan_handoff_recv(chan, c->item) :
+      csp_chan_unbuffered_try_pop(chan, c->item);
+  }
+
+  return c->op == csp_select_send ?
+    chan->try_push_raw(chan->rbq, c->item) :
+    chan->try_pop_raw(chan->rbq, c->item);
+}
+
+/* Wake up a waiter of the other side after the case succeeded. */
+static void csp_select_wake(csp_select_case_t *c) {
+  csp_chan_base_t *chan = csp_select_chan(c);
+  if (csp_chan_is_unbuffered(chan)) {
+    return;
+  }
+  if (c->op == csp_select_send) {
+    csp_chan_wake(chan, receivers, 1);
+  } else {
+    csp_chan_wake(chan, senders, 1);
+  }
+}
+
+/* Pass the wakeup of the waiter of the case to another waiter of the same side
+ * if the select didn't take it. */
+static void csp_select_rewake(csp_select_case_t *c) {
+  csp_chan_base_t *chan = csp_select_chan(c);
+  if (csp_chan_is_unbuffered(chan)) {
+    return;
+  }
+  if (c->op == csp_select_send) {
+    csp_chan_wake(chan, senders, 1);
+  } else {
+    csp_chan_wake(chan, receivers, 1);
+  }
+}
+
+static csp_select_case_t *csp_select_sort(csp_select_case_t *cases, size_t n) {
+  csp_select_case_t *head = NULL, **pos;
+  for (size_t i = 0; i < n; i++) {
+    pos = &head;
+    while (*pos != NULL &&
+        (uintptr_t)(*pos)->chan < (uintptr_t)cases[i].chan) {
+      pos = &(*pos)->next_locked;
+    }
+    if (*pos == NULL || (*pos)->chan != cases[i].chan) {
+      cases[i].next_locked = *pos;
+      *pos = &cases[i];
+    }
+  }
+  return head;
+}
+
+static void csp_select_lock(csp_select_case_t *locked) {
+  for (; locked != NULL; locked = locked->next_locked) {
+    csp_spinlock_lock(&csp_select_chan(locked)->lock);
+  }
+}
+
+static void csp_select_unlock(csp_select_case_t *locked) {
+  for (; locked != NULL; locked = locked->next_locked) {
+    csp_spinlock_unlock(&csp_select_chan(locked)->lock);
+  }
+}
+
+/* Remove the waiters which are still in the waitqs. The caller should hold the
+ * locks of the channels. */
+static void csp_select_unregister(csp_select_case_t *cases, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    csp_waitq_t *waitq = csp_select_waitq(&cases[i]);
+    if (csp_waitq_has(waitq, &cases[i].waiter)) {
+      csp_waitq_remove(waitq, &cases[i].waiter);
+    }
+  }
+}
+
+/* Called by the scheduler after the context of the proc is saved. */
+static void csp_select_on_parked(void *data) {
+  csp_select_t *select = (csp_select_t *)data;
+  csp_proc_t *proc = select->proc;
+
+  csp_select_unlock(select->locked);
+  if (atomic_fetch_add(&select->sel.handoff, 1) == 1) {
+    csp_sched_unpark(proc);
+  }
+}
+
+csp_proc static void csp_select_on_timeout(csp_select_t *select) {
+  csp_proc_t *proc = select->proc;
+  atomic_store(&select->timed_out, true);
+
+  int stat = csp_waiter_sel_waiting;
+  bool won = atomic_compare_exchange_strong(
+    &select->sel.stat, &stat, csp_waiter_sel_woken
+  );
+
+  /* The select may return right after it, DO NOT touch it any more unless we
+   * won, in which case it won't return until we handed it off. */
+  atomic_store(&select->timer_done, true);
+  if (won && atomic_fetch_add(&select->sel.handoff, 1) == 1) {
+    csp_sched_unpark(proc);
+  }
+}
+
+int csp_select(csp_select_case_t *cases, size_t n,
+    csp_timer_duration_t timeout) {
+  if (csp_unlikely(n == 0)) {
+    return -1;
+  }
+
+  csp_select_t select = {
+    .proc = csp_sched_running(),
+    .locked = csp_select_sort(cases, n),
+  };
+  atomic_store(&select.timed_out, false);
+  atomic_store(&select.timer_done, false);
+
+  csp_timer_time_t deadline = timeout > 0 ? csp_timer_now() + timeout : 0;
+  csp_timer_t timer;
+  bool has_timer = false;
+
+  /* Start from a random case for fairness. */
+  size_t start = __builtin_ia32_rdtsc() % n, i;
+  int chosen = -1, claimed = -1;
+
+  while (true) {
+    for (size_t k = 0; k < n; k++) {
+      if (csp_select_try(&cases[i = (start + k) % n], false)) {
+        csp_select_wake(&cases[i]);
+        chosen = i;
+        goto done;
+      }
+      /* The item or space has been taken by others, nothing to pass on. */
+      if ((int)i == claimed) {
+        claimed = -1;
+      }
+    }
+
+    if (timeout == 0 || atomic_load(&select.timed_out)) {
+      goto done;
+    }
+
+    if (timeout > 0 && !has_timer) {
+      timer = csp_timer_at(deadline, csp_select_on_timeout(&select));
+      has_timer = true;
+    }
+
+    csp_select_lock(select.locked);
+
+    /* Check again with the channels locked, nobody can change them before we
+     * are in their waitqs except the non-blocking operations, which will
+     * wake us up after they see us. */
+    for (size_t k = 0; k < n; k++) {
+      if (csp_select_try(&cases[i = (start + k) % n], true)) {
+        csp_select_unlock(select.locked);
+        csp_select_wake(&cases[i]);
+        chosen = i;
+        goto done;
+      }
+    }
+
+    atomic_store(&select.sel.stat, csp_waiter_sel_waiting);
+    atomic_store(&select.sel.handoff, 0);
+    select.sel.woken = NULL;
+    for (size_t k = 0; k < n; k++) {
+      cases[k].waiter.proc = select.proc;
+      cases[k].waiter.sel = &select.sel;
+      cases[k].waiter.item = cases[k].item;
+      cases[k].waiter.done = false;
+      csp_waitq_push(csp_select_waitq(&cases[k]), &cases[k].waiter);
+    }
+
+    /* The timer fired before we were waiting. Only the timer can race with us
+     * as the channels are locked. */
+    int stat = csp_waiter_sel_waiting;
+    if (atomic_load(&select.timed_out) && atomic_compare_exchange_strong(
+        &select.sel.stat, &stat, csp_waiter_sel_woken)) {
+      csp_select_unregister(cases, n);
+      csp_select_unlock(select.locked);
+      goto done;
+    }
+
+    csp_sched_park(csp_select_on_parked, &select);
+
+    /* We are woken up by a channel or the timer, remove the other waiters and
+     * try again unless an unbuffered channel has done the case for us. */
+    csp_select_lock(select.locked);
+    csp_select_unregister(cases, n);
+    csp_select_unlock(select.locked);
+
+    for (size_t k = 0; k < n; k++) {
+      if (cases[k].waiter.done) {
+        chosen = k;
+        goto done;
+      }
+    }
+
+    /* Try the case of the waking channel first, so that its wakeup isn't
+     * lost. */
+    for (size_t k = 0; k < n; k++) {
+      if (&cases[k].waiter == select.sel.woken) {
+        start = k;
+        claimed = k;
+        break;
+      }
+    }
+  }
+
+done:
+  /* Another case is done or we timed out, the wakeup we claimed belongs to
+   * other waiters of the channel then. */
+  if (claimed >= 0 && claimed != chosen) {
+    csp_select_rewake(&cases[claimed]);
+  }
+  if (has_timer && !csp_timer_cancel(timer)) {
+    /* The timer has fired, wait for it to finish using `select`. */
+    while (!atomic_load(&select.timer_done)) {
+      csp_sched_yield();
+    }
+  }
+  return chosen;
+}
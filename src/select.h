@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_SELECT_H
+#define LIBCSP_SELECT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include "timer.h"
+#include "waitq.h"
+
+#define csp_select_send     0
+#define csp_select_recv     1
+
+/* The timeouts of `csp_select`. */
+#define csp_select_default  ((csp_timer_duration_t)0)
+#define csp_select_forever  ((csp_timer_duration_t)-1)
+
+#define csp_select_case_send(c, itemp)                                         \
+  ((csp_select_case_t){.chan = (c), .op = csp_select_send, .item = (itemp)})   \
+
+#define csp_select_case_recv(c, itemp)                                         \
+  ((csp_select_case_t){.chan = (c), .op = csp_select_recv, .item = (itemp)})   \
+
+typedef struct csp_select_case_t {
+  /* The channel, i.e. a pointer of `csp_chan_t(I)`. */
+  void *chan;
+
+  /* `csp_select_send` or `csp_select_recv`. */
+  int op;
+
+  /* The address of the item to send or to store the received item. */
+  void *item;
+
+  /* The following fields are used internally. */
+  csp_waiter_t waiter;
+  struct csp_select_case_t *next_locked;
+} csp_select_case_t;
+
+/*
+ * `csp_select` waits until one of the `n` cases succeeds and returns its index.
+ * If more than one case is ready, one of them is chosen randomly.
+ *
+ * If no case is ready, it returns -1 immediately when `timeout` is
+ * `csp_select_default`, waits forever when `timeout` is negative, or returns -1
+ * after `timeout` nanoseconds otherwise.
+ */
+int csp_select(csp_select_case_t *cases, size_t n,
+    csp_timer_duration_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
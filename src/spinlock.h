@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_SPINLOCK_H
+#define LIBCSP_SPINLOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/*
+ * `csp_spinlock_t` is used by the runtime internals to protect the short
+ * critical sections, e.g. the waitqs of channels. It never parks the holder so
+ * it's also safe to use it in the scheduler and the monitor. Use `csp_mutex_t`
+ * in processes instead.
+ */
+#define csp_spinlock_t                atomic_flag
+
+#ifdef csp_enable_preemption
+/*
+ * The process is never preempted while it runs the runtime code or holds a
+ * spinlock, i.e. while `csp_preempt_disabled` is positive, see
+ * `csp_preempt_handler`. A process may switch out with it raised, e.g. in
+ * `csp_sched_yield`, and the scheduler resets it before running the next one.
+ * So a disabled section must not contain a switch unless it ends there.
+ */
+extern _Thread_local int csp_preempt_disabled;
+
+#define csp_preempt_disable()         (csp_preempt_disabled++)
+#define csp_preempt_enable()          (csp_preempt_disabled--)
+#define csp_preempt_reset()           (csp_preempt_disabled = 0)
+
+#define csp_spinlock_try_lock(lock) ({                                         \
+  csp_preempt_disable();                                                       \
+  bool acquired = !atomic_flag_test_and_set(lock);                             \
+  if (!acquired) {                                                             \
+    csp_preempt_enable();                                                      \
+  }                                                                            \
+  acquired;                                                                    \
+})                                                                             \
+
+#define csp_spinlock_unlock(lock) do {                                         \
+  atomic_flag_clear(lock);                                                     \
+  csp_preempt_enable();                                                        \
+} while (0)                                                                    \
+
+#else
+#define csp_preempt_disable()
+#define csp_preempt_enable()
+#define csp_preempt_reset()
+
+#define csp_spinlock_try_lock(lock)   (!atomic_flag_test_and_set(lock))
+#define csp_spinlock_unlock(lock)     atomic_flag_clear(lock)
+#endif
+
+#define csp_spinlock_lock(lock)       while (!csp_spinlock_try_lock(lock)) {}
+#define csp_spinlock_init(lock)                                                \
+  do { *(lock) = (atomic_flag)ATOMIC_FLAG_INIT; } while (0)                    \
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+
+#define csp_stats_load(counter)                                                \
+  atomic_load_explicit(&(counter), memory_order_relaxed)                       \
+
+extern int csp_sched_np;
+
+csp_stats_core_t *csp_stats_cores;
+
+bool csp_stats_init(void) {
+  csp_stats_cores = (csp_stats_core_t *)aligned_alloc(
+    _Alignof(csp_stats_core_t), sizeof(csp_stats_core_t) * csp_sched_np
+  );
+  if (csp_stats_cores == NULL) {
+    return false;
+  }
+  memset(csp_stats_cores, 0, sizeof(csp_stats_core_t) * csp_sched_np);
+  return true;
+}
+
+/* Add the counters of the CPU processor `pid` to `stats`. */
+static void csp_stats_collect(size_t pid, csp_stats_t *stats) {
+  csp_stats_core_t *core = &csp_stats_cores[pid];
+
+  stats->switches += csp_stats_load(core->switches);
+  stats->lrunq_pops += csp_stats_load(core->lrunq_pops);
+  stats->grunq_pops += csp_stats_load(core->grunq_pops);
+  stats->steal_attempts += csp_stats_load(core->steal_attempts);
+  stats->steals += csp_stats_load(core->steals);
+  stats->sleeps += csp_stats_load(core->sleeps);
+  stats->deep_sleeps += csp_stats_load(core->deep_sleeps);
+  stats->sleep_nanosecs += csp_stats_load(core->sleep_nanosecs);
+  stats->block_handoffs += csp_stats_load(core->block_handoffs);
+
+  uint64_t wakeups[csp_stats_wakeup_num];
+  for (int i = 0; i < csp_stats_wakeup_num; i++) {
+    wakeups[i] = csp_stats_load(core->wakeups[i]) +
+      csp_stats_load(core->monitor_wakeups[i]);
+  }
+  stats->netpoll_wakeups += wakeups[csp_stats_wakeup_netpoll];
+  stats->io_wakeups += wakeups[csp_stats_wakeup_io];
+  stats->timer_wakeups += wakeups[csp_stats_wakeup_timer];
+}
+
+bool csp_stats_snapshot_core(size_t pid, csp_stats_t *stats) {
+  if (pid >= csp_sched_np) {
+    return false;
+  }
+  memset(stats, 0, sizeof(csp_stats_t));
+  csp_stats_collect(pid, stats);
+  return true;
+}
+
+void csp_stats_snapshot(csp_stats_t *stats) {
+  memset(stats, 0, sizeof(csp_stats_t));
+  for (size_t pid = 0; pid < csp_sched_np; pid++) {
+    csp_stats_collect(pid, stats);
+  }
+}
+
+static void csp_stats_print(FILE *fp, const char *name, csp_stats_t *stats) {
+  fprintf(fp,
+    "%-6s %12lu %12lu %12lu %10lu %10lu %10lu %10lu %12lu %8lu %10lu %10lu "
+    "%10lu\n",
+    name, stats->switches, stats->lrunq_pops, stats->grunq_pops,
+    stats->steal_attempts, stats->steals, stats->sleeps, stats->deep_sleeps,
+    stats->sleep_nanosecs / 1000, stats->block_handoffs,
+    stats->netpoll_wakeups, stats->io_wakeups, stats->timer_wakeups
+  );
+}
+
+void csp_stats_dump(FILE *fp) {
+  csp_stats_t stats, total;
+  char name[24];
+
+  fprintf(fp,
+    "%-6s %12s %12s %12s %10s %10s %10s %10s %12s %8s %10s %10s %10s\n",
+    "pid", "switches", "lrunq_pops", "grunq_pops", "steal_try", "steals",
+    "sleeps", "deep_sleep", "sleep_us", "blocks", "netpoll", "io", "timer"
+  );
+
+  memset(&total, 0, sizeof(csp_stats_t));
+  for (size_t pid = 0; pid < csp_sched_np; pid++) {
+    csp_stats_snapshot_core(pid, &stats);
+    csp_stats_collect(pid, &total);
+    snprintf(name, sizeof(name), "%lu", pid);
+    csp_stats_print(fp, name, &stats);
+  }
+  csp_stats_print(fp, "total", &total);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_STATS_H
+#define LIBCSP_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* The sources of the wakeups. */
+typedef enum {
+  csp_stats_wakeup_netpoll,
+  csp_stats_wakeup_io,
+  csp_stats_wakeup_timer,
+  csp_stats_wakeup_num,
+} csp_stats_wakeup_t;
+
+/* `csp_stats_t` is the snapshot of the scheduler counters. */
+typedef struct {
+  /* The times a new process was switched to. */
+  uint64_t switches;
+
+  /* The processes popped from the local runq and the global runq, including
+   * the runq of the pinned processes. */
+  uint64_t lrunq_pops, grunq_pops;
+
+  /* The times we tried stealing and the ones succeeded. */
+  uint64_t steal_attempts, steals;
+
+  /* The times an idle core waited for new processes, the ones it slept in the
+   * kernel instead of only spinning, and the time it spent in waiting. */
+  uint64_t sleeps, deep_sleeps, sleep_nanosecs;
+
+  /* The times a core blocked in `csp_block` and handed its processor over. */
+  uint64_t block_handoffs;
+
+  /* The processes woken up by netpoll, io and timers. */
+  uint64_t netpoll_wakeups, io_wakeups, timer_wakeups;
+} csp_stats_t;
+
+/*
+ * `csp_stats_core_t` keeps the counters of a CPU processor. The first part is
+ * only written by the core running on the processor and the second one only
+ * by the monitor, so both of them are updated without atomic instructions.
+ */
+typedef struct {
+  _Alignas(64) atomic_uint_fast64_t switches, lrunq_pops, grunq_pops,
+    steal_attempts, steals, sleeps, deep_sleeps, sleep_nanosecs,
+    block_handoffs, wakeups[csp_stats_wakeup_num];
+
+  _Alignas(64) atomic_uint_fast64_t monitor_wakeups[csp_stats_wakeup_num];
+} csp_stats_core_t;
+
+extern csp_stats_core_t *csp_stats_cores;
+
+/* The counter is written by one thread only, so a plain load and store are
+ * enough. The relaxed atomics just keep the readers from tearing. */
+#define csp_stats_counter_add(counter, n) do {                                 \
+  atomic_uint_fast64_t *c = &(counter);                                        \
+  atomic_store_explicit(c,                                                     \
+    atomic_load_explicit(c, memory_order_relaxed) + (n), memory_order_relaxed  \
+  );                                                                           \
+} while (0)                                                                    \
+
+#define csp_stats_add(pid, field, n)                                           \
+  csp_stats_counter_add(csp_stats_cores[pid].field, n)                         \
+
+#define csp_stats_incr(pid, field)  csp_stats_add(pid, field, 1)
+
+/* Get the snapshot of the counters of the CPU processor `pid`. It returns
+ * false if `pid` is invalid. */
+bool csp_stats_snapshot_core(size_t pid, csp_stats_t *stats);
+
+/* Get the snapshot of the counters summed over all CPU processors. */
+void csp_stats_snapshot(csp_stats_t *stats);
+
+/* Print the counters of each CPU processor and the total to `fp`. */
+void csp_stats_dump(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
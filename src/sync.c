@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "common.h"
+#include "core.h"
+#include "mutex.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "sync.h"
+#include "waitq.h"
+
+extern _Thread_local csp_core_t *csp_this_core;
+extern int csp_sched_np;
+
+/* Park current proc in `waiters`. The lock should be held and it will be
+ * released after the context of the proc is saved. */
+static void csp_sync_wait(csp_spinlock_t *lock, csp_waitq_t *waiters) {
+  csp_waiter_t waiter = {.proc = csp_sched_running(), .sel = NULL};
+  csp_waitq_push(waiters, &waiter);
+  csp_sched_park(csp_waitq_unlock, lock);
+}
+
+/* Wake up the first waiter. The lock should be held and it's released here. */
+static void csp_sync_wakeup(csp_spinlock_t *lock, csp_waitq_t *waiters) {
+  csp_waiter_t *waiter = csp_waitq_pop(waiters);
+  csp_proc_t *proc = waiter != NULL ? waiter->proc : NULL;
+  csp_spinlock_unlock(lock);
+
+  if (proc != NULL) {
+    csp_sched_unpark(proc);
+  }
+}
+
+/* Wake up all the waiters. The lock should be held and it's released here. */
+static void csp_sync_wakeup_all(csp_spinlock_t *lock, csp_waitq_t *waiters) {
+  csp_waiter_t *waiter = waiters->head, *next;
+  csp_waitq_init(waiters);
+  csp_spinlock_unlock(lock);
+
+  /* The waiters are in the stacks of the parked procs, so we must get the next
+   * one before the proc is unparked. */
+  for (; waiter != NULL; waiter = next) {
+    next = waiter->next;
+    csp_sched_unpark(waiter->proc);
+  }
+}
+
+void csp_proc_cond_wait(csp_proc_cond_t *cond, csp_mutex_t *mutex) {
+  csp_waiter_t waiter = {.proc = csp_sched_running(), .sel = NULL};
+  csp_spinlock_lock(&cond->lock);
+
+  /* Unlock the mutex after we are in the waitq, otherwise we may miss the
+   * signal sent right after it. The signaler takes the lock of the waitq, so
+   * it can't wake us up before we are parked. */
+  csp_waitq_push(&cond->waiters, &waiter);
+  csp_mutex_unlock(mutex);
+  csp_sched_park(csp_waitq_unlock, &cond->lock);
+  csp_mutex_lock(mutex);
+}
+
+void csp_proc_cond_signal(csp_proc_cond_t *cond) {
+  csp_spinlock_lock(&cond->lock);
+  csp_sync_wakeup(&cond->lock, &cond->waiters);
+}
+
+void csp_proc_cond_broadcast(csp_proc_cond_t *cond) {
+  csp_spinlock_lock(&cond->lock);
+  csp_sync_wakeup_all(&cond->lock, &cond->waiters);
+}
+
+bool csp_sema_try_acquire(csp_sema_t *sema) {
+  int_fast64_t permits = atomic_load(&sema->permits);
+  while (permits > 0) {
+    if (atomic_compare_exchange_weak(&sema->permits, &permits, permits - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void csp_sema_acquire(csp_sema_t *sema) {
+  if (csp_sema_try_acquire(sema)) {
+    return;
+  }
+
+  csp_spinlock_lock(&sema->lock);
+  if (csp_sema_try_acquire(sema)) {
+    csp_spinlock_unlock(&sema->lock);
+    return;
+  }
+
+  /* The permit is handed over to us when we are woken up. */
+  csp_sync_wait(&sema->lock, &sema->waiters);
+}
+
+void csp_sema_release(csp_sema_t *sema) {
+  csp_spinlock_lock(&sema->lock);
+  if (csp_waitq_len(&sema->waiters) > 0) {
+    csp_sync_wakeup(&sema->lock, &sema->waiters);
+    return;
+  }
+  atomic_fetch_add(&sema->permits, 1);
+  csp_spinlock_unlock(&sema->lock);
+}
+
+void csp_wg_add(csp_wg_t *wg, int64_t delta) {
+  /* The lock must be taken even if there seems no waiter, cause a waiter may
+   * have seen the old counter but not been in the waitq yet. */
+  if (atomic_fetch_add(&wg->cnt, delta) + delta == 0) {
+    csp_spinlock_lock(&wg->lock);
+    csp_sync_wakeup_all(&wg->lock, &wg->waiters);
+  }
+}
+
+void csp_wg_wait(csp_wg_t *wg) {
+  if (atomic_load(&wg->cnt) == 0) {
+    return;
+  }
+
+  csp_spinlock_lock(&wg->lock);
+  if (atomic_load(&wg->cnt) == 0) {
+    csp_spinlock_unlock(&wg->lock);
+    return;
+  }
+  csp_sync_wait(&wg->lock, &wg->waiters);
+}
+
+void csp_once(csp_once_t *once, void (*fn)(void)) {
+  if (atomic_load(&once->stat) == csp_once_stat_done) {
+    return;
+  }
+
+  int stat = csp_once_stat_init;
+  if (atomic_compare_exchange_strong(&once->stat, &stat,
+      csp_once_stat_running)) {
+    fn();
+    csp_spinlock_lock(&once->lock);
+    atomic_store(&once->stat, csp_once_stat_done);
+    csp_sync_wakeup_all(&once->lock, &once->waiters);
+    return;
+  }
+
+  /* Wait for the running one to finish. */
+  csp_spinlock_lock(&once->lock);
+  if (atomic_load(&once->stat) == csp_once_stat_done) {
+    csp_spinlock_unlock(&once->lock);
+    return;
+  }
+  csp_sync_wait(&once->lock, &once->waiters);
+}
+
+bool csp_rwlock_init(csp_rwlock_t *rwlock) {
+  rwlock->readers = (csp_rwlock_readers_t *)aligned_alloc(
+    sizeof(csp_rwlock_readers_t), sizeof(csp_rwlock_readers_t) * csp_sched_np
+  );
+  if (rwlock->readers == NULL) {
+    return false;
+  }
+  for (int i = 0; i < csp_sched_np; i++) {
+    atomic_store(&rwlock->readers[i].n, 0);
+  }
+
+  atomic_store(&rwlock->writing, false);
+  csp_mutex_init(&rwlock->wmutex);
+  csp_sync_init(rwlock);
+  rwlock->writer = NULL;
+  return true;
+}
+
+/* The number of readers holding the lock. */
+static int_fast64_t csp_rwlock_nreaders(csp_rwlock_t *rwlock) {
+  int_fast64_t n = 0;
+  for (int i = 0; i < csp_sched_np; i++) {
+    n += atomic_load(&rwlock->readers[i].n);
+  }
+  return n;
+}
+
+/* Wake up the writer if it's waiting and we were the last reader. */
+static void csp_rwlock_wakeup_writer(csp_rwlock_t *rwlock) {
+  csp_spinlock_lock(&rwlock->lock);
+  csp_proc_t *writer = rwlock->writer;
+  if (writer != NULL && csp_rwlock_nreaders(rwlock) == 0) {
+    rwlock->writer = NULL;
+  } else {
+    writer = NULL;
+  }
+  csp_spinlock_unlock(&rwlock->lock);
+
+  if (writer != NULL) {
+    csp_sched_unpark(writer);
+  }
+}
+
+void csp_rwlock_rdlock(csp_rwlock_t *rwlock) {
+  while (true) {
+    /* The process must not migrate between increasing and decreasing the
+     * counter when backing off. Otherwise a writer summing the counters may
+     * see the decrement on another processor but not the increment, and miss
+     * a real reader there. */
+    csp_preempt_disable();
+    atomic_int_fast64_t *n = &rwlock->readers[csp_this_core->pid].n;
+    atomic_fetch_add(n, 1);
+    if (csp_likely(!atomic_load(&rwlock->writing))) {
+      csp_preempt_enable();
+      return;
+    }
+
+    /* Back off and wait for the writer to leave. */
+    atomic_fetch_sub(n, 1);
+    csp_preempt_enable();
+    csp_rwlock_wakeup_writer(rwlock);
+
+    csp_spinlock_lock(&rwlock->lock);
+    if (!atomic_load(&rwlock->writing)) {
+      csp_spinlock_unlock(&rwlock->lock);
+      continue;
+    }
+    csp_sync_wait(&rwlock->lock, &rwlock->waiters);
+  }
+}
+
+void csp_rwlock_rdunlock(csp_rwlock_t *rwlock) {
+  csp_preempt_disable();
+  atomic_fetch_sub(&rwlock->readers[csp_this_core->pid].n, 1);
+  csp_preempt_enable();
+  if (csp_likely(!atomic_load(&rwlock->writing))) {
+    return;
+  }
+
+  /* We may be the last reader the writer is waiting for. */
+  csp_rwlock_wakeup_writer(rwlock);
+}
+
+void csp_rwlock_wrlock(csp_rwlock_t *rwlock) {
+  csp_mutex_lock(&rwlock->wmutex);
+
+  /* The new readers back off from now on, wait for the current ones. */
+  atomic_store(&rwlock->writing, true);
+  csp_spinlock_lock(&rwlock->lock);
+  if (csp_rwlock_nreaders(rwlock) == 0) {
+    csp_spinlock_unlock(&rwlock->lock);
+    return;
+  }
+  rwlock->writer = csp_sched_running();
+  csp_sched_park(csp_waitq_unlock, &rwlock->lock);
+}
+
+void csp_rwlock_wrunlock(csp_rwlock_t *rwlock) {
+  atomic_store(&rwlock->writing, false);
+  csp_spinlock_lock(&rwlock->lock);
+  csp_sync_wakeup_all(&rwlock->lock, &rwlock->waiters);
+  csp_mutex_unlock(&rwlock->wmutex);
+}
+
+void csp_rwlock_destroy(csp_rwlock_t *rwlock) {
+  free(rwlock->readers);
+}
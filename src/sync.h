@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_SYNC_H
+#define LIBCSP_SYNC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "mutex.h"
+#include "rbq.h"
+#include "spinlock.h"
+#include "waitq.h"
+
+/*
+ * The synchronization primitives of processes. All of them park the waiting
+ * processes instead of spinning, so the other processes on the same core can
+ * still run. `lock` protects `waiters` in each of them.
+ */
+
+/* `csp_proc_cond_t` is the condition variable used with `csp_mutex_t`. */
+typedef struct {
+  csp_spinlock_t lock;
+  csp_waitq_t waiters;
+} csp_proc_cond_t;
+
+/* `csp_sema_t` is the counting semaphore. */
+typedef struct {
+  atomic_int_fast64_t permits;
+  csp_spinlock_t lock;
+  csp_waitq_t waiters;
+} csp_sema_t;
+
+/* `csp_wg_t` waits for a collection of processes to finish, which may not be
+ * started by `csp_sync`. */
+typedef struct {
+  atomic_int_fast64_t cnt;
+  csp_spinlock_t lock;
+  csp_waitq_t waiters;
+} csp_wg_t;
+
+#define csp_once_stat_init     0
+#define csp_once_stat_running  1
+#define csp_once_stat_done     2
+
+/* `csp_once_t` runs a function only once. It can be initialized statically by
+ * `csp_once_initializer`. */
+typedef struct {
+  atomic_int stat;
+  csp_spinlock_t lock;
+  csp_waitq_t waiters;
+} csp_once_t;
+
+#define csp_once_initializer {0}
+
+/* The reader counter of a CPU processor, it takes a cache line alone. */
+typedef struct {
+  csp_rbq_padding_t _;
+  atomic_int_fast64_t n;
+} csp_rwlock_readers_t;
+
+/*
+ * `csp_rwlock_t` is the reader-writer lock for the read-mostly data. Each CPU
+ * processor has its own reader counter so the readers never touch the memory
+ * of others. The process may unlock it on another CPU processor, so only the
+ * sum of the counters makes sense.
+ */
+typedef struct {
+  csp_rwlock_readers_t *readers;
+
+  /* Whether a writer holds the lock or is waiting for the readers to leave. */
+  atomic_bool writing;
+
+  /* Serialize the writers. */
+  csp_mutex_t wmutex;
+
+  /* The readers waiting for the writer to leave. */
+  csp_spinlock_t lock;
+  csp_waitq_t waiters;
+
+  /* The writer waiting for the readers to leave. */
+  csp_proc_t *writer;
+} csp_rwlock_t;
+
+#define csp_sync_init(s) do {                                                  \
+  csp_spinlock_init(&(s)->lock);                                               \
+  csp_waitq_init(&(s)->waiters);                                               \
+} while (0)                                                                    \
+
+#define csp_proc_cond_init(cond) csp_sync_init(cond)
+
+#define csp_sema_init(sema, n) do {                                            \
+  atomic_store(&(sema)->permits, (n));                                         \
+  csp_sync_init(sema);                                                         \
+} while (0)                                                                    \
+
+#define csp_wg_init(wg) do {                                                   \
+  atomic_store(&(wg)->cnt, 0);                                                 \
+  csp_sync_init(wg);                                                           \
+} while (0)                                                                    \
+
+#define csp_wg_done(wg) csp_wg_add((wg), -1)
+
+#define csp_once_init(once) do {                                               \
+  atomic_store(&(once)->stat, csp_once_stat_init);                             \
+  csp_sync_init(once);                                                         \
+} while (0)                                                                    \
+
+void csp_proc_cond_wait(csp_proc_cond_t *cond, csp_mutex_t *mutex);
+void csp_proc_cond_signal(csp_proc_cond_t *cond);
+void csp_proc_cond_broadcast(csp_proc_cond_t *cond);
+
+bool csp_sema_try_acquire(csp_sema_t *sema);
+void csp_sema_acquire(csp_sema_t *sema);
+void csp_sema_release(csp_sema_t *sema);
+
+void csp_wg_add(csp_wg_t *wg, int64_t delta);
+void csp_wg_wait(csp_wg_t *wg);
+
+void csp_once(csp_once_t *once, void (*fn)(void));
+
+bool csp_rwlock_init(csp_rwlock_t *rwlock);
+void csp_rwlock_rdlock(csp_rwlock_t *rwlock);
+void csp_rwlock_rdunlock(csp_rwlock_t *rwlock);
+void csp_rwlock_wrlock(csp_rwlock_t *rwlock);
+void csp_rwlock_wrunlock(csp_rwlock_t *rwlock);
+void csp_rwlock_destroy(csp_rwlock_t *rwlock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
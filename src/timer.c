@@ -19,35 +19,61 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "common.h"
 #include "core.h"
-#include "mutex.h"
 #include "proc.h"
+#include "spinlock.h"
 #include "timer.h"
 
-#define csp_timer_getclock() ({                                                \
-  uint32_t high, low;                                                          \
-  __asm__ __volatile__("rdtsc\n": "=d"(high), "=a"(low));                      \
-  ((int64_t)high << 32) | low;                                                 \
-})                                                                             \
+/*
+ * The timers of each core are kept in a hierarchical timing wheel, which makes
+ * the insertion and cancellation O(1). The wheel has 6 levels and every level
+ * has 64 slots. A tick of level 0 is 2^20ns(about 1ms) and a slot of level l
+ * covers 64^l ticks, so the wheel can hold the timers in the next 2^56ns(about
+ * 2.3 years). The later timers are put to the farthest slot and they will be
+ * put back when they are cascaded.
+ *
+ * A timer triggered at tick `t` is put to level l if the highest different
+ * 6-bits group between `t` and current tick is l. When the wheel reaches the
+ * start tick of a slot in level l, the timers in it are moved to lower levels.
+ * Timers never expire earlier than `when`, but they may be delayed one tick.
+ */
 
-#define csp_timer_heap_default_cap 64
-#define csp_timer_heap_lte(heap, i, j)                                         \
-  ((heap)->procs[i]->timer.when <= (heap)->procs[j]->timer.when)
+#define csp_timer_wheel_tick_exp      20
+#define csp_timer_wheel_tick_mask     ((1L << csp_timer_wheel_tick_exp) - 1)
+#define csp_timer_wheel_levels        6
+#define csp_timer_wheel_slots_exp     6
+#define csp_timer_wheel_slots         (1 << csp_timer_wheel_slots_exp)
+#define csp_timer_wheel_slots_mask    (csp_timer_wheel_slots - 1)
+#define csp_timer_wheel_span_mask                                              \
+  ((1L << (csp_timer_wheel_levels * csp_timer_wheel_slots_exp)) - 1)
+
+/* Convert the time to the tick, rounded up. */
+#define csp_timer_wheel_tick(when) ({                                          \
+  int64_t when_ = (when);                                                      \
+  (when_ >> csp_timer_wheel_tick_exp) + !!(when_ & csp_timer_wheel_tick_mask); \
+})
+
+#define csp_timer_wheel_idx(level, slot)                                       \
+  (((level) << csp_timer_wheel_slots_exp) | (slot))
+#define csp_timer_wheel_idx_level(idx) ((idx) >> csp_timer_wheel_slots_exp)
+#define csp_timer_wheel_idx_slot(idx)  ((idx) & csp_timer_wheel_slots_mask)
 
 /* Only for debug. */
-#define csp_timer_heap_dump(heap) do {                                         \
-  for (int i = 0; i < (heap)->len; i++) {                                      \
-    printf(                                                                    \
-      "<csp_proc_t %p, rbp: %lx, rsp: %lx, "                                   \
-      "idx: %ld, when: %ld, token: %lx>\n",                                    \
-      (heap)->procs[i],                                                        \
-      (heap)->procs[i]->rbp,                                                   \
-      (heap)->procs[i]->rsp,                                                   \
-      (heap)->procs[i]->timer.idx,                                             \
-      (heap)->procs[i]->timer.when,                                            \
-      (heap)->procs[i]->timer.token                                            \
-    );                                                                         \
+#define csp_timer_wheel_dump(wheel) do {                                       \
+  for (int i = 0; i < csp_timer_wheel_levels; i++) {                           \
+    for (int j = 0; j < csp_timer_wheel_slots; j++) {                          \
+      csp_proc_t *proc = (wheel)->slots[i][j];                                 \
+      for (; proc != NULL; proc = proc->next) {                                \
+        printf(                                                                \
+          "<csp_proc_t %p, rbp: %lx, rsp: %lx, "                               \
+          "idx: %ld, when: %ld, token: %lx>\n",                                \
+          proc, proc->rbp, proc->rsp, proc->timer.idx, proc->timer.when,       \
+          proc->timer.token                                                    \
+        );                                                                     \
+      }                                                                        \
+    }                                                                          \
   }                                                                            \
 } while (0)                                                                    \
 
@@ -55,197 +81,296 @@ extern int csp_sched_np;
 extern _Thread_local csp_core_t *csp_this_core;
 
 extern void csp_core_proc_exit(void);
+extern void csp_monitor_notify(size_t pid, csp_timer_time_t when);
 extern void csp_proc_destroy(csp_proc_t *proc);
 extern void csp_sched_yield(void);
 
-typedef struct csp_timer_heap_t {
-  size_t cap, len;
-  csp_proc_t **procs;
-  csp_timer_time_t time, clock;
+typedef struct csp_timer_wheel_t {
+  /* The last tick processed. */
+  int64_t tick;
+
+  /* The number of timers in the wheel. */
+  size_t len;
+
+  /* The bitmaps of non-empty slots in each level. */
+  uint64_t bitmaps[csp_timer_wheel_levels];
+
+  /* The timer lists linked by `pre` and `next` of processes. */
+  csp_proc_t *slots[csp_timer_wheel_levels][csp_timer_wheel_slots];
+
   int64_t token;
-  csp_mutex_t mutex;
-} csp_timer_heap_t;
+  csp_spinlock_t lock;
+} csp_timer_wheel_t;
 
-bool csp_timer_heap_init(csp_timer_heap_t *heap, size_t pid) {
-  heap->cap = csp_timer_heap_default_cap;
-  heap->len = 0;
-  heap->time = csp_timer_now();
-  heap->clock = csp_timer_getclock();
-  heap->procs = (csp_proc_t **)malloc(sizeof(csp_proc_t *) * heap->cap);
+bool csp_timer_wheel_init(csp_timer_wheel_t *wheel, size_t pid) {
+  memset(wheel->slots, 0, sizeof(wheel->slots));
+  wheel->len = 0;
+  memset(wheel->bitmaps, 0, sizeof(wheel->bitmaps));
+  wheel->tick = csp_timer_now() >> csp_timer_wheel_tick_exp;
 
-  /* Make tokens generated by different `csp_timer_heap_t` different. */
-  heap->token = (uint64_t)pid << 53;
+  /* Make tokens generated by different `csp_timer_wheel_t` different. */
+  wheel->token = (uint64_t)pid << 53;
 
-  csp_mutex_init(&heap->mutex);
-  return heap->procs != NULL;
+  csp_spinlock_init(&wheel->lock);
+  return true;
 }
 
-/* Fix the heap by shifting up the element. */
-void csp_timer_heap_shift_up(csp_timer_heap_t *heap, int64_t idx) {
-  while (idx > 0) {
-    int64_t father = (idx - 1) >> 1;
-    if (csp_timer_heap_lte(heap, father, idx)) {
-      return;
-    }
-    csp_swap(heap->procs[idx], heap->procs[father]);
-    csp_swap(heap->procs[idx]->timer.idx, heap->procs[father]->timer.idx);
-    idx = father;
+/* Add a timer to the wheel relative to tick `ref`, which is no later than the
+ * trigger tick of the timer. The caller should take control of the lock. */
+static void csp_timer_wheel_add(csp_timer_wheel_t *wheel, csp_proc_t *proc,
+    int64_t ref) {
+  int64_t t = csp_timer_wheel_tick(proc->timer.when);
+  if (t < ref) {
+    t = ref;
+  }
+
+  /* The timer is too far, put it to the farthest slot and it will be put back
+   * after it's cascaded to level 0. */
+  if (((t ^ ref) & ~csp_timer_wheel_span_mask) != 0) {
+    t = ref | csp_timer_wheel_span_mask;
+  }
+
+  int level = 0;
+  if (t != ref) {
+    level = (63 - __builtin_clzl(t ^ ref)) / csp_timer_wheel_slots_exp;
+  }
+  int slot = (t >> (level * csp_timer_wheel_slots_exp)) &
+    csp_timer_wheel_slots_mask;
+
+  csp_proc_t **head = &wheel->slots[level][slot];
+  proc->pre = NULL;
+  proc->next = *head;
+  if (*head != NULL) {
+    (*head)->pre = proc;
   }
+  *head = proc;
+
+  proc->timer.idx = csp_timer_wheel_idx(level, slot);
+  wheel->bitmaps[level] |= 1UL << slot;
+  wheel->len++;
 }
 
-/* Put a timer to the heap. */
-void csp_timer_heap_put(csp_timer_heap_t *heap, csp_proc_t *proc) {
-  csp_mutex_lock(&heap->mutex);
+/* Delete a timer from the wheel. The caller should take control of the lock. */
+void csp_timer_wheel_del(csp_timer_wheel_t *wheel, csp_proc_t *proc) {
+  int level = csp_timer_wheel_idx_level(proc->timer.idx);
+  int slot = csp_timer_wheel_idx_slot(proc->timer.idx);
 
-  /* Grow the heap if it's not large enough. */
-  if (csp_unlikely(heap->len == heap->cap)) {
-    size_t cap = heap->cap << 1;
-    csp_proc_t **procs = (csp_proc_t **)realloc(heap->procs, cap);
-    if (csp_unlikely(procs == NULL)) {
-      exit(EXIT_FAILURE);
+  if (proc->pre != NULL) {
+    proc->pre->next = proc->next;
+  } else {
+    wheel->slots[level][slot] = proc->next;
+    if (proc->next == NULL) {
+      wheel->bitmaps[level] &= ~(1UL << slot);
     }
-    heap->procs = procs;
-    heap->cap = cap;
   }
+  if (proc->next != NULL) {
+    proc->next->pre = proc->pre;
+  }
+  proc->pre = proc->next = NULL;
+  wheel->len--;
+}
 
-  csp_proc_timer_token_set(proc, heap->token);
-  heap->token++;
+/* Put a timer to the wheel. */
+void csp_timer_wheel_put(csp_timer_wheel_t *wheel, csp_proc_t *proc) {
+  csp_spinlock_lock(&wheel->lock);
 
-  heap->procs[heap->len] = proc;
-  proc->timer.idx = heap->len++;
-  csp_timer_heap_shift_up(heap, proc->timer.idx);
+  csp_proc_timer_token_set(proc, wheel->token);
+  wheel->token++;
 
-  csp_mutex_unlock(&heap->mutex);
+  /* The slot of current tick has been processed, so the timers triggered at
+   * or before it are put to the next tick. */
+  csp_timer_wheel_add(wheel, proc, wheel->tick + 1);
+
+  csp_spinlock_unlock(&wheel->lock);
 }
 
-/* Delete a timer from the heap. The caller should take control of the mutex. */
-void csp_timer_heap_del(csp_timer_heap_t *heap, csp_proc_t *proc) {
-  int64_t idx = proc->timer.idx;
-  if (idx == --heap->len) {
-    return;
+/* Move the timers in a slot to lower levels when the wheel reaches tick `ref`.
+ */
+static void csp_timer_wheel_cascade(csp_timer_wheel_t *wheel, int level,
+    int64_t ref) {
+  int slot = (ref >> (level * csp_timer_wheel_slots_exp)) &
+    csp_timer_wheel_slots_mask;
+  csp_proc_t *proc = wheel->slots[level][slot], *next;
+  wheel->slots[level][slot] = NULL;
+  wheel->bitmaps[level] &= ~(1UL << slot);
+
+  for (; proc != NULL; proc = next) {
+    next = proc->next;
+    wheel->len--;
+    csp_timer_wheel_add(wheel, proc, ref);
   }
+}
 
-  heap->procs[idx] = heap->procs[heap->len];
-  heap->procs[idx]->timer.idx = idx;
+/* Get the next tick at which the timers in a slot should be expired or
+ * cascaded. Return INT64_MAX if the wheel is empty. The caller should take
+ * control of the lock. */
+static int64_t csp_timer_wheel_next(csp_timer_wheel_t *wheel) {
+  int64_t next = INT64_MAX, from = wheel->tick + 1;
 
-  /* If the timer is smaller than its father, we should shift it up. */
-  if (idx > 0 && csp_timer_heap_lte(heap, idx, (idx - 1) >> 1)) {
-    csp_timer_heap_shift_up(heap, idx);
-    return;
-  }
+  for (int level = 0; level < csp_timer_wheel_levels; level++) {
+    uint64_t bitmap = wheel->bitmaps[level];
+    if (bitmap == 0) {
+      continue;
+    }
+
+    /* Find the first slot starting at or after `from`. */
+    int shift = level * csp_timer_wheel_slots_exp;
+    int64_t round = 1L << (shift + csp_timer_wheel_slots_exp);
+    int64_t base = from & ~(round - 1);
+    int slot = ((from >> shift) & csp_timer_wheel_slots_mask) +
+      ((from & ((1L << shift) - 1)) != 0);
 
-  /* Otherwise we should shift it down. */
-  while (true) {
-    int64_t son = (idx << 1) + 1;
-    if (son >= heap->len) {
-      break;
+    uint64_t pending = 0;
+    if (slot < csp_timer_wheel_slots) {
+      pending = bitmap & (~0UL << slot);
     }
-    if (son + 1 < heap->len && csp_timer_heap_lte(heap, son + 1, son)) {
-      son++;
+    if (pending == 0) {
+      base += round;
+      pending = bitmap;
     }
-    if (csp_timer_heap_lte(heap, idx, son)) {
-      break;
+
+    int64_t tick = base + ((int64_t)__builtin_ctzl(pending) << shift);
+    if (tick < next) {
+      next = tick;
     }
-    csp_swap(heap->procs[idx], heap->procs[son]);
-    csp_swap(heap->procs[idx]->timer.idx, heap->procs[son]->timer.idx);
-    idx = son;
   }
+  return next;
 }
 
-/* Get all expired timers from the heap. */
-static int csp_timer_heap_get(csp_timer_heap_t *heap, csp_proc_t **start,
-    csp_proc_t **end) {
-  csp_mutex_lock(&heap->mutex);
+/* Get all expired timers from the wheel until `now`. */
+static int csp_timer_wheel_get(csp_timer_wheel_t *wheel, csp_timer_time_t now,
+    csp_proc_t **start, csp_proc_t **end) {
+  int64_t now_tick = now >> csp_timer_wheel_tick_exp;
 
-  if (heap->len == 0) {
-    csp_mutex_unlock(&heap->mutex);
+  /* Only the monitor owning the wheel moves it forward, so it's safe to check
+   * the tick without the lock. */
+  if (wheel->tick >= now_tick) {
     return 0;
   }
 
-  csp_timer_time_t clock = csp_timer_getclock(), curr_time;
-  csp_timer_duration_t duration = clock - heap->clock;
-
-  /* Use the approximation calculated by clock instead of the real time to
-   * reduce the syscall calls. */
-  if (duration < CLOCKS_PER_SEC) {
-    curr_time = heap->time + (csp_timer_duration_t)(
-      ((double)duration / CLOCKS_PER_SEC) * csp_timer_second
-    );
-  } else {
-    heap->clock = clock;
-    curr_time = heap->time = csp_timer_now();
-  }
+  csp_spinlock_lock(&wheel->lock);
 
   int n = 0;
-  csp_proc_t *head = NULL, *tail = NULL, *top;
-
-  while (heap->len > 0 && (top = heap->procs[0])->timer.when <= curr_time) {
-    csp_timer_heap_del(heap, top);
-    /*  Invalidate the token. */
-    csp_proc_timer_token_set(top, -1);
-
-    if (tail == NULL) {
-      head = tail = top;
-    } else {
-      tail->next = top;
-      top->pre = tail;
-      tail = top;
+  int64_t next;
+  csp_proc_t *head = NULL, *tail = NULL;
+
+  while ((next = csp_timer_wheel_next(wheel)) <= now_tick) {
+    for (int level = 1; level < csp_timer_wheel_levels; level++) {
+      int64_t mask = (1L << (level * csp_timer_wheel_slots_exp)) - 1;
+      if ((next & mask) != 0) {
+        break;
+      }
+      csp_timer_wheel_cascade(wheel, level, next);
+    }
+
+    int slot = next & csp_timer_wheel_slots_mask;
+    csp_proc_t *proc = wheel->slots[0][slot], *succ;
+    wheel->slots[0][slot] = NULL;
+    wheel->bitmaps[0] &= ~(1UL << slot);
+    wheel->tick = next;
+
+    for (; proc != NULL; proc = succ) {
+      succ = proc->next;
+      wheel->len--;
+
+      /* The timer was too far when it's added. */
+      if (csp_unlikely(csp_timer_wheel_tick(proc->timer.when) > next)) {
+        csp_timer_wheel_add(wheel, proc, next + 1);
+        continue;
+      }
+
+      /*  Invalidate the token. */
+      csp_proc_timer_token_set(proc, -1);
+
+      proc->next = NULL;
+      if (tail == NULL) {
+        proc->pre = NULL;
+        head = tail = proc;
+      } else {
+        tail->next = proc;
+        proc->pre = tail;
+        tail = proc;
+      }
+      n++;
     }
-    n++;
   }
+  wheel->tick = now_tick;
 
   if (n > 0) {
     *start = head;
     *end = tail;
   }
 
-  csp_mutex_unlock(&heap->mutex);
+  csp_spinlock_unlock(&wheel->lock);
   return n;
 }
 
-void csp_timer_heap_destroy(csp_timer_heap_t *heap) {
-  free(heap->procs);
-}
+void csp_timer_wheel_destroy(csp_timer_wheel_t *wheel) {}
 
-struct { int len; csp_timer_heap_t *heaps; } csp_timer_heaps;
+struct { int len; csp_timer_wheel_t *wheels; } csp_timer_wheels;
 
-bool csp_timer_heaps_init(void) {
-  csp_timer_heaps.heaps = (csp_timer_heap_t *)malloc(
-    sizeof(csp_timer_heap_t) * csp_sched_np
+bool csp_timer_wheels_init(void) {
+  csp_timer_wheels.wheels = (csp_timer_wheel_t *)malloc(
+    sizeof(csp_timer_wheel_t) * csp_sched_np
   );
-  if (csp_timer_heaps.heaps == NULL) {
+  if (csp_timer_wheels.wheels == NULL) {
     return false;
   }
 
   for (int i = 0; i < csp_sched_np; i++) {
-    if(!csp_timer_heap_init(&csp_timer_heaps.heaps[i], i)) {
-      csp_timer_heaps.len = i;
+    if(!csp_timer_wheel_init(&csp_timer_wheels.wheels[i], i)) {
+      csp_timer_wheels.len = i;
       return false;
     }
   }
-  csp_timer_heaps.len = csp_sched_np;
+  csp_timer_wheels.len = csp_sched_np;
   return true;
 }
 
-void csp_timer_heaps_destroy(void) {
-  for (size_t i = 0; i < csp_timer_heaps.len; i++) {
-    csp_timer_heap_destroy(&csp_timer_heaps.heaps[i]);
+void csp_timer_wheels_destroy(void) {
+  for (size_t i = 0; i < csp_timer_wheels.len; i++) {
+    csp_timer_wheel_destroy(&csp_timer_wheels.wheels[i]);
   }
-  free(csp_timer_heaps.heaps);
+  free(csp_timer_wheels.wheels);
 }
 
 void csp_timer_put(size_t pid, csp_proc_t *proc) {
-  csp_timer_heap_put(&csp_timer_heaps.heaps[pid], proc);
+  csp_timer_wheel_put(&csp_timer_wheels.wheels[pid], proc);
+
+  /* Wake up the monitor owning the wheel if it's going to sleep beyond the
+   * timer. */
+  csp_monitor_notify(pid, proc->timer.when);
 }
 
-/* Poll all expired timers from all heaps. */
-int csp_timer_poll(csp_proc_t **start, csp_proc_t **end) {
+/* Get the earliest time at which the monitor should poll the wheels of the `n`
+ * CPU processors in `pids`, i.e. the start of the next tick to process. Return
+ * INT64_MAX if all of them are empty. */
+csp_timer_time_t csp_timer_deadline(const int *pids, int n) {
+  int64_t next = INT64_MAX;
+  for (int i = 0; i < n; i++) {
+    csp_timer_wheel_t *wheel = &csp_timer_wheels.wheels[pids[i]];
+    csp_spinlock_lock(&wheel->lock);
+    int64_t tick = csp_timer_wheel_next(wheel);
+    csp_spinlock_unlock(&wheel->lock);
+    if (tick < next) {
+      next = tick;
+    }
+  }
+  return next == INT64_MAX ? INT64_MAX : next << csp_timer_wheel_tick_exp;
+}
+
+/* Poll the expired timers from the wheels of the `n` CPU processors in `pids`.
+ */
+int csp_timer_poll(const int *pids, int n, csp_proc_t **start,
+    csp_proc_t **end) {
   int total = 0;
   csp_proc_t *head, *tail;
+  csp_timer_time_t now = csp_timer_now();
 
-  for (int i = 0; i < csp_timer_heaps.len; i++) {
-    int n = csp_timer_heap_get(&csp_timer_heaps.heaps[i], &head, &tail);
-    if (n > 0) {
+  for (int i = 0; i < n; i++) {
+    csp_timer_wheel_t *wheel = &csp_timer_wheels.wheels[pids[i]];
+    int len = csp_timer_wheel_get(wheel, now, &head, &tail);
+    if (len > 0) {
       if (total != 0) {
         (*end)->next = head;
         head->pre = *end;
@@ -254,24 +379,24 @@ int csp_timer_poll(csp_proc_t **start, csp_proc_t **end) {
         *start = head;
         *end = tail;
       }
-      total += n;
+      total += len;
     }
   }
   return total;
 }
 
 bool csp_timer_cancel(csp_timer_t timer) {
-  csp_timer_heap_t *heap = &csp_timer_heaps.heaps[timer.ctx->borned_pid];
+  csp_timer_wheel_t *wheel = &csp_timer_wheels.wheels[timer.ctx->borned_pid];
 
-  csp_mutex_lock(&heap->mutex);
+  csp_spinlock_lock(&wheel->lock);
   /* Check whether the token is valid. */
   if (!csp_proc_timer_token_cas(timer.ctx, timer.token, -1)) {
-    csp_mutex_unlock(&heap->mutex);
+    csp_spinlock_unlock(&wheel->lock);
     return false;
   }
 
-  csp_timer_heap_del(heap, timer.ctx);
-  csp_mutex_unlock(&heap->mutex);
+  csp_timer_wheel_del(wheel, timer.ctx);
+  csp_spinlock_unlock(&wheel->lock);
   csp_proc_destroy(timer.ctx);
   return true;
 }
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "topo.h"
+
+#define csp_topo_sysfs_node "/sys/devices/system/node"
+#define csp_topo_sysfs_cpu  "/sys/devices/system/cpu"
+
+/* The levels of the victims, the lower the closer. */
+enum {
+  csp_topo_level_l2,
+  csp_topo_level_l3,
+  csp_topo_level_package,
+  csp_topo_level_other,
+  csp_topo_level_num,
+};
+
+/* The distances used if sysfs doesn't tell. */
+#define csp_topo_local_distance   10
+#define csp_topo_remote_distance  20
+
+extern int csp_sched_np;
+
+csp_topo_t csp_topo;
+
+/* Read a list like "0-3,8,10-11" from file `path` to `set`. */
+static bool csp_topo_read_list(const char *path, cpu_set_t *set) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return false;
+  }
+
+  char buf[1024];
+  bool ok = fgets(buf, sizeof(buf), fp) != NULL;
+  fclose(fp);
+  if (!ok) {
+    return false;
+  }
+
+  CPU_ZERO(set);
+  for (char *p = buf, *end; *p != '\0' && *p != '\n'; p = end) {
+    long from = strtol(p, &end, 10), to = from;
+    if (end == p || from < 0) {
+      return false;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      to = strtol(p, &end, 10);
+      if (end == p) {
+        return false;
+      }
+    }
+    for (long i = from; i <= to && i < CPU_SETSIZE; i++) {
+      CPU_SET(i, set);
+    }
+    if (*end == ',') {
+      end++;
+    }
+  }
+  return true;
+}
+
+/* Read an integer from file `path` to `val`. */
+static bool csp_topo_read_int(const char *path, int *val) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return false;
+  }
+  bool ok = fscanf(fp, "%d", val) == 1;
+  fclose(fp);
+  return ok;
+}
+
+/* Read the L2 cache, the L3 cache and the package of CPU `cpu`. */
+static void csp_topo_read_caches(int cpu) {
+  char path[128], type[32];
+  cpu_set_t cpus;
+  int level;
+
+  snprintf(path, sizeof(path),
+    csp_topo_sysfs_cpu "/cpu%d/topology/physical_package_id", cpu);
+  csp_topo_read_int(path, &csp_topo.packages[cpu]);
+
+  for (int index = 0; ; index++) {
+    snprintf(path, sizeof(path),
+      csp_topo_sysfs_cpu "/cpu%d/cache/index%d/level", cpu, index);
+    if (!csp_topo_read_int(path, &level)) {
+      break;
+    }
+    if (level != 2 && level != 3) {
+      continue;
+    }
+
+    /* Skip the instruction caches. */
+    snprintf(path, sizeof(path),
+      csp_topo_sysfs_cpu "/cpu%d/cache/index%d/type", cpu, index);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+      continue;
+    }
+    bool ok = fscanf(fp, "%31s", type) == 1;
+    fclose(fp);
+    if (!ok || strcmp(type, "Instruction") == 0) {
+      continue;
+    }
+
+    snprintf(path, sizeof(path),
+      csp_topo_sysfs_cpu "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+    if (!csp_topo_read_list(path, &cpus)) {
+      continue;
+    }
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &cpus)) {
+        (level == 2 ? csp_topo.l2s : csp_topo.l3s)[cpu] = i;
+        break;
+      }
+    }
+  }
+}
+
+/* Read the distances from node `from` to the online nodes. */
+static void csp_topo_read_distances(const char *path, int from,
+    cpu_set_t *online) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    return;
+  }
+
+  /* The distances are listed in the order of the online nodes. */
+  int distance;
+  for (int to = 0; to < csp_topo.nnodes; to++) {
+    if (CPU_ISSET(to, online)) {
+      if (fscanf(fp, "%d", &distance) != 1) {
+        break;
+      }
+      csp_topo.distances[from * csp_topo.nnodes + to] = distance;
+    }
+  }
+  fclose(fp);
+}
+
+/* Read the nodes and the distances from sysfs. It returns false if the
+ * topology is unknown, e.g. the kernel is built without NUMA. */
+static bool csp_topo_read(void) {
+  cpu_set_t online, cpus;
+  if (!csp_topo_read_list(csp_topo_sysfs_node "/online", &online)) {
+    return false;
+  }
+
+  int max_node = -1;
+  for (int i = 0; i < CPU_SETSIZE; i++) {
+    if (CPU_ISSET(i, &online)) {
+      max_node = i;
+    }
+  }
+  if (max_node < 0) {
+    return false;
+  }
+
+  int nnodes = max_node + 1;
+  csp_topo.distances = (int *)malloc(sizeof(int) * nnodes * nnodes);
+  if (csp_topo.distances == NULL) {
+    return false;
+  }
+  csp_topo.nnodes = nnodes;
+  for (int i = 0; i < nnodes; i++) {
+    for (int j = 0; j < nnodes; j++) {
+      csp_topo.distances[i * nnodes + j] = i == j ?
+        csp_topo_local_distance : csp_topo_remote_distance;
+    }
+  }
+
+  char path[128];
+  for (int node = 0; node < nnodes; node++) {
+    if (!CPU_ISSET(node, &online)) {
+      continue;
+    }
+
+    snprintf(path, sizeof(path), csp_topo_sysfs_node "/node%d/cpulist", node);
+    if (csp_topo_read_list(path, &cpus)) {
+      for (int pid = 0; pid < csp_topo.np; pid++) {
+        if (CPU_ISSET(pid, &cpus)) {
+          csp_topo.nodes[pid] = node;
+        }
+      }
+    }
+
+    snprintf(path, sizeof(path), csp_topo_sysfs_node "/node%d/distance", node);
+    csp_topo_read_distances(path, node, &online);
+  }
+  return true;
+}
+
+/* The level of `victim` from the view of `pid`. */
+static int csp_topo_level(int pid, int victim) {
+  if (csp_topo.l2s[pid] >= 0 && csp_topo.l2s[pid] == csp_topo.l2s[victim]) {
+    return csp_topo_level_l2;
+  }
+  if (csp_topo.l3s[pid] >= 0 && csp_topo.l3s[pid] == csp_topo.l3s[victim]) {
+    return csp_topo_level_l3;
+  }
+  if (csp_topo.packages[pid] >= 0 &&
+      csp_topo.packages[pid] == csp_topo.packages[victim]) {
+    return csp_topo_level_package;
+  }
+  return csp_topo_level_other;
+}
+
+static int csp_topo_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Group the CPU processors by nodes and sort the victims of each one. */
+static bool csp_topo_build(void) {
+  int np = csp_topo.np, nnodes = csp_topo.nnodes;
+
+  csp_topo.node_starts = (int *)calloc(nnodes + 1, sizeof(int));
+  csp_topo.node_pids = (int *)malloc(sizeof(int) * np);
+  /* Plus one to avoid `malloc(0)` if there is only one CPU processor. */
+  csp_topo.steal_orders = (int *)malloc(sizeof(int) * (np * (np - 1) + 1));
+  csp_topo.steal_ends = (int *)malloc(sizeof(int) * (np * (np - 1) + 1));
+  uint64_t *keys = (uint64_t *)malloc(sizeof(uint64_t) * np);
+  if (csp_topo.node_starts == NULL || csp_topo.node_pids == NULL ||
+      csp_topo.steal_orders == NULL || csp_topo.steal_ends == NULL ||
+      keys == NULL) {
+    free(keys);
+    return false;
+  }
+
+  /* Counting sort the CPU processors by nodes. */
+  int *starts = csp_topo.node_starts;
+  for (int pid = 0; pid < np; pid++) {
+    starts[csp_topo.nodes[pid] + 1]++;
+  }
+  for (int node = 0; node < nnodes; node++) {
+    starts[node + 1] += starts[node];
+  }
+  for (int pid = 0; pid < np; pid++) {
+    csp_topo.node_pids[starts[csp_topo.nodes[pid]]++] = pid;
+  }
+  for (int node = nnodes; node > 0; node--) {
+    starts[node] = starts[node - 1];
+  }
+  starts[0] = 0;
+
+  /* Sort the victims by the distance, then by the level and then by the
+   * offset, i.e. the rank of a victim is `distance * level_num + level`. */
+  for (int pid = 0; pid < np; pid++) {
+    int *distances = &csp_topo.distances[csp_topo.nodes[pid] * nnodes];
+    for (int offset = 1; offset < np; offset++) {
+      int victim = (pid + offset) % np;
+      uint64_t rank = (uint64_t)distances[csp_topo.nodes[victim]] *
+        csp_topo_level_num + csp_topo_level(pid, victim);
+      keys[offset - 1] = rank << 32 | offset;
+    }
+    qsort(keys, np - 1, sizeof(uint64_t), csp_topo_cmp);
+
+    int *order = csp_topo_steal_order(pid), *ends = csp_topo_steal_ends(pid);
+    for (int i = np - 2; i >= 0; i--) {
+      order[i] = (pid + (uint32_t)keys[i]) % np;
+      ends[i] = i == np - 2 || keys[i] >> 32 != keys[i + 1] >> 32 ?
+        i + 1 : ends[i + 1];
+    }
+  }
+
+  free(keys);
+  return true;
+}
+
+bool csp_topo_init(void) {
+  int np = csp_topo.np = csp_sched_np;
+  csp_topo.nodes = (int *)calloc(np, sizeof(int));
+  csp_topo.l2s = (int *)malloc(sizeof(int) * np * 3);
+  if (csp_topo.nodes == NULL || csp_topo.l2s == NULL) {
+    return false;
+  }
+  csp_topo.l3s = csp_topo.l2s + np;
+  csp_topo.packages = csp_topo.l3s + np;
+  for (int i = 0; i < np * 3; i++) {
+    csp_topo.l2s[i] = -1;
+  }
+  for (int pid = 0; pid < np; pid++) {
+    csp_topo_read_caches(pid);
+  }
+
+  /* Regard all of the CPU processors in node 0 if the topology is unknown. */
+  if (!csp_topo_read()) {
+    free(csp_topo.distances);
+    csp_topo.distances = (int *)malloc(sizeof(int));
+    if (csp_topo.distances == NULL) {
+      return false;
+    }
+    csp_topo.distances[0] = csp_topo_local_distance;
+    csp_topo.nnodes = 1;
+    for (int pid = 0; pid < csp_topo.np; pid++) {
+      csp_topo.nodes[pid] = 0;
+    }
+  }
+  return csp_topo_build();
+}
+
+void csp_topo_destroy(void) {
+  free(csp_topo.nodes);
+  free(csp_topo.distances);
+  free(csp_topo.l2s);
+  free(csp_topo.node_starts);
+  free(csp_topo.node_pids);
+  free(csp_topo.steal_orders);
+  free(csp_topo.steal_ends);
+}
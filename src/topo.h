@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_TOPO_H
+#define LIBCSP_TOPO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+/* The NUMA node of CPU processor `pid`. */
+#define csp_topo_node(pid)        (csp_topo.nodes[pid])
+
+/* The other CPU processors in the order `pid` should steal from. */
+#define csp_topo_steal_order(pid)                                              \
+  (&csp_topo.steal_orders[(pid) * (csp_topo.np - 1)])
+
+/* The ends of the levels in `csp_topo_steal_order(pid)`, i.e. the victims in
+ * the same level as the i-th one end before the `ends[i]`-th one. */
+#define csp_topo_steal_ends(pid)                                               \
+  (&csp_topo.steal_ends[(pid) * (csp_topo.np - 1)])
+
+/*
+ * `csp_topo_t` describes the NUMA and cache topology read from sysfs. The CPU
+ * processor `pid` runs on CPU `pid`, so their nodes and caches are the ones of
+ * the CPUs. All of them are regarded in node 0 if the topology is unknown.
+ */
+typedef struct {
+  /* The number of CPU processors and NUMA nodes. */
+  int np, nnodes;
+
+  /* The NUMA node of each CPU processor. */
+  int *nodes;
+
+  /* The distances between nodes, i.e. `distances[i * nnodes + j]`. */
+  int *distances;
+
+  /* The ids of the L2 cache, the L3 cache and the package of each CPU
+   * processor, -1 if unknown. The id of a cache is the first CPU sharing it. */
+  int *l2s, *l3s, *packages;
+
+  /* The CPU processors grouped by nodes. The ones of node `i` are in
+   * [node_pids + node_starts[i], node_pids + node_starts[i + 1]). */
+  int *node_pids, *node_starts;
+
+  /* The victims of each CPU processor, see `csp_topo_steal_order`. They are
+   * grouped by levels: sharing the L2 cache, sharing the L3 cache, in the same
+   * package and the others, and the ones in the nearer nodes come first. */
+  int *steal_orders, *steal_ends;
+} csp_topo_t;
+
+extern csp_topo_t csp_topo;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
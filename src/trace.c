@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+#include "timer.h"
+#include "trace.h"
+
+#ifdef csp_enable_trace
+
+extern size_t csp_max_threads;
+extern int csp_sched_np;
+extern const char *csp_procs_name[];
+extern _Thread_local csp_core_t *csp_this_core;
+
+_Thread_local csp_trace_ring_t *csp_trace_this_ring;
+
+/* The rings of the cores and the monitors, i.e. at most
+ * `csp_max_threads + csp_sched_np` threads. */
+static csp_trace_ring_t **csp_trace_rings;
+static size_t csp_trace_rings_cap;
+static atomic_size_t csp_trace_rings_len;
+
+/* The TSC and the time when tracing started, used to convert the TSC to the
+ * time when dumping. */
+static uint64_t csp_trace_tsc;
+static int64_t csp_trace_time;
+
+bool csp_trace_init(void) {
+  csp_trace_rings_cap = csp_max_threads + csp_sched_np;
+  csp_trace_rings = (csp_trace_ring_t **)calloc(
+    csp_trace_rings_cap, sizeof(csp_trace_ring_t *)
+  );
+  if (csp_trace_rings == NULL) {
+    return false;
+  }
+  csp_trace_tsc = __builtin_ia32_rdtsc();
+  csp_trace_time = csp_timer_now();
+  return true;
+}
+
+/* Create the ring of current thread when it records its first event. */
+csp_trace_ring_t *csp_trace_ring_new(void) {
+  if (atomic_load(&csp_trace_rings_len) >= csp_trace_rings_cap) {
+    return NULL;
+  }
+
+  csp_trace_ring_t *ring = (csp_trace_ring_t *)malloc(sizeof(csp_trace_ring_t));
+  if (ring == NULL) {
+    return NULL;
+  }
+  atomic_store(&ring->len, 0);
+  ring->pid = csp_this_core == NULL ? -1 : (int64_t)csp_this_core->pid;
+  ring->running = 0;
+
+  size_t idx = atomic_fetch_add(&csp_trace_rings_len, 1);
+  if (idx >= csp_trace_rings_cap) {
+    free(ring);
+    return NULL;
+  }
+  atomic_store_explicit(
+    (_Atomic(csp_trace_ring_t *) *)&csp_trace_rings[idx], ring,
+    memory_order_release
+  );
+  return csp_trace_this_ring = ring;
+}
+
+/* Copy the events in `ring` to `events` and return the number of events. */
+static size_t csp_trace_ring_copy(csp_trace_ring_t *ring,
+    csp_trace_event_t *events) {
+  uint64_t len = atomic_load_explicit(&ring->len, memory_order_acquire);
+  uint64_t start = len > csp_trace_ring_cap ? len - csp_trace_ring_cap : 0;
+  for (uint64_t i = start; i < len; i++) {
+    events[i - start] = ring->events[i & csp_trace_ring_mask];
+  }
+
+  /* The events the owner wrote while we were copying may overwrite the
+   * oldest ones we copied, drop them. The owner may also be writing the slot
+   * of event `now`, which overwrites event `now - cap`, drop it as well. */
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t now = atomic_load_explicit(&ring->len, memory_order_relaxed);
+  uint64_t valid = now + 1 > csp_trace_ring_cap ?
+    now + 1 - csp_trace_ring_cap : 0;
+  if (valid > start) {
+    if (valid >= len) {
+      return 0;
+    }
+    memmove(events, events + (valid - start),
+      sizeof(csp_trace_event_t) * (len - valid));
+    start = valid;
+  }
+  return len - start;
+}
+
+void csp_trace_dump(FILE *fp) {
+  static const char *wakeups[] = {"netpoll", "io", "timer"};
+
+  size_t n = atomic_load(&csp_trace_rings_len);
+  if (n > csp_trace_rings_cap) {
+    n = csp_trace_rings_cap;
+  }
+  csp_trace_event_t *events = (csp_trace_event_t *)malloc(
+    sizeof(csp_trace_event_t) * csp_trace_ring_cap
+  );
+  if (events == NULL) {
+    return;
+  }
+
+  /* The TSC ticks per nanosecond. */
+  double ticks = (double)(__builtin_ia32_rdtsc() - csp_trace_tsc) /
+    (csp_timer_now() - csp_trace_time);
+  if (ticks <= 0) {
+    ticks = 1;
+  }
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(fp, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+    "\"args\":{\"name\":\"monitor\"}}", csp_sched_np);
+  for (int pid = 0; pid < csp_sched_np; pid++) {
+    fprintf(fp, ",\n{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+      "\"args\":{\"name\":\"processor %d\"}}", pid, pid);
+  }
+
+  for (size_t tid = 0; tid < n; tid++) {
+    csp_trace_ring_t *ring = atomic_load_explicit(
+      (_Atomic(csp_trace_ring_t *) *)&csp_trace_rings[tid],
+      memory_order_acquire
+    );
+    if (ring == NULL) {
+      continue;
+    }
+
+    int pid = ring->pid < 0 ? csp_sched_np : (int)ring->pid;
+    fprintf(fp, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+      "\"tid\":%lu,\"args\":{\"name\":\"%s %lu\"}}", pid, tid,
+      ring->pid < 0 ? "monitor" : "core", tid);
+
+    /* The first events of the ring may end a process slice whose beginning
+     * was overwritten, skip them. */
+    bool running = false;
+    size_t len = csp_trace_ring_copy(ring, events);
+    for (size_t i = 0; i < len; i++) {
+      csp_trace_event_t *event = &events[i];
+      double ts = (int64_t)(event->tsc - csp_trace_tsc) / ticks / 1000;
+      const char *name = NULL, *ph = "i";
+
+      switch (event->type) {
+      case csp_trace_event_create:
+        fprintf(fp, ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"create\","
+          "\"pid\":%d,\"tid\":%lu,\"ts\":%.3f,"
+          "\"args\":{\"proc\":\"%#lx\",\"fn\":\"%s\"}}",
+          pid, tid, ts, event->proc, csp_procs_name[event->arg]);
+        continue;
+      case csp_trace_event_run:
+        running = true;
+        fprintf(fp, ",\n{\"ph\":\"B\",\"name\":\"%#lx\",\"pid\":%d,"
+          "\"tid\":%lu,\"ts\":%.3f}", event->proc, pid, tid, ts);
+        continue;
+      case csp_trace_event_yield:
+        name = "yield";
+        ph = "E";
+        break;
+      case csp_trace_event_exit:
+        name = "exit";
+        ph = "E";
+        break;
+      case csp_trace_event_unblock:
+        name = "unblock";
+        ph = "E";
+        break;
+      case csp_trace_event_block:
+        name = "block";
+        break;
+      case csp_trace_event_steal:
+        fprintf(fp, ",\n{\"ph\":\"i\",\"s\":\"t\",\"name\":\"steal\","
+          "\"pid\":%d,\"tid\":%lu,\"ts\":%.3f,"
+          "\"args\":{\"proc\":\"%#lx\",\"victim\":%d}}",
+          pid, tid, ts, event->proc, event->arg);
+        continue;
+      case csp_trace_event_wakeup:
+        name = wakeups[event->arg];
+        break;
+      default:
+        continue;
+      }
+
+      if (*ph == 'E') {
+        if (!running) {
+          continue;
+        }
+        running = false;
+      }
+      fprintf(fp, ",\n{\"ph\":\"%s\",%s\"name\":\"%s\",\"pid\":%d,"
+        "\"tid\":%lu,\"ts\":%.3f,\"args\":{\"proc\":\"%#lx\"}}", ph,
+        *ph == 'i' ? "\"s\":\"t\"," : "", name, pid, tid, ts, event->proc);
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  free(events);
+}
+
+#else
+
+void csp_trace_dump(FILE *fp) {
+  fprintf(fp, "libcsp is not configured with --enable-trace.\n");
+}
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_TRACE_H
+#define LIBCSP_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "common.h"
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* The number of events kept by each thread, i.e. 768KB of memory. */
+#define csp_trace_ring_cap  (1 << 15)
+#define csp_trace_ring_mask (csp_trace_ring_cap - 1)
+
+typedef enum {
+  csp_trace_event_create,
+  csp_trace_event_run,
+  csp_trace_event_yield,
+  csp_trace_event_exit,
+  csp_trace_event_block,
+  csp_trace_event_unblock,
+  csp_trace_event_steal,
+  csp_trace_event_wakeup,
+  csp_trace_event_num,
+} csp_trace_event_type_t;
+
+/*
+ * `arg` is the id of the process function for `csp_trace_event_create`, the
+ * victim processor for `csp_trace_event_steal` and the `csp_stats_wakeup_t`
+ * for `csp_trace_event_wakeup`.
+ */
+typedef struct {
+  uint64_t tsc, proc;
+  uint32_t type;
+  int32_t arg;
+} csp_trace_event_t;
+
+/*
+ * `csp_trace_ring_t` keeps the latest events of a thread. Only the owner thread
+ * writes it, and the old events are overwritten when it's full. The reader(i.e.
+ * `csp_trace_dump`) drops the events overwritten while it's reading.
+ */
+typedef struct {
+  /* The number of events ever written. */
+  atomic_uint_fast64_t len;
+
+  /* The CPU processor of the owner thread, -1 if it's not a core. */
+  int64_t pid;
+
+  /* The process the owner thread switched to last time, 0 if it stopped. */
+  uint64_t running;
+
+  csp_trace_event_t events[csp_trace_ring_cap];
+} csp_trace_ring_t;
+
+#ifdef csp_enable_trace
+extern _Thread_local csp_trace_ring_t *csp_trace_this_ring;
+extern csp_trace_ring_t *csp_trace_ring_new(void);
+
+/* Record an event to the ring of current thread. */
+#define csp_trace(event_type, p, a) do {                                       \
+  csp_trace_ring_t *ring_ = csp_trace_this_ring;                               \
+  if (csp_unlikely(ring_ == NULL) && (ring_ = csp_trace_ring_new()) == NULL) { \
+    break;                                                                     \
+  }                                                                            \
+  uint64_t len_ = atomic_load_explicit(&ring_->len, memory_order_relaxed);     \
+  csp_trace_event_t *event_ = &ring_->events[len_ & csp_trace_ring_mask];      \
+  event_->tsc = __builtin_ia32_rdtsc();                                        \
+  event_->proc = (uint64_t)(uintptr_t)(p);                                     \
+  event_->type = (event_type);                                                 \
+  event_->arg = (a);                                                           \
+  atomic_store_explicit(&ring_->len, len_ + 1, memory_order_release);          \
+} while (0)                                                                    \
+
+/* Current thread switches to the process `p`. */
+#define csp_trace_run(p) do {                                                  \
+  csp_trace(csp_trace_event_run, (p), 0);                                      \
+  if (csp_trace_this_ring != NULL) {                                           \
+    csp_trace_this_ring->running = (uint64_t)(uintptr_t)(p);                   \
+  }                                                                            \
+} while (0)                                                                    \
+
+/* The process current thread switched to stops running for `event_type`. */
+#define csp_trace_stop(event_type) do {                                        \
+  csp_trace_ring_t *stop_ring_ = csp_trace_this_ring;                          \
+  if (stop_ring_ != NULL && stop_ring_->running != 0) {                        \
+    csp_trace((event_type), stop_ring_->running, 0);                           \
+    stop_ring_->running = 0;                                                   \
+  }                                                                            \
+} while (0)                                                                    \
+
+#else
+#define csp_trace(event_type, p, a)
+#define csp_trace_run(p)
+#define csp_trace_stop(event_type)
+#endif
+
+/* Write the events of all threads to `fp` in the Chrome trace event format,
+ * which can be loaded by `chrome://tracing` or `https://ui.perfetto.dev`. It
+ * only works if libcsp is configured with `--enable-trace`. */
+void csp_trace_dump(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
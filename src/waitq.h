@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_WAITQ_H
+#define LIBCSP_WAITQ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "proc.h"
+#include "sched.h"
+#include "spinlock.h"
+
+#define csp_waiter_sel_waiting  0
+#define csp_waiter_sel_woken    1
+
+/*
+ * The state shared by the waiters of a select. The waiters are in the waitqs
+ * of different channels, only the first one who switches `stat` from
+ * `csp_waiter_sel_waiting` to `csp_waiter_sel_woken` can wake up the proc.
+ */
+typedef struct {
+  atomic_int stat;
+
+  /* The winner may come before the proc is parked (e.g. the timer of the
+   * select), so both the winner and the parking proc increase it and the later
+   * one puts the proc back to the runq. */
+  atomic_int handoff;
+
+  /* The waiter claimed by the winner, NULL if it's the timer. */
+  struct csp_waiter_t *woken;
+} csp_waiter_sel_t;
+
+/*
+ * `csp_waitq_t` is a FIFO queue of the procs waiting for something, e.g. the
+ * space or items of a channel. The waiters usually live in the stack of the
+ * waiting procs, and the queue should be protected by a lock except
+ * `csp_waitq_len`, which can be used to check whether there are waiters
+ * without taking the lock.
+ */
+typedef struct csp_waiter_t {
+  /* The waiting proc. */
+  csp_proc_t *proc;
+
+  /* The select the waiter belongs to, NULL if it's not in a select. */
+  csp_waiter_sel_t *sel;
+
+  /* Used by the unbuffered channels, the waker copies the item from or to
+   * `item` directly and sets `done`. */
+  void *item;
+  bool done;
+
+  struct csp_waiter_t *pre, *next;
+} csp_waiter_t;
+
+typedef struct {
+  csp_waiter_t *head, *tail;
+  atomic_size_t len;
+} csp_waitq_t;
+
+#define csp_waitq_len(q)    atomic_load(&(q)->len)
+
+/* Whether the waiter is still in the waitq. */
+#define csp_waitq_has(q, w) ((w)->pre != NULL || (q)->head == (w))
+
+#define csp_waitq_init(q) do {                                                 \
+  (q)->head = (q)->tail = NULL;                                                \
+  atomic_store(&(q)->len, 0);                                                  \
+} while (0)                                                                    \
+
+#define csp_waitq_push(q, waiter) do {                                         \
+  csp_waiter_t *node = (waiter);                                               \
+  node->next = NULL;                                                           \
+  node->pre = (q)->tail;                                                       \
+  if ((q)->tail != NULL) {                                                     \
+    (q)->tail->next = node;                                                    \
+  } else {                                                                     \
+    (q)->head = node;                                                          \
+  }                                                                            \
+  (q)->tail = node;                                                            \
+  atomic_fetch_add(&(q)->len, 1);                                              \
+} while (0)                                                                    \
+
+#define csp_waitq_remove(q, waiter) do {                                       \
+  csp_waiter_t *node = (waiter);                                               \
+  if (node->pre != NULL) {                                                     \
+    node->pre->next = node->next;                                              \
+  } else {                                                                     \
+    (q)->head = node->next;                                                    \
+  }                                                                            \
+  if (node->next != NULL) {                                                    \
+    node->next->pre = node->pre;                                               \
+  } else {                                                                     \
+    (q)->tail = node->pre;                                                     \
+  }                                                                            \
+  node->pre = node->next = NULL;                                               \
+  atomic_fetch_sub(&(q)->len, 1);                                              \
+} while (0)                                                                    \
+
+#define csp_waitq_push_front(q, waiter) do {                                   \
+  csp_waiter_t *node = (waiter);                                               \
+  node->pre = NULL;                                                            \
+  node->next = (q)->head;                                                      \
+  if ((q)->head != NULL) {                                                     \
+    (q)->head->pre = node;                                                     \
+  } else {                                                                     \
+    (q)->tail = node;                                                          \
+  }                                                                            \
+  (q)->head = node;                                                            \
+  atomic_fetch_add(&(q)->len, 1);                                              \
+} while (0)                                                                    \
+
+/* Pop the first waiter, returns NULL if the queue is empty. */
+#define csp_waitq_pop(q) ({                                                    \
+  csp_waiter_t *first = (q)->head;                                             \
+  if (first != NULL) {                                                         \
+    csp_waitq_remove((q), first);                                              \
+  }                                                                            \
+  first;                                                                       \
+})                                                                             \
+
+/* Try to take the right to wake up the waiter, it always succeeds if the
+ * waiter is not in a select. */
+#define csp_waiter_claim(waiter) ({                                            \
+  csp_waiter_sel_t *sel = (waiter)->sel;                                       \
+  int stat = csp_waiter_sel_waiting;                                           \
+  sel == NULL || (atomic_compare_exchange_strong(                              \
+    &sel->stat, &stat, csp_waiter_sel_woken                                    \
+  ) && (sel->woken = (waiter), true));                                         \
+})                                                                             \
+
+/* Wake up the claimed waiter. */
+#define csp_waiter_wakeup(waiter) do {                                         \
+  csp_proc_t *proc = (waiter)->proc;                                           \
+  csp_waiter_sel_t *sel = (waiter)->sel;                                       \
+  if (sel == NULL || atomic_fetch_add(&sel->handoff, 1) == 1) {                \
+    csp_sched_unpark(proc);                                                    \
+  }                                                                            \
+} while (0)                                                                    \
+
+/* The function passed to `csp_sched_park` to release the lock of the waitq. */
+void csp_waitq_unlock(void *lock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define csp_enable_proc_accounting
+
+#include <assert.h>
+#include "../src/acct.c"
+
+int csp_sched_np = 2;
+size_t csp_procs_num = 3;
+const char *csp_procs_name[] = {"main", "worker", "timer"};
+_Thread_local csp_core_t *csp_this_core;
+
+void test_acct(void) {
+  assert(csp_acct_init());
+  assert(access(csp_acct_path, F_OK) == 0);
+  assert(csp_acct->magic == csp_acct_magic);
+  assert(strcmp(csp_acct_names(csp_acct)[1], "worker") == 0);
+
+  csp_core_t core = {.pid = 1};
+  csp_proc_t p1, p2;
+  csp_this_core = &core;
+
+  csp_acct_proc_new(0, &p1, 1);
+  csp_acct_proc_new(0, &p2, 1);
+  assert(p1.acct.id != p2.acct.id);
+  assert(p1.acct.id % csp_sched_np == 0);
+  assert(csp_acct_entries(csp_acct, 0)[1].created == 2);
+
+  /* Running the same process again is not a switch. */
+  csp_acct_switch_in(&core, &p1);
+  csp_acct_switch_out(&core);
+  csp_acct_switch_in(&core, &p1);
+  csp_acct_switch_out(&core);
+  csp_acct_switch_in(&core, &p2);
+  assert(p1.acct.switches == 1);
+
+  /* The running slice is published for the readers. */
+  csp_acct_slice_t *slice = &csp_acct_slices(csp_acct)[1];
+  assert(slice->fn == 1 && slice->at == core.acct.at);
+  assert(csp_acct_slices(csp_acct)[0].fn == -1);
+  assert(p2.acct.switches == 1);
+
+  csp_acct_entry_t *entry = &csp_acct_entries(csp_acct, 1)[1];
+  assert(entry->switches == 2);
+  assert(entry->run_nanosecs == p1.acct.run_nanosecs);
+
+  /* Destroying the running process counts its running time. */
+  csp_acct_proc_destroy(&p2);
+  assert(core.acct.proc == NULL && core.acct.last == NULL);
+  assert(slice->fn == -1);
+  assert(entry->destroyed == 1);
+  assert(entry->run_nanosecs == p1.acct.run_nanosecs + p2.acct.run_nanosecs);
+
+  /* The processes destroyed outside of the cores count to where they were
+   * born. */
+  csp_this_core = NULL;
+  p1.borned_pid = 0;
+  csp_acct_proc_destroy(&p1);
+  assert(csp_acct_entries(csp_acct, 0)[1].destroyed == 1);
+  assert(entry->destroyed == 1);
+
+  FILE *fp = fopen("/dev/null", "w");
+  assert(fp != NULL);
+  csp_acct_dump(fp);
+  fclose(fp);
+}
+
+int main(void) {
+  test_acct();
+}
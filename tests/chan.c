@@ -38,8 +38,30 @@ csp_chan_define(ms, int, ms);
 csp_chan_declare(mm, int, mm);
 csp_chan_define(mm, int, mm);
 
+_Thread_local csp_core_t *csp_this_core;
+csp_chan_t(mm) *parking_chan;
+int parked = 0, unparked = 0, parked_popped;
+
 void csp_sched_yield(void) {}
 
+/* Pretend that another proc operates the channel while we are parked. */
+void csp_sched_park(void (*fn)(void *), void *arg) {
+  fn(arg);
+  parked++;
+
+  int val;
+  if (csp_waitq_len(&parking_chan->base.senders) > 0) {
+    assert(csp_chan_try_pop(parking_chan, &val));
+    parked_popped = val;
+  } else {
+    assert(csp_chan_try_push(parking_chan, -1));
+  }
+}
+
+void csp_sched_unpark(csp_proc_t *proc) {
+  unparked++;
+}
+
 int array[] = {8, 7, 6, 5, 4, 3, 2, 1};
 int array_len = sizeof(array) / sizeof(int);
 int array_cpy[sizeof(array) / sizeof(int)];
@@ -252,6 +274,66 @@ void test_chan_mm(void) {
   csp_chan_destroy(chan);
 }
 
+void test_chan_park(void) {
+  csp_core_t core = {.running = NULL};
+  csp_this_core = &core;
+
+  parking_chan = csp_chan_new(mm)(CAP_EXP);
+  for (int i = 0; i < CAP; i++) {
+    csp_chan_push(parking_chan, i);
+  }
+  assert(parked == 0 && unparked == 0);
+
+  /* The channel is full. */
+  csp_chan_push(parking_chan, CAP);
+  assert(parked == 1 && unparked == 1);
+  assert(csp_waitq_len(&parking_chan->base.senders) == 0);
+
+  int val;
+  for (int i = 1; i <= CAP; i++) {
+    csp_chan_pop(parking_chan, &val);
+    assert(val == i);
+  }
+  assert(parked == 1 && unparked == 1);
+
+  /* The channel is empty. */
+  csp_chan_pop(parking_chan, &val);
+  assert(val == -1);
+  assert(parked == 2 && unparked == 2);
+  assert(csp_waitq_len(&parking_chan->base.receivers) == 0);
+
+  csp_chan_destroy(parking_chan);
+}
+
+void test_chan_unbuffered(void) {
+  csp_core_t core = {.running = NULL};
+  csp_this_core = &core;
+  parked = unparked = 0;
+
+  parking_chan = csp_chan_new(mm)(csp_chan_unbuffered);
+
+  int val;
+  assert(!csp_chan_try_push(parking_chan, 1));
+  assert(!csp_chan_try_pop(parking_chan, &val));
+  assert(!csp_chan_try_pushm(parking_chan, array, array_len));
+  assert(csp_chan_try_popm(parking_chan, array_cpy, array_len) == 0);
+
+  /* The item is handed to the receiver directly. */
+  csp_chan_push(parking_chan, 1);
+  assert(parked == 1 && unparked == 1 && parked_popped == 1);
+  assert(csp_waitq_len(&parking_chan->base.senders) == 0);
+
+  csp_chan_pop(parking_chan, &val);
+  assert(parked == 2 && unparked == 2 && val == -1);
+  assert(csp_waitq_len(&parking_chan->base.receivers) == 0);
+
+  csp_chan_pushm(parking_chan, array, array_len);
+  assert(parked == 2 + array_len && unparked == 2 + array_len);
+  assert(parked_popped == array[array_len - 1]);
+
+  csp_chan_destroy(parking_chan);
+}
+
 void *producer(void *data) {
   csp_chan_t(mm) *chan = (csp_chan_t(mm) *)(data);
   for (int i = 0; i < (1 << 25); i++) {
@@ -301,4 +383,6 @@ int main(void) {
   test_chan_sm();
   test_chan_ms();
   test_chan_mm();
+  test_chan_park();
+  test_chan_unbuffered();
 }
@@ -31,6 +31,7 @@
 int csp_sched_np = 1;
 size_t csp_max_threads = 1;
 size_t csp_max_procs_hint = 100;
+csp_stats_core_t *csp_stats_cores;
 
 size_t csp_procs_num = 1;
 size_t csp_procs_size[] = {4096};
@@ -15,10 +15,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include "../src/mem.c"
 
 int csp_sched_np = 1;
+size_t csp_mem_retained_pages = 16;
+csp_topo_t csp_topo = {.np = 1, .nnodes = 1, .nodes = (int []){0}};
 _Thread_local csp_core_t *csp_this_core = &(csp_core_t){.pid = 0};
 void csp_sched_yield(void) {}
 
@@ -269,6 +275,288 @@ void test_tree_node(void) {
   csp_rbtree_destroy(heap.tree, heap.all_nodes);
 }
 
+void test_small_class(void) {
+  assert(csp_mem_small_class(0) == 0);
+  assert(csp_mem_small_class(1) == 0);
+  assert(csp_mem_small_class(16) == 0);
+  assert(csp_mem_small_class(17) == 1);
+  assert(csp_mem_small_class(128) == 7);
+  assert(csp_mem_small_class(129) == 8);
+  assert(csp_mem_small_class(160) == 8);
+  assert(csp_mem_small_class(161) == 9);
+  assert(csp_mem_small_class(256) == 11);
+  assert(csp_mem_small_class(2048) == csp_mem_small_class_num - 1);
+
+  for (int i = 0; i < csp_mem_small_class_num; i++) {
+    size_t size = csp_mem_small_class_size(i);
+    assert(size % 16 == 0);
+    assert(csp_mem_small_class(size) == i);
+    assert(csp_mem_small_class(size - 15) == i);
+  }
+  assert(csp_mem_small_class_size(csp_mem_small_class_num - 1) == 2048);
+
+  assert(csp_mem_slab_offset % 16 == 0);
+  assert(csp_mem_slab_npages(16) == 1);
+  assert(csp_mem_slab_npages(256) == 1);
+  assert(csp_mem_slab_npages(2048) == 8);
+}
+
+void test_small(void) {
+  assert(csp_mem_init());
+  csp_mem_heap_t *heap = &csp_mem.heaps[0];
+
+  /* Objects of the same class are carved from the same slab. */
+  char *a = csp_mem_small_alloc(24), *b = csp_mem_small_alloc(32);
+  assert(a != NULL && b != NULL);
+  assert((uintptr_t)a % 16 == 0 && (uintptr_t)b % 16 == 0);
+  assert(b - a == 32);
+  assert(csp_mem_slab_by_addr(heap, a) == csp_mem_slab_by_addr(heap, b));
+  memset(a, 0xff, 32);
+  memset(b, 0xff, 32);
+
+  csp_mem_slab_t *slab = csp_mem_slab_by_addr(heap, a);
+  assert(slab->cls == 1);
+  assert(slab->nfree == slab->nobjs - 2);
+  assert(heap->slabs[1] == slab);
+
+  /* The freed object is reused first. */
+  csp_mem_small_free(a);
+  assert(slab->nfree == slab->nobjs - 1);
+  assert(csp_mem_small_alloc(20) == a);
+
+  /* Fill a multi-page slab and spill to a new one. */
+  size_t n = 0;
+  char *objs[64];
+  do {
+    objs[n] = csp_mem_small_alloc(2048);
+    memset(objs[n], 0, 2048);
+    n++;
+  } while (csp_mem_slab_by_addr(heap, objs[n - 1]) ==
+           csp_mem_slab_by_addr(heap, objs[0]));
+  csp_mem_slab_t *full = csp_mem_slab_by_addr(heap, objs[0]);
+  assert(full->npages == 8);
+  assert(n - 1 == full->nobjs);
+  assert(heap->slabs[csp_mem_small_class_num - 1] != full);
+
+  /* Free the full slab and it will be returned to the heap. */
+  for (size_t i = 0; i < n - 1; i++) {
+    csp_mem_small_free(objs[i]);
+  }
+  int32_t l1 = csp_mem_meta_l1_by_addr(heap, full);
+  int32_t l2 = csp_mem_meta_l2_by_addr(heap, full);
+  assert(heap->metas[l1]->slabs[l2] == 0);
+  assert(!csp_mem_meta_taken_bit(heap, l1, l2));
+  csp_mem_small_free(objs[n - 1]);
+
+  /* Objects freed in other threads go through the remote stack. */
+  csp_core_t *this_core = csp_this_core;
+  csp_this_core = NULL;
+  csp_mem_small_free(b);
+  assert(slab->nfree == slab->nobjs - 2);
+  csp_this_core = this_core;
+  assert(csp_mem_heap_collect(heap));
+  assert(slab->nfree == slab->nobjs - 1);
+  assert(!csp_mem_heap_collect(heap));
+  csp_mem_small_free(a);
+
+  /* The remote stack is unbounded, more objects than the slots of a mailbox
+   * can be freed before being collected. */
+  n = csp_exp(csp_mem_meta_l2_num_exp) + 1;
+  char **many = malloc(n * sizeof(char *));
+  assert(many != NULL);
+  for (size_t i = 0; i < n; i++) {
+    many[i] = csp_mem_small_alloc(16);
+  }
+  csp_this_core = NULL;
+  for (size_t i = 0; i < n; i++) {
+    csp_mem_small_free(many[i]);
+  }
+  csp_this_core = this_core;
+  assert(csp_mem_heap_collect(heap));
+  slab = heap->slabs[0];
+  assert(slab != NULL && slab->next == NULL && slab->nfree == slab->nobjs);
+  free(many);
+
+  /* Large objects and objects allocated outside of cores fall back to the
+   * system malloc. */
+  void *large = csp_mem_small_alloc(csp_mem_small_size_max + 1);
+  assert(large != NULL);
+  assert((uintptr_t)large < heap->start || (uintptr_t)large >= heap->end);
+  csp_mem_small_free(large);
+  csp_mem_small_free(NULL);
+
+  csp_mem_destroy();
+}
+
+void test_reclaim(void) {
+  assert(csp_mem_init());
+  csp_mem_heap_t *heap = &csp_mem.heaps[0];
+
+  size_t size = 64 * csp_mem_page_size;
+  char *objs[16];
+  for (int i = 0; i < 16; i++) {
+    objs[i] = csp_mem_alloc(0, size);
+    memset(objs[i], 1, size);
+  }
+  for (int i = 0; i < 16; i++) {
+    csp_mem_free(0, objs[i]);
+  }
+  assert(heap->dirty);
+
+  /* Nothing happens until the monitor asks. */
+  csp_mem_reclaim(0);
+  assert(heap->dirty);
+
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  assert(!heap->dirty);
+  assert(!atomic_load(&heap->reclaim));
+
+  /* Nothing is left to reclaim, so the core isn't asked again. */
+  assert(!csp_mem_reclaim_notify(0));
+  assert(!atomic_load(&heap->reclaim));
+
+  /* All freed pages are merged into one span and released. */
+  csp_mem_span_t *span = csp_mem_meta_span_by_addr(heap, objs[0]);
+  int npages = csp_mem_span_npages_get(span);
+  assert(csp_mem_span_released_get(span) == npages);
+  unsigned char vec[64];
+  assert(mincore(objs[0], size, vec) == 0);
+  for (int i = 0; i < 64; i++) {
+    assert((vec[i] & 0x01) == 0);
+  }
+
+  /* The released pages can be reused. */
+  char *obj = csp_mem_alloc(0, size);
+  assert(obj == objs[0]);
+  assert(obj[0] == 0);
+  assert(csp_mem_span_released_get(span) == 0);
+  memset(obj, 1, size);
+  csp_mem_free(0, obj);
+
+  /* Small free spans are retained. */
+  obj = csp_mem_alloc(0, csp_mem_page_size);
+  char *other = csp_mem_alloc(0, csp_mem_page_size);
+  memset(obj, 1, csp_mem_page_size);
+  csp_mem_free(0, obj);
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  span = csp_mem_meta_span_by_addr(heap, obj);
+  assert(csp_mem_span_released_get(span) == 0);
+  assert(obj[0] == 1);
+  csp_mem_free(0, other);
+
+  csp_mem_destroy();
+}
+
+void test_reclaim_merge(void) {
+  assert(csp_mem_init());
+  csp_mem_heap_t *heap = &csp_mem.heaps[0];
+
+  char *a = csp_mem_alloc(0, 32 * csp_mem_page_size);
+  char *b = csp_mem_alloc(0, 8 * csp_mem_page_size);
+  assert(b == a + 32 * csp_mem_page_size);
+  memset(a, 1, 32 * csp_mem_page_size);
+  memset(b, 1, 8 * csp_mem_page_size);
+
+  /* `a` and the rest of the arena are released while `b` is taken. */
+  csp_mem_free(0, a);
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  csp_mem_span_t *span = csp_mem_meta_span_by_addr(heap, a);
+  assert(csp_mem_span_released_get(span) == 32);
+
+  /* `b` is cached first and freed to the heap after an unused interval, then
+   * merged with its released neighbors. Only its pages count against
+   * `csp_mem_retained_pages`, so they are retained. */
+  csp_mem_free(0, b);
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  assert(heap->cached_pages == 0);
+  assert(csp_mem_meta_span_by_addr(heap, a) == span);
+  int npages = csp_mem_span_npages_get(span);
+  assert(npages > 40);
+  assert(csp_mem_span_released_get(span) == npages - 8);
+  assert(b[0] == 1);
+
+  /* It converges, nothing is left to reclaim. */
+  assert(!csp_mem_reclaim_notify(0));
+
+  csp_mem_destroy();
+}
+
+void test_cache(void) {
+  assert(csp_mem_init());
+  csp_mem_heap_t *heap = &csp_mem.heaps[0];
+
+  /* The freed span is cached and reused for the same size. */
+  char *obj = csp_mem_alloc(0, 2 * csp_mem_page_size);
+  csp_mem_free(0, obj);
+  assert(heap->caches[2].head == csp_mem_meta_span_by_addr(heap, obj));
+  assert(heap->caches[2].len == 1);
+  assert(heap->cached_pages == 2);
+  assert(!heap->dirty);
+  assert(csp_mem_alloc(0, 2 * csp_mem_page_size) == obj);
+  assert(heap->caches[2].len == 0);
+  assert(heap->cached_pages == 0);
+
+  /* The spans beyond `csp_mem_retained_pages` are freed to the heap. */
+  char *large = csp_mem_alloc(0, 32 * csp_mem_page_size);
+  csp_mem_free(0, large);
+  assert(heap->caches[32].len == 0);
+  assert(heap->dirty);
+
+  /* The span unused during a whole interval is freed when reclaiming. */
+  csp_mem_free(0, obj);
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  assert(heap->caches[2].len == 1);
+  assert(heap->caches[2].low == 1);
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  assert(heap->caches[2].head == NULL);
+  assert(heap->caches[2].len == 0);
+  assert(heap->cached_pages == 0);
+
+  /* All unused spans of the same size are freed. */
+  char *a = csp_mem_alloc(0, csp_mem_page_size);
+  char *b = csp_mem_alloc(0, csp_mem_page_size);
+  csp_mem_free(0, a);
+  csp_mem_free(0, b);
+  assert(heap->caches[1].len == 2);
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  assert(csp_mem_reclaim_notify(0));
+  csp_mem_reclaim(0);
+  assert(heap->caches[1].len == 0);
+  assert(heap->cached_pages == 0);
+
+  /* Take all free spans, so that the next allocation misses the tree. */
+  obj = csp_mem_alloc(0, 2 * csp_mem_page_size);
+  int n = csp_rbtree_all_nodes(heap->tree, heap->all_nodes);
+  for (int i = 0; i < n; i++) {
+    int key = heap->all_nodes[i]->key;
+    for (csp_mem_span_t *span = (csp_mem_span_t *)heap->all_nodes[i]->value;
+         span != NULL; span = csp_mem_meta_span_by_index(heap, span->fp_next)) {
+      assert(csp_mem_alloc(0, key * csp_mem_page_size) != NULL);
+    }
+  }
+  assert(csp_mem_tree_node_get_gte(heap, 1) == NULL);
+
+  /* The span freed by other cores is collected to the cache and reused. */
+  csp_core_t *this_core = csp_this_core;
+  csp_this_core = NULL;
+  csp_mem_free(0, obj);
+  csp_this_core = this_core;
+  assert(heap->caches[2].len == 0);
+  assert(csp_mem_alloc(0, 2 * csp_mem_page_size) == obj);
+  assert(heap->arenas->next == NULL);
+
+  csp_mem_destroy();
+}
+
 int main(void) {
   test_page();
   test_span();
@@ -279,4 +567,9 @@ int main(void) {
   test_arena();
   test_tree_node();
   test_meta();
+  test_small_class();
+  test_small();
+  test_reclaim();
+  test_reclaim_merge();
+  test_cache();
 }
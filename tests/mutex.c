@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include "../src/mutex.c"
+#include "tproc.h"
+
+#define NTHREADS 4
+#define NLOOPS   100000
+
+csp_mutex_t mutex;
+int64_t counter;
+atomic_bool holding;
+
+void lock_and_incr(void) {
+  for (int i = 0; i < NLOOPS; i++) {
+    csp_mutex_lock(&mutex);
+    counter++;
+    csp_mutex_unlock(&mutex);
+  }
+}
+
+/* Hold the mutex until the main thread has checked it. */
+void lock_and_hold(void) {
+  csp_mutex_lock(&mutex);
+  counter++;
+  atomic_store(&holding, true);
+  while (atomic_load(&holding)) {}
+  csp_mutex_unlock(&mutex);
+}
+
+void test_mutex(void) {
+  tproc_t self, ts[NTHREADS];
+  tproc_init(&self, 0);
+  csp_this_core = &self.core;
+  csp_mutex_init(&mutex);
+
+  assert(csp_mutex_try_lock(&mutex));
+  assert(!csp_mutex_try_lock(&mutex));
+  csp_mutex_unlock(&mutex);
+  assert(atomic_load(&mutex.stat) == csp_mutex_unlocked);
+
+  /* The contended mutex is handed over to the waiter directly. */
+  counter = 0;
+  csp_mutex_lock(&mutex);
+  tproc_start(&ts[0], 1, lock_and_hold);
+  while (csp_waitq_len(&mutex.waiters) == 0) {}
+  assert(atomic_load(&mutex.stat) == csp_mutex_contended);
+  csp_mutex_unlock(&mutex);
+  assert(atomic_load(&mutex.stat) == csp_mutex_locked);
+  assert(!csp_mutex_try_lock(&mutex));
+  while (!atomic_load(&holding)) {}
+  assert(counter == 1);
+  atomic_store(&holding, false);
+  pthread_join(ts[0].tid, NULL);
+  assert(counter == 1);
+  assert(atomic_load(&mutex.stat) == csp_mutex_unlocked);
+
+  /* No update is lost under contention. */
+  counter = 0;
+  for (int i = 0; i < NTHREADS; i++) {
+    tproc_start(&ts[i], i, lock_and_incr);
+  }
+  for (int i = 0; i < NTHREADS; i++) {
+    pthread_join(ts[i].tid, NULL);
+  }
+  assert(counter == NTHREADS * NLOOPS);
+  assert(atomic_load(&mutex.stat) == csp_mutex_unlocked);
+  assert(csp_waitq_len(&mutex.waiters) == 0);
+}
+
+int main(void) {
+  test_mutex();
+}
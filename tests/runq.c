@@ -31,23 +31,51 @@ void test_lrunq(void) {
   size_t cap_exp = 3, cap = 1 << cap_exp;
   csp_proc_t *proc = NULL;
 
-  csp_lrunq_t *runq = csp_lrunq_new();
+  csp_lrunq_t *runq = csp_lrunq_new(cap_exp);
   assert(csp_lrunq_len(runq) == 0);
-  assert(!csp_lrunq_try_pop_front(runq, &proc));
+  assert(!csp_lrunq_try_pop(runq, &proc));
+  assert(csp_lrunq_try_steal(runq, &proc) == csp_lrunq_failed);
 
   csp_proc_t *proc1 = csp_proc_new(0, false);
   csp_proc_t *proc2 = csp_proc_new(0, false);
   csp_proc_t *proc3 = csp_proc_new(0, false);
 
-  csp_lrunq_push(runq, proc1);
-  csp_lrunq_push(runq, proc2);
-  csp_lrunq_push(runq, proc3);
+  assert(csp_lrunq_push(runq, proc1));
+  assert(csp_lrunq_push(runq, proc2));
+  assert(csp_lrunq_push(runq, proc3));
+  assert(csp_lrunq_len(runq) == 3);
 
-  /* Test the order of poped processes. */
-  assert(csp_lrunq_try_pop_front(runq, &proc) && proc == proc1);
-  assert(csp_lrunq_try_pop_front(runq, &proc) && proc == proc2);
-  assert(csp_lrunq_try_pop_front(runq, &proc) && proc == proc3);
-  assert(!csp_lrunq_try_pop_front(runq, &proc));
+  /* The owner pops from the bottom. */
+  assert(csp_lrunq_try_pop(runq, &proc) && proc == proc3);
+  assert(csp_lrunq_try_pop(runq, &proc) && proc == proc2);
+  assert(csp_lrunq_try_pop(runq, &proc) && proc == proc1);
+  assert(!csp_lrunq_try_pop(runq, &proc));
+  assert(csp_lrunq_len(runq) == 0);
+
+  /* The thieves steal from the top. */
+  assert(csp_lrunq_push(runq, proc1));
+  assert(csp_lrunq_push(runq, proc2));
+  assert(csp_lrunq_push(runq, proc3));
+  assert(csp_lrunq_try_steal(runq, &proc) == csp_lrunq_ok && proc == proc1);
+  assert(csp_lrunq_try_pop(runq, &proc) && proc == proc3);
+  assert(csp_lrunq_try_steal(runq, &proc) == csp_lrunq_ok && proc == proc2);
+  assert(csp_lrunq_try_steal(runq, &proc) == csp_lrunq_failed);
+  assert(!csp_lrunq_try_pop(runq, &proc));
+
+  /* The array grows when it's full and keeps the order. */
+  csp_lrunq_array_t *array = atomic_load(&runq->array);
+  csp_proc_t *procs[] = {proc1, proc2, proc3};
+  for (int i = 0; i < 2 * cap + 1; i++) {
+    assert(csp_lrunq_push(runq, procs[i % 3]));
+  }
+  assert(csp_lrunq_len(runq) == 2 * cap + 1);
+  assert(atomic_load(&runq->array)->mask == 4 * cap - 1);
+  assert(atomic_load(&runq->array)->pre->pre == array);
+  assert(csp_lrunq_try_steal(runq, &proc) == csp_lrunq_ok && proc == proc1);
+  for (int i = 2 * cap; i > 0; i--) {
+    assert(csp_lrunq_try_pop(runq, &proc) && proc == procs[i % 3]);
+  }
+  assert(!csp_lrunq_try_pop(runq, &proc));
 
   csp_proc_destroy(proc1);
   csp_proc_destroy(proc2);
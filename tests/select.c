@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include "../src/chan.h"
+#include "../src/select.c"
+
+#define CAP_EXP     3
+
+csp_chan_declare(mm, int, mm);
+csp_chan_define(mm, int, mm);
+
+_Thread_local csp_core_t *csp_this_core;
+void (*peer)(void);
+int parked = 0, unparked = 0;
+
+void csp_sched_yield(void) {}
+
+/* Pretend that another proc operates the channels while we are parked. */
+void csp_sched_park(void (*fn)(void *), void *arg) {
+  fn(arg);
+  parked++;
+  peer();
+}
+
+void csp_sched_unpark(csp_proc_t *proc) {
+  unparked++;
+}
+
+/* The select never waits with a timeout in the tests. */
+void csp_timer_anchor(csp_timer_time_t when) {}
+bool csp_timer_cancel(csp_timer_t timer) { return false; }
+
+csp_chan_t(mm) *chan_a, *chan_b, *chan_u;
+
+void push_b(void) {
+  assert(csp_chan_try_push(chan_b, 2));
+}
+
+void push_u(void) {
+  assert(csp_chan_try_push(chan_u, 3));
+}
+
+void test_select_default(void) {
+  int val_a, val_b;
+  csp_select_case_t cases[] = {
+    csp_select_case_recv(chan_a, &val_a),
+    csp_select_case_recv(chan_b, &val_b),
+  };
+  assert(csp_select(cases, 2, csp_select_default) == -1);
+  assert(csp_select(cases, 0, csp_select_forever) == -1);
+  assert(parked == 0 && unparked == 0);
+}
+
+void test_select_ready(void) {
+  int val_a = 0, val_b = 0;
+  csp_select_case_t cases[] = {
+    csp_select_case_recv(chan_a, &val_a),
+    csp_select_case_recv(chan_b, &val_b),
+  };
+  assert(csp_chan_try_push(chan_b, 1));
+  assert(csp_select(cases, 2, csp_select_default) == 1);
+  assert(val_a == 0 && val_b == 1);
+
+  /* There is always space in an empty buffered channel. */
+  int item = 1;
+  cases[0] = csp_select_case_send(chan_a, &item);
+  assert(csp_select(cases, 2, csp_select_forever) == 0);
+  assert(csp_chan_try_pop(chan_a, &val_a) && val_a == 1);
+  assert(parked == 0 && unparked == 0);
+}
+
+void test_select_park_buffered(void) {
+  int val_a = 0, val_b = 0;
+  csp_select_case_t cases[] = {
+    csp_select_case_recv(chan_a, &val_a),
+    csp_select_case_recv(chan_b, &val_b),
+  };
+  peer = push_b;
+  assert(csp_select(cases, 2, csp_select_forever) == 1);
+  assert(val_a == 0 && val_b == 2);
+  assert(parked == 1 && unparked == 1);
+  assert(!cases[1].waiter.done);
+
+  /* All the waiters of the select have left the channels. */
+  assert(csp_waitq_len(&chan_a->base.receivers) == 0);
+  assert(csp_waitq_len(&chan_b->base.receivers) == 0);
+}
+
+void test_select_park_unbuffered(void) {
+  int val_a = 0, val_u = 0;
+  csp_select_case_t cases[] = {
+    csp_select_case_recv(chan_a, &val_a),
+    csp_select_case_recv(chan_u, &val_u),
+  };
+  peer = push_u;
+  assert(csp_select(cases, 2, csp_select_forever) == 1);
+  assert(val_a == 0 && val_u == 3);
+  assert(parked == 2 && unparked == 2);
+
+  /* The item is handed off to the select directly. */
+  assert(cases[1].waiter.done);
+  assert(csp_waitq_len(&chan_a->base.receivers) == 0);
+  assert(csp_waitq_len(&chan_u->base.receivers) == 0);
+}
+
+void test_select_rewake(void) {
+  int val;
+  csp_select_case_t c = csp_select_case_recv(chan_b, &val);
+  csp_waiter_t other = {.proc = NULL, .sel = NULL};
+
+  /* The wakeup claimed by the select is passed on to the next receiver. */
+  csp_waitq_push(&chan_b->base.receivers, &other);
+  csp_select_rewake(&c);
+  assert(unparked == 3);
+  assert(csp_waitq_len(&chan_b->base.receivers) == 0);
+
+  /* Nobody to pass it on. */
+  csp_select_rewake(&c);
+  assert(unparked == 3);
+
+  /* The unbuffered channels hand off the items, there's no wakeup to pass. */
+  c = csp_select_case_recv(chan_u, &val);
+  csp_waitq_push(&chan_u->base.receivers, &other);
+  csp_select_rewake(&c);
+  assert(unparked == 3);
+  assert(csp_waitq_len(&chan_u->base.receivers) == 1);
+  csp_waitq_remove(&chan_u->base.receivers, &other);
+}
+
+int main(void) {
+  csp_core_t core = {.running = NULL};
+  csp_this_core = &core;
+
+  chan_a = csp_chan_new(mm)(CAP_EXP);
+  chan_b = csp_chan_new(mm)(CAP_EXP);
+  chan_u = csp_chan_new(mm)(csp_chan_unbuffered);
+
+  test_select_default();
+  test_select_ready();
+  test_select_park_buffered();
+  test_select_park_unbuffered();
+  test_select_rewake();
+
+  csp_chan_destroy(chan_a);
+  csp_chan_destroy(chan_b);
+  csp_chan_destroy(chan_u);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include "../src/stats.c"
+
+int csp_sched_np = 2;
+
+void test_snapshot(void) {
+  assert(csp_stats_init());
+
+  csp_stats_incr(0, switches);
+  csp_stats_incr(0, switches);
+  csp_stats_incr(1, switches);
+  csp_stats_add(0, sleep_nanosecs, 100);
+  csp_stats_add(1, sleep_nanosecs, 20);
+  csp_stats_add(1, wakeups[csp_stats_wakeup_netpoll], 3);
+  csp_stats_add(1, monitor_wakeups[csp_stats_wakeup_netpoll], 4);
+  csp_stats_add(0, monitor_wakeups[csp_stats_wakeup_timer], 5);
+
+  csp_stats_t stats;
+  assert(csp_stats_snapshot_core(0, &stats));
+  assert(stats.switches == 2);
+  assert(stats.sleep_nanosecs == 100);
+  assert(stats.netpoll_wakeups == 0);
+  assert(stats.timer_wakeups == 5);
+
+  assert(csp_stats_snapshot_core(1, &stats));
+  assert(stats.switches == 1);
+  assert(stats.netpoll_wakeups == 7);
+  assert(stats.timer_wakeups == 0);
+
+  assert(!csp_stats_snapshot_core(2, &stats));
+
+  csp_stats_snapshot(&stats);
+  assert(stats.switches == 3);
+  assert(stats.sleep_nanosecs == 120);
+  assert(stats.netpoll_wakeups == 7);
+  assert(stats.io_wakeups == 0);
+  assert(stats.timer_wakeups == 5);
+
+  FILE *fp = fopen("/dev/null", "w");
+  assert(fp != NULL);
+  csp_stats_dump(fp);
+  fclose(fp);
+
+  free(csp_stats_cores);
+}
+
+int main(void) {
+  test_snapshot();
+}
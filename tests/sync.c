@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/mutex.c"
+#include "../src/sync.c"
+#include "tproc.h"
+
+#define NTHREADS 4
+
+int csp_sched_np = 2;
+
+csp_mutex_t mutex;
+csp_proc_cond_t cond;
+csp_sema_t sema;
+csp_wg_t wg;
+csp_once_t once = csp_once_initializer;
+atomic_int tokens, woken, calls;
+
+/* Wait until `n` procs are parked in `waitq`. */
+#define wait_parked(waitq, n) while (csp_waitq_len(waitq) < (n)) {}
+
+tproc_t self, ts[NTHREADS];
+
+void start_all(void (*fn)(void)) {
+  for (int i = 0; i < NTHREADS; i++) {
+    tproc_start(&ts[i], i % csp_sched_np, fn);
+  }
+}
+
+void join_all(void) {
+  for (int i = 0; i < NTHREADS; i++) {
+    pthread_join(ts[i].tid, NULL);
+  }
+}
+
+void cond_consume(void) {
+  csp_mutex_lock(&mutex);
+  while (atomic_load(&tokens) == 0) {
+    csp_proc_cond_wait(&cond, &mutex);
+  }
+  atomic_fetch_sub(&tokens, 1);
+  atomic_fetch_add(&woken, 1);
+  csp_mutex_unlock(&mutex);
+}
+
+void test_cond(void) {
+  csp_mutex_init(&mutex);
+  csp_proc_cond_init(&cond);
+  atomic_store(&tokens, 0);
+  atomic_store(&woken, 0);
+
+  /* Signaling without waiters is a no-op. */
+  csp_proc_cond_signal(&cond);
+  csp_proc_cond_broadcast(&cond);
+
+  start_all(cond_consume);
+  wait_parked(&cond.waiters, NTHREADS);
+
+  /* Signal wakes up one waiter. */
+  csp_mutex_lock(&mutex);
+  atomic_store(&tokens, 1);
+  csp_mutex_unlock(&mutex);
+  csp_proc_cond_signal(&cond);
+  while (atomic_load(&woken) < 1) {}
+  assert(csp_waitq_len(&cond.waiters) == NTHREADS - 1);
+
+  /* Broadcast wakes up the others. */
+  csp_mutex_lock(&mutex);
+  atomic_store(&tokens, NTHREADS - 1);
+  csp_mutex_unlock(&mutex);
+  csp_proc_cond_broadcast(&cond);
+  join_all();
+  assert(atomic_load(&woken) == NTHREADS);
+  assert(atomic_load(&tokens) == 0);
+  assert(csp_waitq_len(&cond.waiters) == 0);
+}
+
+#define NRACES 100
+
+atomic_bool waiting, signaling;
+
+/* The waiter hands the mutex over to us in `csp_proc_cond_wait`, hold it there
+ * until we are signaling. */
+void cond_hold_waiter(csp_proc_t *proc) {
+  if (proc == &self.proc) {
+    while (!atomic_load(&signaling)) {}
+    usleep(100);
+  }
+}
+
+void cond_consume_race(void) {
+  for (int i = 0; i < NRACES; i++) {
+    csp_mutex_lock(&mutex);
+    atomic_store(&waiting, true);
+    wait_parked(&mutex.waiters, 1);
+    while (atomic_load(&tokens) == 0) {
+      csp_proc_cond_wait(&cond, &mutex);
+    }
+    atomic_fetch_sub(&tokens, 1);
+    atomic_fetch_add(&woken, 1);
+    csp_mutex_unlock(&mutex);
+  }
+}
+
+void test_cond_race(void) {
+  csp_mutex_init(&mutex);
+  csp_proc_cond_init(&cond);
+  atomic_store(&tokens, 0);
+  atomic_store(&woken, 0);
+  tproc_unparked = cond_hold_waiter;
+
+  tproc_start(&ts[0], 1, cond_consume_race);
+  for (int i = 0; i < NRACES; i++) {
+    /* We get the mutex after the waiter unlocked it and signal while it's
+     * between the unlock and the park. The signal must not be lost. */
+    while (!atomic_load(&waiting)) {}
+    atomic_store(&waiting, false);
+    csp_mutex_lock(&mutex);
+    atomic_store(&tokens, 1);
+    csp_mutex_unlock(&mutex);
+    atomic_store(&signaling, true);
+    csp_proc_cond_signal(&cond);
+    atomic_store(&signaling, false);
+    while (atomic_load(&woken) < i + 1) {}
+  }
+  pthread_join(ts[0].tid, NULL);
+  tproc_unparked = NULL;
+  assert(atomic_load(&tokens) == 0);
+  assert(csp_waitq_len(&cond.waiters) == 0);
+}
+
+void sema_acquire(void) {
+  csp_sema_acquire(&sema);
+  atomic_fetch_add(&woken, 1);
+}
+
+void test_sema(void) {
+  csp_sema_init(&sema, 1);
+  atomic_store(&woken, 0);
+
+  assert(csp_sema_try_acquire(&sema));
+  assert(!csp_sema_try_acquire(&sema));
+
+  start_all(sema_acquire);
+  wait_parked(&sema.waiters, NTHREADS);
+
+  /* The permit is handed over to a waiter instead of being counted. */
+  csp_sema_release(&sema);
+  while (atomic_load(&woken) < 1) {}
+  assert(atomic_load(&sema.permits) == 0);
+  assert(csp_waitq_len(&sema.waiters) == NTHREADS - 1);
+
+  for (int i = 0; i < NTHREADS; i++) {
+    csp_sema_release(&sema);
+  }
+  join_all();
+  assert(atomic_load(&woken) == NTHREADS);
+  assert(atomic_load(&sema.permits) == 1);
+}
+
+void wg_wait(void) {
+  csp_wg_wait(&wg);
+  assert(atomic_load(&wg.cnt) == 0);
+  atomic_fetch_add(&woken, 1);
+}
+
+void test_wg(void) {
+  csp_wg_init(&wg);
+  atomic_store(&woken, 0);
+
+  /* Wait for nothing returns at once. */
+  csp_wg_wait(&wg);
+
+  csp_wg_add(&wg, 2);
+  start_all(wg_wait);
+  wait_parked(&wg.waiters, NTHREADS);
+
+  /* The waiters are woken up only when the counter crosses zero. */
+  csp_wg_done(&wg);
+  csp_wg_add(&wg, 1);
+  csp_wg_done(&wg);
+  usleep(1000);
+  assert(atomic_load(&woken) == 0);
+  assert(csp_waitq_len(&wg.waiters) == NTHREADS);
+
+  csp_wg_done(&wg);
+  join_all();
+  assert(atomic_load(&woken) == NTHREADS);
+  assert(csp_waitq_len(&wg.waiters) == 0);
+}
+
+void once_fn(void) {
+  usleep(10000);
+  atomic_fetch_add(&calls, 1);
+}
+
+void once_call(void) {
+  csp_once(&once, once_fn);
+  assert(atomic_load(&calls) == 1);
+  atomic_fetch_add(&woken, 1);
+}
+
+void test_once(void) {
+  atomic_store(&calls, 0);
+  atomic_store(&woken, 0);
+
+  /* The concurrent callers wait for the running one and return after it. */
+  start_all(once_call);
+  join_all();
+  assert(atomic_load(&calls) == 1);
+  assert(atomic_load(&woken) == NTHREADS);
+  assert(atomic_load(&once.stat) == csp_once_stat_done);
+
+  csp_once(&once, once_fn);
+  assert(atomic_load(&calls) == 1);
+}
+
+csp_rwlock_t rwlock;
+atomic_int stage, shared;
+
+/* Wait until the main thread moves to `n`. */
+#define wait_stage(n) while (atomic_load(&stage) < (n)) {}
+
+void rwlock_read_and_migrate(void) {
+  csp_rwlock_rdlock(&rwlock);
+  atomic_fetch_add(&woken, 1);
+  wait_stage(1);
+
+  /* Pretend that the proc has moved to another CPU processor. */
+  csp_this_core->pid = 1;
+  csp_rwlock_rdunlock(&rwlock);
+}
+
+void rwlock_write(void) {
+  csp_rwlock_wrlock(&rwlock);
+  atomic_store(&shared, 1);
+  wait_stage(2);
+  csp_rwlock_wrunlock(&rwlock);
+}
+
+void rwlock_read(void) {
+  csp_rwlock_rdlock(&rwlock);
+  assert(atomic_load(&shared) == 1);
+  atomic_fetch_add(&woken, 1);
+  csp_rwlock_rdunlock(&rwlock);
+}
+
+void test_rwlock(void) {
+  assert(csp_rwlock_init(&rwlock));
+  atomic_store(&woken, 0);
+  atomic_store(&stage, 0);
+  atomic_store(&shared, 0);
+
+  /* The readers share the lock. */
+  csp_rwlock_rdlock(&rwlock);
+  tproc_start(&ts[0], 0, rwlock_read_and_migrate);
+  while (atomic_load(&woken) < 1) {}
+  csp_rwlock_rdunlock(&rwlock);
+
+  /* The writer waits for the reader. */
+  tproc_start(&ts[1], 1, rwlock_write);
+  csp_proc_t *writer = NULL;
+  while (writer == NULL) {
+    csp_spinlock_lock(&rwlock.lock);
+    writer = rwlock.writer;
+    csp_spinlock_unlock(&rwlock.lock);
+  }
+  assert(writer == &ts[1].proc);
+  assert(atomic_load(&shared) == 0);
+
+  /* The reader unlocks it on another CPU processor and wakes up the writer,
+   * the counters only make sense in total. */
+  atomic_store(&stage, 1);
+  while (atomic_load(&shared) == 0) {}
+  assert(atomic_load(&rwlock.readers[0].n) == 1);
+  assert(atomic_load(&rwlock.readers[1].n) == -1);
+  assert(rwlock.writer == NULL);
+
+  /* The new readers wait for the writer to leave. */
+  tproc_start(&ts[2], 0, rwlock_read);
+  wait_parked(&rwlock.waiters, 1);
+  atomic_store(&stage, 2);
+
+  for (int i = 0; i < 3; i++) {
+    pthread_join(ts[i].tid, NULL);
+  }
+  assert(atomic_load(&woken) == 2);
+  assert(!atomic_load(&rwlock.writing));
+  assert(csp_waitq_len(&rwlock.waiters) == 0);
+  csp_rwlock_destroy(&rwlock);
+}
+
+int main(void) {
+  tproc_init(&self, 0);
+  csp_this_core = &self.core;
+
+  test_cond();
+  test_cond_race();
+  test_sema();
+  test_wg();
+  test_once();
+  test_rwlock();
+}
@@ -29,6 +29,7 @@ _Thread_local csp_core_t *csp_this_core = &(csp_core_t){.pid = 0};
 
 void csp_sched_yield(void) {}
 void csp_core_proc_exit(void) {}
+void csp_monitor_notify(size_t pid, csp_timer_time_t when) {}
 
 csp_proc_t *start, *end;
 
@@ -40,115 +41,166 @@ void put_proc(csp_proc_t *proc) {
   csp_proc_destroy(proc);
 }
 
-void test_timer_events(void) {
-  csp_timer_heap_t heap;
-  assert(csp_timer_heap_init(&heap, 0));
+#define tick(n) ((csp_timer_time_t)(n) << csp_timer_wheel_tick_exp)
 
-  csp_proc_t *proc1 = get_proc();
-  proc1->timer.when = 100;
-  csp_timer_heap_put(&heap, proc1);
-  assert(heap.len == 1);
-  assert(heap.token == 1);
-  assert(heap.procs[0] == proc1);
-  assert(proc1->timer.idx == 0);
-  assert(proc1->timer.token == 0);
+csp_proc_t *put_timer(csp_timer_wheel_t *wheel, csp_timer_time_t when) {
+  csp_proc_t *proc = get_proc();
+  proc->timer.when = when;
+  csp_timer_wheel_put(wheel, proc);
+  return proc;
+}
 
-  csp_proc_t *proc2 = get_proc();
-  proc2->timer.when = 50;
-  csp_timer_heap_put(&heap, proc2);
-  assert(heap.len == 2);
-  assert(heap.token == 2);
-  assert(heap.procs[0] == proc2);
-  assert(heap.procs[1] == proc1);
-  assert(proc1->timer.idx == 1);
+void test_timer_wheel(void) {
+  csp_timer_wheel_t wheel;
+  assert(csp_timer_wheel_init(&wheel, 0));
+  wheel.tick = 0;
+
+  /* The expired timer is put to the next tick. */
+  csp_proc_t *proc1 = put_timer(&wheel, 0);
+  assert(wheel.len == 1);
+  assert(wheel.token == 1);
+  assert(wheel.slots[0][1] == proc1);
+  assert(wheel.bitmaps[0] == 0x02);
+  assert(proc1->timer.idx == csp_timer_wheel_idx(0, 1));
   assert(proc1->timer.token == 0);
-  assert(proc2->timer.idx == 0);
-  assert(proc2->timer.token == 1);
 
-  csp_proc_t *proc3 = get_proc();
-  proc3->timer.when = 150;
-  csp_timer_heap_put(&heap, proc3);
-  assert(heap.len == 3);
-  assert(heap.token == 3);
-  assert(heap.procs[0] == proc2);
-  assert(heap.procs[1] == proc1);
-  assert(heap.procs[2] == proc3);
-  assert(proc1->timer.idx == 1);
-  assert(proc1->timer.token == 0);
-  assert(proc2->timer.idx == 0);
+  /* The time is rounded up to the tick. */
+  csp_proc_t *proc2 = put_timer(&wheel, tick(63) + 1);
+  assert(wheel.slots[1][1] == proc2);
+  assert(proc2->timer.idx == csp_timer_wheel_idx(1, 1));
   assert(proc2->timer.token == 1);
-  assert(proc3->timer.idx == 2);
-  assert(proc3->timer.token == 2);
-
-  csp_timer_heap_del(&heap, proc2);
-  assert(heap.len == 2);
-  assert(heap.token == 3);
-  assert(heap.procs[0] == proc1);
-  assert(heap.procs[1] == proc3);
-  assert(proc1->timer.idx == 0);
-  assert(proc1->timer.token == 0);
-  assert(proc3->timer.idx == 1);
-  assert(proc3->timer.token == 2);
 
-  csp_timer_heap_del(&heap, proc1);
-  assert(heap.len == 1);
-  assert(heap.token == 3);
-  assert(heap.procs[0] == proc3);
-  assert(proc3->timer.idx == 0);
-  assert(proc3->timer.token == 2);
+  csp_proc_t *proc3 = put_timer(&wheel, tick(100));
+  assert(wheel.slots[1][1] == proc3);
+  assert(proc3->next == proc2);
+  assert(proc2->pre == proc3);
+  assert(wheel.bitmaps[1] == 0x02);
+
+  csp_proc_t *proc4 = put_timer(&wheel, INT64_MAX);
+  assert(wheel.slots[csp_timer_wheel_levels - 1][63] == proc4);
+  assert(wheel.len == 4);
+  assert(wheel.token == 4);
+
+  csp_timer_wheel_del(&wheel, proc3);
+  assert(wheel.slots[1][1] == proc2);
+  assert(proc2->pre == NULL);
+  assert(wheel.bitmaps[1] == 0x02);
+  csp_timer_wheel_del(&wheel, proc2);
+  assert(wheel.slots[1][1] == NULL);
+  assert(wheel.bitmaps[1] == 0);
+  assert(wheel.len == 2);
+
+  csp_timer_wheel_del(&wheel, proc1);
+  csp_timer_wheel_del(&wheel, proc4);
+  assert(wheel.len == 0);
+  assert(wheel.bitmaps[0] == 0);
+
+  put_proc(proc1);
+  put_proc(proc2);
+  put_proc(proc3);
+  put_proc(proc4);
+  csp_timer_wheel_destroy(&wheel);
+}
 
-  csp_timer_heap_del(&heap, proc3);
-  assert(heap.len == 0);
-  assert(heap.token == 3);
+void test_timer_wheel_get(void) {
+  csp_timer_wheel_t wheel;
+  assert(csp_timer_wheel_init(&wheel, 0));
+  wheel.tick = 0;
 
-  csp_timer_heap_destroy(&heap);
+  int64_t ticks[] = {1, 6, 64, 65, 4097, 300000, 1L << 40};
+  int len = sizeof(ticks) / sizeof(ticks[0]);
+  csp_proc_t *procs[len];
+  for (int i = 0; i < len; i++) {
+    procs[i] = put_timer(&wheel, tick(ticks[i]) - (i == 1));
+  }
+
+  for (int i = 0; i < len; i++) {
+    /* Never expire early. */
+    assert(csp_timer_wheel_get(&wheel, tick(ticks[i]) - 1, &start, &end) ==
+      0);
+    assert(csp_timer_wheel_get(&wheel, tick(ticks[i]), &start, &end) == 1);
+    assert(start == procs[i] && end == procs[i]);
+    assert(start->timer.token == -1);
+    assert(wheel.tick == ticks[i]);
+    assert(wheel.len == len - i - 1);
+  }
+
+  /* Batch expiry. */
+  for (int i = 0; i < len; i++) {
+    procs[i]->timer.when = tick(wheel.tick + ticks[i]);
+    csp_timer_wheel_put(&wheel, procs[i]);
+  }
+  csp_proc_t *far = put_timer(&wheel, INT64_MAX);
+  assert(csp_timer_wheel_get(&wheel, INT64_MAX, &start, &end) == len);
+  for (int i = 0; i < len; i++) {
+    assert(start == procs[i]);
+    start = start->next;
+  }
+  assert(wheel.len == 1);
+  csp_timer_wheel_del(&wheel, far);
+
+  for (int i = 0; i < len; i++) {
+    put_proc(procs[i]);
+  }
+  put_proc(far);
+  csp_timer_wheel_destroy(&wheel);
 }
 
-void test_timer_heaps(void) {
-  assert(csp_timer_heaps_init());
-  csp_timer_heaps_destroy();
+void test_timer_wheels(void) {
+  assert(csp_timer_wheels_init());
+  csp_timer_wheels_destroy();
 }
 
 void test_timer(void) {
-  csp_timer_heaps_init();
+  csp_timer_wheels_init();
+  csp_timer_wheel_t *wheel = &csp_timer_wheels.wheels[0];
+  int pids[] = {1, 0};
+  assert(csp_timer_deadline(pids, 2) == INT64_MAX);
 
   csp_proc_t *proc1 = get_proc();
   proc1->timer.when = 0;
   csp_timer_put(0, proc1);
-  assert(csp_timer_heaps.heaps[0].len == 1);
-  assert(csp_timer_heaps.heaps[0].token == 1);
-  assert(csp_timer_heaps.heaps[0].procs[0] == proc1);
+  assert(csp_timer_deadline(pids, 2) == tick(wheel->tick + 1));
+  assert(csp_timer_deadline(pids, 1) == INT64_MAX);
+  assert(wheel->len == 1);
+  assert(wheel->token == 1);
   assert(proc1->borned_pid == 0);
-  assert(proc1->timer.idx == 0);
   assert(proc1->timer.token == 0);
 
   csp_proc_t *proc2 = get_proc();
   proc2->timer.when = INT64_MAX;
   csp_timer_put(0, proc2);
-  assert(csp_timer_heaps.heaps[0].len == 2);
-  assert(csp_timer_heaps.heaps[0].token == 2);
-  assert(csp_timer_heaps.heaps[0].procs[0] == proc1);
+  assert(wheel->len == 2);
+  assert(wheel->token == 2);
   assert(proc2->borned_pid == 0);
-  assert(proc2->timer.idx == 1);
   assert(proc2->timer.token == 1);
 
+  csp_timer_time_t now = csp_timer_now() + tick(1);
   for (int i = 1; i < csp_sched_np; i++) {
-    assert(csp_timer_heap_get(&csp_timer_heaps.heaps[i], &start, &end) == 0);
+    csp_timer_wheel_t *other = &csp_timer_wheels.wheels[i];
+    assert(csp_timer_wheel_get(other, now, &start, &end) == 0);
   }
-  assert(csp_timer_heap_get(&csp_timer_heaps.heaps[0], &start, &end) == 1);
+  assert(csp_timer_wheel_get(wheel, now, &start, &end) == 1);
   assert(start == end);
   assert(start == proc1);
-  assert(csp_timer_heaps.heaps[0].len == 1);
-  assert(csp_timer_heaps.heaps[0].token == 2);
-  assert(csp_timer_heaps.heaps[0].procs[0] == proc2);
-  assert(csp_timer_heap_get(&csp_timer_heaps.heaps[0], &start, &end) == 0);
-
-  put_proc(proc2);
-  csp_timer_heaps_destroy();
+  assert(wheel->len == 1);
+  assert(wheel->token == 2);
+  assert(csp_timer_wheel_get(wheel, now, &start, &end) == 0);
+  assert(csp_timer_deadline(pids, 2) > now);
+
+  /* Cancel the timer. */
+  assert(!csp_timer_cancel((csp_timer_t){.ctx = proc1, .token = 0}));
+  assert(!csp_timer_cancel((csp_timer_t){.ctx = proc2, .token = 0}));
+  assert(csp_timer_cancel((csp_timer_t){.ctx = proc2, .token = 1}));
+  assert(wheel->len == 0);
+
+  put_proc(proc1);
+  csp_timer_wheels_destroy();
 }
 
 int main(void) {
-  test_timer_events();
-  test_timer_heaps();
+  test_timer_wheel();
+  test_timer_wheel_get();
+  test_timer_wheels();
   test_timer();
 }
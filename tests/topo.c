@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <unistd.h>
+#include "../src/topo.c"
+
+int csp_sched_np = 8;
+
+void test_read_list(void) {
+  char path[] = "/tmp/libcsp_topo_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  assert(write(fd, "0-2,5,7-8\n", 10) == 10);
+  close(fd);
+
+  cpu_set_t set;
+  assert(csp_topo_read_list(path, &set));
+  assert(CPU_COUNT(&set) == 6);
+  assert(CPU_ISSET(0, &set) && CPU_ISSET(1, &set) && CPU_ISSET(2, &set));
+  assert(!CPU_ISSET(3, &set) && !CPU_ISSET(4, &set));
+  assert(CPU_ISSET(5, &set) && !CPU_ISSET(6, &set));
+  assert(CPU_ISSET(7, &set) && CPU_ISSET(8, &set));
+
+  unlink(path);
+  assert(!csp_topo_read_list(path, &set));
+}
+
+void test_build(void) {
+  /* Two nodes and the CPUs are interleaved. */
+  int nodes[] = {0, 1, 0, 1, 0, 1, 0, 1}, distances[] = {10, 21, 21, 10};
+  int unknown[] = {-1, -1, -1, -1, -1, -1, -1, -1};
+
+  csp_topo.np = 8;
+  csp_topo.nnodes = 2;
+  csp_topo.nodes = nodes;
+  csp_topo.distances = distances;
+  csp_topo.l2s = csp_topo.l3s = csp_topo.packages = unknown;
+  assert(csp_topo_build());
+
+  assert(csp_topo.node_starts[0] == 0);
+  assert(csp_topo.node_starts[1] == 4);
+  assert(csp_topo.node_starts[2] == 8);
+  for (int i = 0; i < 4; i++) {
+    assert(csp_topo.node_pids[i] == i * 2);
+    assert(csp_topo.node_pids[i + 4] == i * 2 + 1);
+  }
+
+  int *order = csp_topo_steal_order(2), *ends = csp_topo_steal_ends(2);
+  int expected_order[] = {4, 6, 0, 3, 5, 7, 1};
+  int expected_ends[] = {3, 3, 3, 7, 7, 7, 7};
+  for (int i = 0; i < 7; i++) {
+    assert(order[i] == expected_order[i]);
+    assert(ends[i] == expected_ends[i]);
+  }
+
+  free(csp_topo.node_starts);
+  free(csp_topo.node_pids);
+  free(csp_topo.steal_orders);
+  free(csp_topo.steal_ends);
+}
+
+void test_build_levels(void) {
+  /* One node, the L2 caches are shared by pairs and the L3 ones by quads. */
+  int nodes[] = {0, 0, 0, 0, 0, 0, 0, 0}, distances[] = {10};
+  int l2s[] = {0, 0, 2, 2, 4, 4, 6, 6}, l3s[] = {0, 0, 0, 0, 4, 4, 4, 4};
+  int packages[] = {0, 0, 0, 0, 0, 0, 1, 1};
+
+  csp_topo.np = 8;
+  csp_topo.nnodes = 1;
+  csp_topo.nodes = nodes;
+  csp_topo.distances = distances;
+  csp_topo.l2s = l2s;
+  csp_topo.l3s = l3s;
+  csp_topo.packages = packages;
+  assert(csp_topo_build());
+
+  int *order = csp_topo_steal_order(0), *ends = csp_topo_steal_ends(0);
+  int expected_order[] = {1, 2, 3, 4, 5, 6, 7};
+  int expected_ends[] = {1, 3, 3, 5, 5, 7, 7};
+  for (int i = 0; i < 7; i++) {
+    assert(order[i] == expected_order[i]);
+    assert(ends[i] == expected_ends[i]);
+  }
+
+  order = csp_topo_steal_order(5);
+  ends = csp_topo_steal_ends(5);
+  int expected_order5[] = {4, 6, 7, 0, 1, 2, 3};
+  int expected_ends5[] = {1, 3, 3, 7, 7, 7, 7};
+  for (int i = 0; i < 7; i++) {
+    assert(order[i] == expected_order5[i]);
+    assert(ends[i] == expected_ends5[i]);
+  }
+
+  free(csp_topo.node_starts);
+  free(csp_topo.node_pids);
+  free(csp_topo.steal_orders);
+  free(csp_topo.steal_ends);
+}
+
+void test_init(void) {
+  assert(csp_topo_init());
+  assert(csp_topo.np == csp_sched_np);
+  assert(csp_topo.nnodes >= 1);
+  for (int pid = 0; pid < csp_topo.np; pid++) {
+    assert(csp_topo_node(pid) < csp_topo.nnodes);
+  }
+  csp_topo_destroy();
+}
+
+int main(void) {
+  test_read_list();
+  test_build();
+  test_build_levels();
+  test_init();
+}
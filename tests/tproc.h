@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_TESTS_TPROC_H
+#define LIBCSP_TESTS_TPROC_H
+
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+
+/* It's included after the sources under test, which define `csp_proc_t` and
+ * `csp_core_t`. */
+
+/* A thread pretending to be a proc, it's parked on its semaphore. */
+typedef struct {
+  csp_proc_t proc;
+  csp_core_t core;
+  sem_t sem;
+  pthread_t tid;
+  void (*fn)(void);
+} tproc_t;
+
+_Thread_local csp_core_t *csp_this_core;
+
+void csp_sched_yield(void) {}
+
+void csp_sched_park(void (*fn)(void *), void *arg) {
+  tproc_t *self = (tproc_t *)csp_this_core->running;
+  fn(arg);
+  sem_wait(&self->sem);
+}
+
+/* Called after a proc is unparked if it's set, the tests use it to stop the
+ * waker at a given point. */
+void (*tproc_unparked)(csp_proc_t *proc);
+
+void csp_sched_unpark(csp_proc_t *proc) {
+  sem_post(&((tproc_t *)proc)->sem);
+  if (tproc_unparked != NULL) {
+    tproc_unparked(proc);
+  }
+}
+
+void tproc_init(tproc_t *t, size_t pid) {
+  memset(t, 0, sizeof(tproc_t));
+  sem_init(&t->sem, 0, 0);
+  t->core.pid = pid;
+  t->core.running = &t->proc;
+}
+
+void *tproc_main(void *data) {
+  tproc_t *t = (tproc_t *)data;
+  csp_this_core = &t->core;
+  t->fn();
+  return NULL;
+}
+
+void tproc_start(tproc_t *t, size_t pid, void (*fn)(void)) {
+  tproc_init(t, pid);
+  t->fn = fn;
+  assert(pthread_create(&t->tid, NULL, tproc_main, t) == 0);
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#define csp_enable_trace
+
+#include <assert.h>
+#include "../src/trace.c"
+
+int csp_sched_np = 2;
+size_t csp_max_threads = 2;
+const char *csp_procs_name[] = {"main", "worker"};
+_Thread_local csp_core_t *csp_this_core;
+
+void test_trace(void) {
+  assert(csp_trace_init());
+
+  csp_core_t core = {.pid = 1};
+  csp_proc_t p1, p2;
+  csp_this_core = &core;
+
+  csp_trace(csp_trace_event_create, &p1, 1);
+  csp_trace_run(&p1);
+  csp_trace_stop(csp_trace_event_yield);
+  csp_trace_run(&p2);
+  csp_trace_stop(csp_trace_event_exit);
+
+  /* Stopping again records nothing cause no process is running. */
+  csp_trace_stop(csp_trace_event_yield);
+
+  csp_trace_ring_t *ring = csp_trace_this_ring;
+  assert(ring != NULL && ring->pid == 1);
+  assert(atomic_load(&ring->len) == 5);
+  assert(ring->events[0].type == csp_trace_event_create);
+  assert(ring->events[0].arg == 1);
+  assert(ring->events[2].type == csp_trace_event_yield);
+  assert(ring->events[2].proc == (uintptr_t)&p1);
+  assert(ring->events[4].type == csp_trace_event_exit);
+  assert(ring->events[4].proc == (uintptr_t)&p2);
+  assert(ring->events[3].tsc >= ring->events[1].tsc);
+
+  /* The oldest events are overwritten when the ring is full, and the oldest
+   * one we can copy is dropped cause its slot is the next to write. */
+  csp_trace_event_t *events = (csp_trace_event_t *)malloc(
+    sizeof(csp_trace_event_t) * csp_trace_ring_cap
+  );
+  assert(events != NULL);
+  for (int i = 0; i < csp_trace_ring_cap; i++) {
+    csp_trace(csp_trace_event_steal, &p1, i);
+  }
+  assert(csp_trace_ring_copy(ring, events) == csp_trace_ring_cap - 1);
+  assert(events[0].type == csp_trace_event_steal && events[0].arg == 1);
+  assert(events[csp_trace_ring_cap - 2].arg == csp_trace_ring_cap - 1);
+  free(events);
+
+  char *buf;
+  size_t size;
+  FILE *fp = open_memstream(&buf, &size);
+  assert(fp != NULL);
+  csp_trace_dump(fp);
+  fclose(fp);
+  assert(buf[0] == '{' && strstr(buf, "\"name\":\"core 0\"") != NULL);
+  assert(strcmp(buf + size - 4, "\n]}\n") == 0);
+  free(buf);
+}
+
+int main(void) {
+  test_trace();
+}